@@ -0,0 +1,259 @@
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./FixedStep.h"
+#include "./Options.h"
+#include "./Physics.h"
+#include "./Stepper.h"
+
+inline const char* integratorName(const Options::Integrator integrator) {
+  switch (integrator) {
+    case Options::RKF45: return "rkf45";
+    case Options::TAYLOR: return "taylor";
+    default: return "rk8pd";
+  }
+}
+
+// A run of a fixed length used to measure cost against accuracy.
+struct Scenario {
+  std::string name;
+  Dipole d;
+  Options::Dynamics dynamics;
+  // Length of the run
+  double T;
+};
+
+// Cost and accuracy of one scenario with one stepper setting.
+struct BenchmarkRun {
+  std::string scenario;
+  Options::Integrator integrator;
+  // Fixed step scheme if fixed_h, else GSL
+  Options::FixedScheme scheme;
+  double eps;
+  double h;
+  bool fixed_h;
+  // False if the setting cannot run the scenario, e.g. a fixed step size
+  // with collisions
+  bool ok;
+  long numSteps;
+  long numEvaluations;
+  // Wall time of one run
+  double seconds;
+  // Final energy error and largest difference of any state variable from
+  // the reference trajectory. For taylor an evaluation is one expansion
+  // of the series, which costs O(order^2) operations.
+  double dE;
+  double error;
+  // Estimated error of the reference itself; see WorkPrecision
+  double referenceError;
+
+  // The integrator, or the fixed step scheme if not GSL
+  const char* method() const {
+    return (scheme == Options::GSL) ?
+        integratorName(integrator) : FixedStep::name(scheme);
+  }
+
+  std::string key() const {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s %s %g %g %d", scenario.c_str(),
+             method(), eps, h, fixed_h ? 1 : 0);
+    return buf;
+  }
+};
+
+// Work-precision measurements. The reference trajectory of a scenario is
+// rk8pd at eps = 1e-14, started with a tenth of the usual step. It is
+// checked against an independent taylor run at eps = 1e-16, and their
+// difference is reported with every run as the reference error: errors
+// below it are not resolved. Collisions are handled as in doSimulation,
+// so collision location error is part of the measured error.
+class WorkPrecision {
+ public:
+  struct Reference {
+    Dipole d;
+    // Largest difference of any state variable from the taylor check
+    double error;
+  };
+
+  // Each run is repeated until minSeconds have passed to time it.
+  explicit WorkPrecision(const double minSeconds) : _minSeconds(minSeconds) {}
+
+  static Reference reference(const Scenario& s) {
+    return reference(s, s.T);
+  }
+
+  static Reference reference(const Scenario& s, const double T) {
+    Stepper stepper(s.d, o.h / 10, false, 1e-14, s.dynamics, Options::RK8PD);
+    stepper.advance(T, []() {}, []() {});
+    Stepper check(s.d, o.h, false, 1e-16, s.dynamics, Options::TAYLOR);
+    check.advance(T, []() {}, []() {});
+    Reference ref;
+    ref.d = stepper.d;
+    ref.error = distance(stepper.d, check.d);
+    return ref;
+  }
+
+  BenchmarkRun run(const Scenario& s, const Reference& ref,
+                   const Options::Integrator integrator, const double eps,
+                   const double h, const bool fixed_h,
+                   const Options::FixedScheme scheme = Options::GSL) const {
+    typedef std::chrono::steady_clock Clock;
+    BenchmarkRun r;
+    r.scenario = s.name;
+    r.integrator = integrator;
+    r.eps = eps;
+    r.h = h;
+    r.fixed_h = fixed_h;
+    r.scheme = fixed_h ? scheme : Options::GSL;
+    r.ok = true;
+    r.numSteps = r.numEvaluations = 0;
+    r.seconds = r.dE = r.error = NAN;
+    r.referenceError = ref.error;
+
+    const Clock::time_point start = Clock::now();
+    int numRuns = 0;
+    double seconds = 0;
+    Dipole d;
+    double t = s.T;
+    try {
+      while (numRuns == 0 || seconds < _minSeconds) {
+        Stepper stepper(s.d, h, fixed_h, eps, s.dynamics, integrator,
+                        r.scheme);
+        if (r.scheme != Options::GSL && s.dynamics == Options::SLIDING) {
+          // No collisions, so the steps are taken in one batch that ends
+          // on T
+          r.numSteps = std::max(1L, lround(s.T / h));
+          stepper.steps(r.numSteps);
+        } else {
+          r.numSteps = stepper.advance(s.T, []() {}, []() {});
+        }
+        r.numEvaluations = stepper.numEvaluations();
+        d = stepper.d;
+        t = stepper.t;
+        ++numRuns;
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      }
+    } catch (std::logic_error& e) {
+      r.ok = false;
+      return r;
+    }
+    r.seconds = seconds / numRuns;
+    r.dE = d.get_dE();
+    // Fixed steps overshoot T, so compare with the reference at the end
+    // of the last step
+    if (t == s.T) {
+      r.error = distance(d, ref.d);
+    } else {
+      const Reference end = reference(s, t);
+      r.error = distance(d, end.d);
+      r.referenceError = end.error;
+    }
+    return r;
+  }
+
+  static void writeCsvHeader(FILE* out) {
+    fprintf(out, "scenario, integrator, eps, h, fixed_h, ok, steps, "
+            "evaluations, seconds, dE, error, reference_error\n");
+  }
+
+  static void writeCsv(FILE* out, const BenchmarkRun& r) {
+    fprintf(out, "%s, %s, %g, %g, %d, %d, %ld, %ld, %e, %e, %e, %e\n",
+            r.scenario.c_str(), r.method(), r.eps, r.h,
+            r.fixed_h ? 1 : 0, r.ok ? 1 : 0, r.numSteps, r.numEvaluations,
+            r.seconds, r.dE, r.error, r.referenceError);
+  }
+
+  static void writeJson(FILE* out, const std::vector<BenchmarkRun>& runs) {
+    fprintf(out, "[");
+    for (int i = 0; i < runs.size(); ++i) {
+      const BenchmarkRun& r = runs[i];
+      fprintf(out, "%s\n{\"scenario\":\"%s\",\"integrator\":\"%s\","
+              "\"eps\":%g,\"h\":%g,\"fixed_h\":%s,\"ok\":%s",
+              i ? "," : "", r.scenario.c_str(), r.method(),
+              r.eps, r.h, r.fixed_h ? "true" : "false", r.ok ? "true" : "false");
+      if (r.ok) {
+        fprintf(out, ",\"steps\":%ld,\"evaluations\":%ld,\"seconds\":%e,"
+                "\"dE\":%e,\"error\":%e,\"referenceError\":%e",
+                r.numSteps, r.numEvaluations, r.seconds, r.dE, r.error,
+                r.referenceError);
+      }
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n]\n");
+  }
+
+  // Reads runs written by writeCsv. Files from before the reference_error
+  // column have a reference error of 0.
+  static std::vector<BenchmarkRun> readCsv(const std::string& filename) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+      throw std::logic_error("Unable to open " + filename);
+    }
+    std::vector<BenchmarkRun> runs;
+    std::string line;
+    getline(in, line);
+    while (getline(in, line)) {
+      std::vector<std::string> f;
+      std::stringstream ss(line);
+      std::string field;
+      while (getline(ss, field, ',')) {
+        const size_t b = field.find_first_not_of(' ');
+        f.push_back(b == std::string::npos ? "" : field.substr(b));
+      }
+      if (f.size() != 11 && f.size() != 12) continue;
+      BenchmarkRun r;
+      r.scenario = f[0];
+      r.integrator = (f[1] == "taylor") ? Options::TAYLOR :
+          (f[1] == "rkf45") ? Options::RKF45 : Options::RK8PD;
+      r.scheme = Options::GSL;
+      for (int j = Options::RK4; j <= Options::SYMPLECTIC8; ++j) {
+        if (f[1] == FixedStep::name((Options::FixedScheme)j)) {
+          r.scheme = (Options::FixedScheme)j;
+        }
+      }
+      r.eps = atof(f[2].c_str());
+      r.h = atof(f[3].c_str());
+      r.fixed_h = (f[4] == "1");
+      r.ok = (f[5] == "1");
+      r.numSteps = atol(f[6].c_str());
+      r.numEvaluations = atol(f[7].c_str());
+      r.seconds = atof(f[8].c_str());
+      r.dE = atof(f[9].c_str());
+      r.error = atof(f[10].c_str());
+      r.referenceError = (f.size() > 11) ? atof(f[11].c_str()) : 0;
+      runs.push_back(r);
+    }
+    return runs;
+  }
+
+  static double distance(const Dipole& a, const Dipole& b) {
+    const double* ya = (const double*)(&a);
+    const double* yb = (const double*)(&b);
+    double m = 0;
+    for (int i = 0; i < 6; ++i) {
+      double diff = ya[i] - yb[i];
+      if (i == 1 || i == 2) {
+        diff = Physics::normalizeAngle(diff);
+      }
+      m = std::max(m, fabs(diff));
+    }
+    return m;
+  }
+
+ private:
+  const double _minSeconds;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Ensemble.h"
+#include "./Options.h"
+
+// Sparse checkpoints of a single run, so that a cheap run that writes only
+// its events can later be replayed over a window of events at full
+// resolution (--replay). A checkpoint is taken at the end of the step in
+// which every n-th event occurs and holds what doSimulation needs to
+// continue the run: the state, time, next step size, step and event
+// counts and whether the step ended at a collision. Continuing from a
+// checkpoint with the same options gives the same trajectory, step for
+// step, as the original run.
+//
+// The file is text:
+//   # magphyx-checkpoints 1
+//   config <Checkpoints::config>
+//   every <n>
+//   checkpoint <events> <steps> <t> <h> <atCollision> <r> <theta> <phi>
+//       <pr> <ptheta> <pphi> <E0>
+//   end <events> <steps>
+// one checkpoint line per checkpoint, with doubles in %a so that they are
+// read back exactly, and an end line with the final counts if the run
+// finished. The run from the initial condition is checkpoint 0 and is not
+// written.
+class Checkpoints {
+ public:
+  static const int VERSION = 1;
+
+  // The options that determine the trajectory and its event numbering.
+  // Output options such as -s and --sampleDt may differ on replay.
+  static std::string config(const Dipole& ic,
+                            const Options::Dynamics dynamics) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "ic %a %a %a %a %a %a dynamics %d h %a fixed_h %d eps %a "
+             "integrator %d scheme %d",
+             ic.get_r(), ic.get_theta(), ic.get_phi(), ic.get_pr(),
+             ic.get_ptheta(), ic.get_pphi(), (int)dynamics, o.h,
+             (int)o.fixed_h, o.eps, (int)o.integrator, (int)o.fixedScheme);
+    std::string s = buf;
+    s += " events";
+    for (int i = 0; i < o.events.size(); ++i) {
+      s += " " + o.events[i].name() + ":" +
+          std::to_string((int)o.events[i].direction());
+    }
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      s += " layout " + layout->signature();
+    }
+    return s;
+  }
+
+  // Whether runs with the current options can be checkpointed: energy
+  // projection changes the trajectory by state that is not kept, and
+  // single-step runs do not count events.
+  static bool checkpointable() {
+    return o.projectEvery == 0 && o.sampleDt == 0 &&
+        o.singleStep == Options::NONE;
+  }
+
+  // Reads the checkpoints of filename, which must have been written with
+  // config.
+  Checkpoints(const std::string& filename, const std::string& config)
+      : _endEvents(-1), _endSteps(-1) {
+    FILE* in = fopen(filename.c_str(), "r");
+    if (!in) {
+      throw std::logic_error("Unable to open " + filename);
+    }
+    char line[4096];
+    int version = 0;
+    bool ok = (fgets(line, sizeof(line), in) &&
+               sscanf(line, "# magphyx-checkpoints %d", &version) == 1 &&
+               version == VERSION);
+    ok = ok && fgets(line, sizeof(line), in) &&
+        std::string(line) == "config " + config + "\n";
+    ok = ok && fgets(line, sizeof(line), in) &&
+        sscanf(line, "every %d", &_every) == 1;
+    if (!ok) {
+      fclose(in);
+      throw std::logic_error(filename + " is not a checkpoint file of a run "
+                             "with these initial conditions and options");
+    }
+    while (fgets(line, sizeof(line), in)) {
+      if (sscanf(line, "end %d %ld", &_endEvents, &_endSteps) == 2) {
+        break;
+      }
+      RunResult r;
+      double y[7];
+      int atCollision;
+      if (sscanf(line, "checkpoint %d %ld %la %la %d %la %la %la %la %la %la "
+                 "%la", &r.numEvents, &r.numSteps, &r.t, &r.h, &atCollision,
+                 &y[0], &y[1], &y[2], &y[3], &y[4], &y[5], &y[6]) != 12) {
+        // A run stopped while writing leaves a partial last line
+        break;
+      }
+      // Dipole's constructor takes E0 from the state; restore the original
+      r.d = Dipole(y[0], y[1], y[2], y[3], y[4], y[5]);
+      r.d.set_E0(y[6]);
+      r.atCollision = (atCollision != 0);
+      r.fate = RecurrenceDetector::UNRESOLVED;
+      r.period = 0;
+      _checkpoints.push_back(r);
+    }
+    fclose(in);
+  }
+
+  int every() const { return _every; }
+
+  // Whether the run finished, and its final event and step counts if so
+  bool finished() const { return _endSteps >= 0; }
+  int endEvents() const { return _endEvents; }
+  long endSteps() const { return _endSteps; }
+
+  // The last checkpoint before event number a (counting from 1), or 0 if
+  // the run must be replayed from its initial condition.
+  const RunResult* before(const int a) const {
+    const RunResult* best = 0;
+    for (int i = 0; i < _checkpoints.size(); ++i) {
+      if (_checkpoints[i].numEvents < a) best = &_checkpoints[i];
+    }
+    return best;
+  }
+
+ private:
+  int _every;
+  std::vector<RunResult> _checkpoints;
+  int _endEvents;
+  long _endSteps;
+};
+
+// Writes the checkpoints of a run as it goes.
+class CheckpointWriter {
+ public:
+  CheckpointWriter(const std::string& filename, const std::string& config,
+                   const int every)
+      : _filename(filename), _every(std::max(1, every)), _next(_every) {
+    _file = fopen(filename.c_str(), "w");
+    if (!_file) {
+      throw std::logic_error("Unable to open " + filename);
+    }
+    fprintf(_file, "# magphyx-checkpoints %d\n", Checkpoints::VERSION);
+    fprintf(_file, "config %s\n", config.c_str());
+    fprintf(_file, "every %d\n", _every);
+  }
+
+  ~CheckpointWriter() {
+    fclose(_file);
+  }
+
+  // Called at the end of every step of the run, with the step and event
+  // counts so far.
+  void step(const Dipole& d, const double t, const double h,
+            const long numSteps, const int numEvents,
+            const bool atCollision) {
+    if (numEvents < _next) return;
+    fprintf(_file, "checkpoint %d %ld %a %a %d %a %a %a %a %a %a %a\n",
+            numEvents, numSteps, t, h, (int)atCollision, d.get_r(),
+            d.get_theta(), d.get_phi(), d.get_pr(), d.get_ptheta(),
+            d.get_pphi(), d.get_E0());
+    // Flushed so that an interrupted run keeps its checkpoints
+    fflush(_file);
+    while (_next <= numEvents) _next += _every;
+  }
+
+  // Called once when the run has finished, with its final counts.
+  void finish(const long numSteps, const int numEvents) {
+    fprintf(_file, "end %d %ld\n", numEvents, numSteps);
+    fflush(_file);
+  }
+
+  const std::string& filename() const { return _filename; }
+
+ private:
+  // disallow copies because destructor closes file
+  CheckpointWriter(const CheckpointWriter&);
+  void operator=(const CheckpointWriter&);
+
+ private:
+  const std::string _filename;
+  const int _every;
+  // Events at which the next checkpoint is due
+  int _next;
+  FILE* _file;
+};
+
+#endif
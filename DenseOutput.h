@@ -0,0 +1,113 @@
+#ifndef __DENSE_OUTPUT_H__
+#define __DENSE_OUTPUT_H__
+
+#include "./Dipole.h"
+#include "./Physics.h"
+
+// Resamples an adaptive trajectory at the uniform times 0, dt, 2dt, ...
+// Each accepted step [t0, t1] is given a continuous extension by quintic
+// Hermite interpolation of the state, its first derivative (Eqs. 52-57)
+// and its second derivative (jacobian times first derivative) at both
+// ends. The extension is O(h^6) accurate, so samples are much closer to
+// the integrator's own accuracy than linear or cubic interpolation would
+// be.
+class DenseOutput {
+ public:
+  DenseOutput(const double dt) : _dt(dt), _k(0), _t0(0) {}
+
+  // Starts a new interval at (d, t) without emitting samples. Used at the
+  // start of a run and after discontinuities such as a reflection.
+  void restart(const Dipole& d, const double t) {
+    _t0 = t;
+    load(d, _y0, _f0, _a0);
+  }
+
+  // Skips the samples before t, for output that starts partway into a
+  // run.
+  void skipTo(const double t) {
+    const int k = (int)ceil(t / _dt);
+    if (k > _k) _k = k;
+  }
+
+  // Adds the state at the end of an accepted step and calls
+  // emit(sample, t) for every sample time in the step, up to maxSamples.
+  // Returns the number of samples emitted.
+  template <typename Emit>
+  int add(const Dipole& d, const double t, const int maxSamples, Emit emit) {
+    double y1[6], f1[6], a1[6];
+    load(d, y1, f1, a1);
+    // theta and phi are kept in [-180, 180] by the caller. Undo any wrap
+    // so that the interpolant is continuous.
+    for (int i = 1; i <= 2; ++i) {
+      y1[i] += 2*M_PI * floor((_y0[i] - y1[i]) / (2*M_PI) + 0.5);
+    }
+
+    const double h = t - _t0;
+    int count = 0;
+    while (count < maxSamples && _k * _dt <= t) {
+      const double ts = _k * _dt;
+      const double s = (h > 0) ? (ts - _t0) / h : 1;
+      const double s2 = s*s, s3 = s2*s, s4 = s3*s, s5 = s4*s;
+      const double h00 = 1 - 10*s3 + 15*s4 - 6*s5;
+      const double h10 = s - 6*s3 + 8*s4 - 3*s5;
+      const double h20 = (s2 - 3*s3 + 3*s4 - s5) / 2;
+      const double h01 = 10*s3 - 15*s4 + 6*s5;
+      const double h11 = -4*s3 + 7*s4 - 3*s5;
+      const double h21 = (s3 - 2*s4 + s5) / 2;
+      double y[6];
+      for (int i = 0; i < 6; ++i) {
+        y[i] = h00*_y0[i] + h10*h*_f0[i] + h20*h*h*_a0[i] +
+            h01*y1[i] + h11*h*f1[i] + h21*h*h*a1[i];
+      }
+      // Copy to keep d's initial energy for dE
+      Dipole sample = d;
+      sample.set_r(y[0]);
+      sample.set_theta(Physics::normalizeAngle(y[1]));
+      sample.set_phi(Physics::normalizeAngle(y[2]));
+      sample.set_pr(y[3]);
+      sample.set_ptheta(y[4]);
+      sample.set_pphi(y[5]);
+      emit(sample, ts);
+      ++_k;
+      ++count;
+    }
+
+    _t0 = t;
+    for (int i = 0; i < 6; ++i) {
+      _y0[i] = y1[i];
+      _f0[i] = f1[i];
+      _a0[i] = a1[i];
+    }
+    return count;
+  }
+
+ private:
+  // State y, first derivative f and second derivative a of d.
+  static void load(const Dipole& d, double y[], double f[], double a[]) {
+    const double* dy = (const double*)(&d);
+    for (int i = 0; i < 6; ++i) {
+      y[i] = dy[i];
+    }
+    Physics::get_derivatives(d, f);
+    double J[36];
+    Physics::get_jacobian(d, J);
+    for (int i = 0; i < 6; ++i) {
+      a[i] = 0;
+      for (int j = 0; j < 6; ++j) {
+        a[i] += J[i*6+j] * f[j];
+      }
+    }
+  }
+
+ private:
+  const double _dt;
+  // Index of the next sample
+  int _k;
+  // Start of the current interval
+  double _t0;
+  double _y0[6];
+  double _f0[6];
+  double _a0[6];
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <math.h>
 
+#include "./Layout.h"
 #include "./vec.h"
 
 // Dipole has properties r, theta, phi, pr, ptheta, pphi
@@ -50,7 +51,8 @@ class Dipole {
   double get_pr() const { return _pr; }
   double get_ptheta() const { return _ptheta; }
   double get_pphi() const { return _pphi; }
-  // double get_E0() const { return _E0; }
+  double get_E0() const { return _E0; }
+  void set_E0(const double E0) { _E0 = E0; }
   double get_dE() const { return fabs(_E0-get_E()); }
 
   void set_r(const double r) { _r = r; }
@@ -72,17 +74,38 @@ class Dipole {
       throw std::logic_error("No magnetic field at origin");
     }
     const double r2 = r*r;
-    const double c = 1 / 6;
+    const double c = 1.0 / 6;
     const double3 mr = mult(p, 3 * p[0] / (r2*r2*r));
     const double3 mm = make_double3(1.0 / (r2*r), 0, 0);
     return mult(subtract(mr, mm), c);
   }
 
+  // Magnetic field at each of the n points p, as above. Each point is
+  // one padded SIMD vector.
+  static void B(const double3a* p, double3a* out, const int n) {
+    const double c = 1.0 / 6;
+    for (int i = 0; i < n; ++i) {
+      const double r = length(p[i]);
+      if (r == 0) {
+        throw std::logic_error("No magnetic field at origin");
+      }
+      const double r2 = r*r;
+      const double3a mr = mult(p[i], 3 * p[i].x / (r2*r2*r));
+      const double3a mm = make_double3a(1.0 / (r2*r), 0, 0);
+      out[i] = mult(subtract(mr, mm), c);
+    }
+  }
+
   static Dipole interpolateZeroCrossing(
       const Dipole& src, const Dipole& target, double f(const Dipole&)) {
+    return interpolateZeroCrossing(src, target, f(src), f(target));
+  }
+
+  // Same as above, but with f already evaluated at src and target.
+  static Dipole interpolateZeroCrossing(
+      const Dipole& src, const Dipole& target,
+      const double srcValue, const double targetValue) {
     const double EPSILON = 0.000000000001;
-    const double srcValue = f(src);
-    const double targetValue = f(target);
     double t = (-srcValue) / (targetValue - srcValue);
     if (fabs(targetValue - srcValue) < EPSILON) {
       t = 0;
@@ -106,6 +129,56 @@ class Dipole {
     return T() + V();
   }
 
+  // Gradient of E with respect to (r, theta, phi, pr, ptheta, pphi).
+  void get_grad_E(double g[6]) const {
+    const double r2 = _r*_r;
+    const double r3 = r2*_r;
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      layout->energy(_r, _theta, _phi, g);
+      g[0] -= _ptheta*_ptheta/r3;
+      g[3] = _pr;
+      g[4] = _ptheta/r2;
+      g[5] = 10*_pphi;
+      return;
+    }
+    const double cos2 = cos(_phi-2*_theta);
+    const double sin2 = sin(_phi-2*_theta);
+    g[0] = -_ptheta*_ptheta/r3 + (cos(_phi) + 3*cos2)/(4*r3*_r);
+    g[1] = -sin2/(2*r3);
+    g[2] = (sin(_phi) + 3*sin2)/(12*r3);
+    g[3] = _pr;
+    g[4] = _ptheta/r2;
+    g[5] = 10*_pphi;
+  }
+
+  // Moves the state back onto the initial energy surface E = E0 with the
+  // minimum-norm correction, i.e. Newton steps along grad E:
+  //   y <- y - (E(y) - E0) grad E / |grad E|^2
+  // If fixRadius, r and pr are left unchanged (sliding, or at a
+  // collision). Returns the Euclidean norm of the total correction.
+  double projectToEnergy(const bool fixRadius) {
+    double* y = (double*)this;
+    double y0[6];
+    for (int i = 0; i < 6; ++i) y0[i] = y[i];
+    for (int iter = 0; iter < 3; ++iter) {
+      const double dE = get_E() - _E0;
+      if (dE == 0) break;
+      double g[6];
+      get_grad_E(g);
+      if (fixRadius) {
+        g[0] = 0;
+        g[3] = 0;
+      }
+      double g2 = 0;
+      for (int i = 0; i < 6; ++i) g2 += g[i]*g[i];
+      if (g2 == 0) break;
+      for (int i = 0; i < 6; ++i) y[i] -= dE * g[i] / g2;
+    }
+    double norm2 = 0;
+    for (int i = 0; i < 6; ++i) norm2 += (y[i]-y0[i])*(y[i]-y0[i]);
+    return sqrt(norm2);
+  }
+
  private:
   //----------------------------------------
   // Energy
@@ -116,6 +189,9 @@ class Dipole {
   }
 
   double V() const {
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      return layout->energy(_r, _theta, _phi);
+    }
     return -(cos(_phi) + 3*cos(_phi-2*_theta))/(12*_r*_r*_r);
   }
 
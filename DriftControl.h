@@ -0,0 +1,126 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __DRIFT_CONTROL_H__
+#define __DRIFT_CONTROL_H__
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Event.h"
+#include "./Options.h"
+#include "./Stepper.h"
+
+// Keeps the energy drift dE = |E - E0| of a single run under a budget by
+// adapting the error tolerance as the run goes, so that the run spends
+// effort only where the dynamics need it.
+//
+// Time is cut into segments of length segmentLength. The state at the
+// start of a segment is a checkpoint held in memory. A segment is run at
+// the current tolerance with its events recorded; if dE goes over maxDrift
+// at any step, the events are dropped, the run rolls back to the
+// checkpoint and the segment is run again at a tenth of the tolerance,
+// down to MIN_EPS. While below the base tolerance, a segment accepted with
+// dE under half the budget relaxes the tolerance by a factor of ten for
+// the next segment.
+class DriftControl {
+ public:
+  // Tolerances are not tightened below this, where rk8pd stops improving
+  static constexpr double MIN_EPS = 1e-15;
+
+  struct Segment {
+    double t0;
+    double t1;
+    // Tolerance the segment was accepted at
+    double eps;
+    // Runs rolled back before it was accepted
+    int rollbacks;
+    // Steps of the accepted run, and of all runs
+    long steps;
+    long totalSteps;
+    // Largest dE over the accepted run
+    double dE;
+  };
+
+  DriftControl(const double maxDrift, const double segmentLength,
+               const double eps, const Options::Dynamics dynamics,
+               const Options::Integrator integrator)
+      : _maxDrift(maxDrift), _segmentLength(segmentLength), _baseEps(eps),
+        _eps(eps), _dynamics(dynamics), _integrator(integrator) {
+    if (maxDrift <= 0 || segmentLength <= 0) {
+      throw std::logic_error("--maxDrift and --driftSegment must be positive");
+    }
+  }
+
+  // Advances (d, t) by one segment. Events of the accepted run are
+  // appended to records in order. Throws if dE is over the budget even at
+  // MIN_EPS, leaving d and t at the checkpoint.
+  Segment segment(Dipole& d, double& t, std::vector<Event::Record>& records) {
+    Segment s;
+    s.t0 = t;
+    s.t1 = t + _segmentLength;
+    s.rollbacks = 0;
+    s.totalSteps = 0;
+    std::vector<Event::Record> tried;
+    while (true) {
+      tried.clear();
+      Stepper stepper(d, o.h, false, _eps, _dynamics, _integrator);
+      Event event(d, t, &tried);
+      stepper.t = t;
+      s.dE = 0;
+      s.steps = stepper.advance(
+          s.t1,
+          [&]() {
+            event.log(stepper.d, stepper.t, &stepper);
+            s.dE = std::max(s.dE, stepper.d.get_dE());
+          },
+          [&]() {
+            event.logCollision(stepper.d, stepper.t);
+            s.dE = std::max(s.dE, stepper.d.get_dE());
+          });
+      s.totalSteps += s.steps;
+      if (s.dE <= _maxDrift) {
+        d = stepper.d;
+        break;
+      }
+      if (_eps <= MIN_EPS) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Drift %.2e over --maxDrift at eps = %g "
+                 "in the segment from t = %lf", s.dE, _eps, s.t0);
+        throw std::logic_error(msg);
+      }
+      _eps = (_eps / 10 > MIN_EPS) ? _eps / 10 : MIN_EPS;
+      ++s.rollbacks;
+    }
+    s.eps = _eps;
+    records.insert(records.end(), tried.begin(), tried.end());
+    t = s.t1;
+    if (_eps < _baseEps && s.dE < _maxDrift / 2) {
+      _eps = std::min(_baseEps, _eps * 10);
+    }
+    return s;
+  }
+
+ private:
+  const double _maxDrift;
+  const double _segmentLength;
+  const double _baseEps;
+  // Tolerance the next segment is first run at
+  double _eps;
+  const Options::Dynamics _dynamics;
+  const Options::Integrator _integrator;
+};
+
+#endif
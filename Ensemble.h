@@ -0,0 +1,327 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __ENSEMBLE_H__
+#define __ENSEMBLE_H__
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "./Dipole.h"
+#include "./MappedFile.h"
+#include "./Physics.h"
+#include "./Recurrence.h"
+
+// One initial condition of an ensemble.
+struct EnsembleRecord {
+  // Position of the record in the ensemble, counting from 0
+  long index;
+  Dipole dipole;
+  // Event budget of this run. A record without one (-1 in the file) gets
+  // --numEvents, which is -1 with --logOfNumSteps: then the run has no
+  // event budget and stops after that many steps.
+  int numEvents;
+  // A record without dynamics (-1 in the file) gets -d
+  Options::Dynamics dynamics;
+};
+
+// Final state of a single run.
+struct RunResult {
+  Dipole d;
+  double t;
+  int numEvents;
+  long numSteps;
+  RecurrenceDetector::Fate fate;
+  // Period in section crossings if periodic
+  int period;
+  // Next step size, and whether the run stopped at a collision (d is
+  // after the reflection). With the rest, enough to continue the run.
+  double h;
+  bool atCollision;
+};
+
+// Streams the records of an ensemble file. open() picks the reader from
+// the file's contents:
+//
+// Binary files start with the 8 bytes "MAGPHYXB", a uint32 version (1) and
+// a uint32 flags word, followed by fixed-size records of six doubles
+//   r theta phi pr ptheta pphi
+// with angles in radians. If bit 0 of flags is set, each record is
+// followed by an int32 numEvents (-1 for the default) and an int32
+// dynamics (0 bouncing, 1 sliding, -1 for the default).
+//
+// Any other file is text: one initial condition per line in the same
+// units as -i, fields separated by whitespace or commas,
+//   r theta phi pr ptheta pphi [numEvents [bouncing|sliding]]
+// Blank lines and lines not starting with a number (comments, CSV headers)
+// are skipped. Both \n and \r end a line.
+class EnsembleReader {
+ public:
+  static const uint32_t HAS_RUN_SETTINGS = 1;
+
+  EnsembleReader(const int defaultNumEvents,
+                 const Options::Dynamics defaultDynamics)
+      : _index(0), _defaultNumEvents(defaultNumEvents),
+        _defaultDynamics(defaultDynamics) {}
+  virtual ~EnsembleReader() {}
+
+  static EnsembleReader* open(const std::string& filename,
+                              const int defaultNumEvents,
+                              const Options::Dynamics defaultDynamics);
+
+  // Reads the next record. Returns false at end of file.
+  virtual bool next(EnsembleRecord& rec) = 0;
+
+  // Starts over at the first record.
+  virtual void rewind() = 0;
+
+ protected:
+  void fill(EnsembleRecord& rec, const double y[6], const int numEvents,
+            const int dynamics) {
+    rec.index = _index++;
+    rec.dipole = Dipole(y[0], y[1], y[2], y[3], y[4], y[5]);
+    rec.numEvents = (numEvents == -1) ? _defaultNumEvents : numEvents;
+    rec.dynamics = (dynamics == -1) ? _defaultDynamics :
+        (Options::Dynamics)dynamics;
+    if (rec.dynamics == Options::SLIDING && MagnetLayout::active()) {
+      throw std::logic_error("Record " + std::to_string(rec.index) +
+                             " slides, which --layout does not support");
+    }
+  }
+
+ protected:
+  long _index;
+  const int _defaultNumEvents;
+  const Options::Dynamics _defaultDynamics;
+};
+
+class BinaryEnsembleReader : public EnsembleReader {
+ public:
+  static const size_t HEADER_SIZE = 16;
+
+  static bool isBinary(const MappedFile& file) {
+    return file.size() >= HEADER_SIZE &&
+        memcmp(file.data(), "MAGPHYXB", 8) == 0;
+  }
+
+  BinaryEnsembleReader(const std::string& filename,
+                       const int defaultNumEvents,
+                       const Options::Dynamics defaultDynamics)
+      : EnsembleReader(defaultNumEvents, defaultDynamics),
+        _file(filename), _pos(HEADER_SIZE) {
+    uint32_t version, flags;
+    memcpy(&version, _file.data() + 8, 4);
+    memcpy(&flags, _file.data() + 12, 4);
+    if (version != 1) {
+      throw std::logic_error("Unsupported binary ensemble version");
+    }
+    _hasRunSettings = (flags & HAS_RUN_SETTINGS) != 0;
+    _recordSize = 6*sizeof(double) + (_hasRunSettings ? 8 : 0);
+    if ((_file.size() - HEADER_SIZE) % _recordSize != 0) {
+      throw std::logic_error("Truncated binary ensemble file");
+    }
+  }
+
+  bool next(EnsembleRecord& rec) {
+    if (_pos + _recordSize > _file.size()) return false;
+    const char* p = _file.data() + _pos;
+    double y[6];
+    memcpy(y, p, sizeof(y));
+    int32_t settings[2] = { -1, -1 };
+    if (_hasRunSettings) {
+      memcpy(settings, p + sizeof(y), sizeof(settings));
+      if (settings[1] != -1 && settings[1] != Options::BOUNCING &&
+          settings[1] != Options::SLIDING) {
+        throw std::logic_error("Illegal dynamics " +
+                               std::to_string(settings[1]) +
+                               " in ensemble record " +
+                               std::to_string(_index));
+      }
+    }
+    fill(rec, y, settings[0], settings[1]);
+    _pos += _recordSize;
+    return true;
+  }
+
+  void rewind() {
+    _pos = HEADER_SIZE;
+    _index = 0;
+  }
+
+  // Writes a binary ensemble file header.
+  static void writeHeader(FILE* out, const bool hasRunSettings) {
+    const uint32_t version = 1;
+    const uint32_t flags = hasRunSettings ? HAS_RUN_SETTINGS : 0;
+    fwrite("MAGPHYXB", 1, 8, out);
+    fwrite(&version, 4, 1, out);
+    fwrite(&flags, 4, 1, out);
+  }
+
+  // Writes one record of a file with run settings.
+  static void writeRecord(FILE* out, const EnsembleRecord& rec) {
+    fwrite((const double*)(&rec.dipole), sizeof(double), 6, out);
+    const int32_t settings[2] = { rec.numEvents, (int32_t)rec.dynamics };
+    fwrite(settings, sizeof(int32_t), 2, out);
+  }
+
+ private:
+  MappedFile _file;
+  size_t _pos;
+  size_t _recordSize;
+  bool _hasRunSettings;
+};
+
+// Tokenizes text ensemble files in place in the mapped buffer, with no
+// per-line allocation.
+class TextEnsembleReader : public EnsembleReader {
+ public:
+  TextEnsembleReader(const std::string& filename,
+                     const int defaultNumEvents,
+                     const Options::Dynamics defaultDynamics)
+      : EnsembleReader(defaultNumEvents, defaultDynamics),
+        _file(filename), _p(_file.data()), _end(_file.data() + _file.size()) {}
+
+  bool next(EnsembleRecord& rec) {
+    while (_p < _end) {
+      const char* lineEnd = _p;
+      while (lineEnd < _end && *lineEnd != '\n' && *lineEnd != '\r') {
+        ++lineEnd;
+      }
+      const char* p = _p;
+      _p = (lineEnd < _end) ? lineEnd+1 : _end;
+
+      const char* tok;
+      size_t len;
+      if (!token(p, lineEnd, tok, len) || !isNumberStart(*tok)) continue;
+
+      double y[6];
+      for (int i = 0; i < 6; ++i) {
+        if (i > 0 && !token(p, lineEnd, tok, len)) {
+          throw std::logic_error("Too few values in ensemble record " +
+                                 std::to_string(_index));
+        }
+        y[i] = toDouble(tok, len);
+      }
+      y[1] = Physics::deg2rad(y[1]);
+      y[2] = Physics::deg2rad(y[2]);
+
+      int numEvents = -1;
+      int dynamics = -1;
+      if (token(p, lineEnd, tok, len)) {
+        numEvents = (int)toDouble(tok, len);
+        if (token(p, lineEnd, tok, len)) {
+          const std::string d(tok, len);
+          if (d == "bouncing") dynamics = Options::BOUNCING;
+          else if (d == "sliding") dynamics = Options::SLIDING;
+          else throw std::logic_error("Illegal dynamics in ensemble: " + d);
+        }
+      }
+      fill(rec, y, numEvents, dynamics);
+      return true;
+    }
+    return false;
+  }
+
+  void rewind() {
+    _p = _file.data();
+    _index = 0;
+  }
+
+ private:
+  static bool isSeparator(const char c) {
+    return c == ' ' || c == '\t' || c == ',';
+  }
+
+  static bool isNumberStart(const char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+  }
+
+  // Finds the next token in [p, end) and advances p past it.
+  static bool token(const char*& p, const char* end,
+                    const char*& tok, size_t& len) {
+    while (p < end && isSeparator(*p)) ++p;
+    if (p == end) return false;
+    tok = p;
+    while (p < end && !isSeparator(*p)) ++p;
+    len = p - tok;
+    return true;
+  }
+
+  // The mapped buffer is not null-terminated, so numbers are copied to
+  // a small buffer before strtod.
+  static double toDouble(const char* tok, const size_t len) {
+    char buf[64];
+    if (len >= sizeof(buf)) {
+      throw std::logic_error("Number too long in ensemble file");
+    }
+    memcpy(buf, tok, len);
+    buf[len] = 0;
+    char* end;
+    const double value = strtod(buf, &end);
+    if (end != buf + len) {
+      throw std::logic_error("Illegal number in ensemble file: " +
+                             std::string(buf));
+    }
+    return value;
+  }
+
+ private:
+  MappedFile _file;
+  const char* _p;
+  const char* _end;
+};
+
+inline EnsembleReader* EnsembleReader::open(
+    const std::string& filename, const int defaultNumEvents,
+    const Options::Dynamics defaultDynamics) {
+  bool binary;
+  {
+    MappedFile file(filename);
+    binary = BinaryEnsembleReader::isBinary(file);
+  }
+  if (binary) {
+    return new BinaryEnsembleReader(filename, defaultNumEvents,
+                                    defaultDynamics);
+  }
+  return new TextEnsembleReader(filename, defaultNumEvents, defaultDynamics);
+}
+
+// Deterministic, cost-balanced assignment of ensemble records to N shards.
+// The records are cut into N contiguous ranges of nearly equal total cost,
+// where a record's cost is its event (or step) budget. A record belongs to
+// the range containing the midpoint of its cost interval. Every process
+// computes the same assignment from the ensemble file alone, so shards
+// need no communication.
+class ShardAssignment {
+ public:
+  ShardAssignment(const int numShards, const double totalCost)
+      : _numShards(numShards), _totalCost(totalCost) {}
+
+  // Shard of a record whose cost interval is
+  // [costBefore, costBefore + cost).
+  int shardOf(const double costBefore, const double cost) const {
+    if (_totalCost <= 0) return 0;
+    const double mid = costBefore + cost / 2;
+    const int k = (int)(_numShards * mid / _totalCost);
+    return (k < _numShards) ? k : _numShards-1;
+  }
+
+ private:
+  const int _numShards;
+  const double _totalCost;
+};
+
+#endif
@@ -1,25 +1,75 @@
 #ifndef __EVENT_H__
 #define __EVENT_H__
 
+#include <algorithm>
+
 #include <gsl/gsl_fft_real.h>
 
 #include "./Dipole.h"
+#include "./EventRing.h"
+#include "./EventSurface.h"
 #include "./Options.h"
+#include "./Physics.h"
+#include "./Pyramid.h"
+#include "./Summary.h"
+
+// Dense output of the last integration step, if the integrator has one.
+class DenseStep {
+ public:
+  virtual ~DenseStep() {}
+  // Sets d to the state at fraction s in [0, 1] of the last step. Returns
+  // false if there is no dense output.
+  virtual bool interpolate(const double s, Dipole& d) const = 0;
+};
 
 class Event {
  public:
+  // If append, events are added to the end of an existing file.
   Event(const std::string& filename, const Dipole& d,
-        const Options::StateVariable& singleStep)
-      : _n(1), _d(d), _singleStep(singleStep) {
+        const Options::StateVariable& singleStep, const bool append = false)
+      : _n(1), _d(d), _t(0), _singleStep(singleStep),
+        _logCollisions(false), _records(0), _summary(0), _pyramid(0),
+        _ring(0) {
     _isStdout = (filename == "");
     if (_isStdout) {
       _file = stdout;
     } else {
-      _file = fopen(filename.c_str(), "w");
+      _file = fopen(filename.c_str(), append ? "a" : "w");
     }
+    initSurfaces(d);
+  }
+
+  // Counts events without writing them anywhere. Used for ensemble runs,
+  // where only the final state of each run is output, and for single-step
+  // runs that only write a pyramid.
+  explicit Event(const Dipole& d,
+                 const Options::StateVariable singleStep = Options::NONE)
+      : _file(0), _isStdout(false), _n(1), _d(d), _t(0),
+        _singleStep(singleStep), _logCollisions(false), _records(0),
+        _summary(0), _pyramid(0), _ring(0) {
+    initSurfaces(d);
+  }
+
+  // An event held in memory by a recording Event.
+  struct Record {
+    std::string name;
+    Dipole d;
+    double t;
+  };
+
+  // Records events in memory instead of writing them, so that pieces of a
+  // trajectory computed out of order (parareal time slices) can be
+  // replayed into the output Event in order.
+  Event(const Dipole& d, const double t, std::vector<Record>* records)
+      : _file(0), _isStdout(false), _n(1), _d(d), _t(t),
+        _singleStep(Options::NONE), _logCollisions(false), _records(records),
+        _summary(0), _pyramid(0), _ring(0) {
+    initSurfaces(d);
   }
 
   ~Event() {
+    if (!_file) return;
+
     if (_singleStep != Options::NONE && _singleStep != Options::ALL) {
       if (o.fft) {
         gsl_fft_real_radix2_transform(_ss_v.data(), 1, _ss_v.size());
@@ -66,8 +116,22 @@ class Event {
   void operator=(const Event& e) {
   }
 
+  void initSurfaces(const Dipole& d) {
+    const std::vector<EventSurface> surfaces =
+        o.events.empty() ? EventSurface::defaults() : o.events;
+    for (int i = 0; i < surfaces.size(); ++i) {
+      if (surfaces[i].kind() == EventSurface::COLLISION) {
+        _logCollisions = true;
+      } else {
+        _surfaces.push_back(surfaces[i]);
+        _values.push_back(surfaces[i].evaluate(d));
+      }
+    }
+  }
+
  public:
   void printHeader() const {
+    if (!_file) return;
     if (_singleStep == Options::NONE || _singleStep == Options::ALL) {
       fprintf(_file, "n, event_type, t, r, theta, phi,"
               "pr, ptheta, pphi, beta, E, dE\n");
@@ -76,73 +140,145 @@ class Event {
 
   int get_n() const { return _n; }
 
-  bool log(const Dipole& new_d, const double t) {
+  // Continues a run that stopped at d at time t with n events logged, as
+  // if the events so far had been logged here. d is the state the last
+  // crossing test saw.
+  void resume(const Dipole& d, const double t, const int n) {
+    _d = d;
+    _t = t;
+    _n = n + 1;
+    for (int i = 0; i < _surfaces.size(); ++i) {
+      _values[i] = _surfaces[i].evaluate(d);
+    }
+  }
+
+  // If dense is given, crossings are located on its dense output
+  // instead of by linear interpolation between steps.
+  bool log(const Dipole& new_d, const double t, const DenseStep* dense = 0) {
     if (_singleStep != Options::NONE) {
-      _ss_t.push_back(t);
-      if (_singleStep == Options::THETA) {
-        _ss_v.push_back(new_d.get_theta());
-      } else if (_singleStep == Options::PHI) {
-        _ss_v.push_back(new_d.get_phi());
-      } else if (_singleStep == Options::ALL) {
-        event("step", new_d, t);
-      }
+      logStep(new_d, t);
       return true;
     }
 
     bool fired = false;
-    // Log zero crossings
-    if (isZeroCrossing(_d.get_theta(), new_d.get_theta())) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return d.get_theta();});
-      event("theta = 0", logDipole, t);
-      fired = true;
-    }
-    if (isZeroCrossing(_d.get_phi(), new_d.get_phi())) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return d.get_phi();});
-      event("phi = 0", logDipole, t);
-      fired = true;
-    }
-    if (isZeroCrossing(Physics::get_beta(_d), Physics::get_beta(new_d))) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return Physics::get_beta(d);});
-      event("beta = 0", logDipole, t);
-      fired = true;
-    }
-    if (isNegativeZeroCrossing(_d.get_pr(), new_d.get_pr())) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return d.get_pr();});
-      event("pr = 0", logDipole, t);
-      fired = true;
-    }
-    if (isZeroCrossing(_d.get_ptheta(), new_d.get_ptheta())) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return d.get_ptheta();});
-      event("ptheta = 0", logDipole, t);
-      fired = true;
-    }
-    if (isZeroCrossing(_d.get_pphi(), new_d.get_pphi())) {
-      const Dipole logDipole = Dipole::interpolateZeroCrossing(
-          _d, new_d, [](const Dipole& d) {return d.get_pphi();});
-      event("pphi = 0", logDipole, t);
-      fired = true;
+    // Log zero crossings. Each surface is evaluated once per step; the
+    // value at the previous step is cached in _values.
+    for (int i = 0; i < _surfaces.size(); ++i) {
+      const EventSurface& surface = _surfaces[i];
+      const double value = surface.evaluate(new_d);
+      if (isCrossing(surface.direction(), _values[i], value) &&
+          surface.accept(new_d)) {
+        Dipole logDipole;
+        double s;
+        if (dense && locate(surface, *dense, _values[i], value, logDipole, s)) {
+          Record r = { surface.name(), logDipole, _t + s * (t - _t) };
+          _located.push_back(r);
+        } else {
+          logDipole = Dipole::interpolateZeroCrossing(
+              _d, new_d, _values[i], value);
+          event(surface.name(), logDipole, t);
+        }
+        fired = true;
+      }
+      _values[i] = value;
+    }
+    // Events located on the dense output are written in time order
+    if (!_located.empty()) {
+      std::stable_sort(_located.begin(), _located.end(), isEarlier);
+      for (int i = 0; i < _located.size(); ++i) {
+        event(_located[i].name, _located[i].d, _located[i].t);
+      }
+      _located.clear();
     }
     _d = new_d;
+    _t = t;
     return fired;
   }
 
+  // Single-step output of the state at time t
+  void logStep(const Dipole& d, const double t) {
+    if (_pyramid) {
+      const double v[Pyramid::NUM_VARIABLES] = {
+        d.get_r(), Physics::rad2deg(d.get_theta()),
+        Physics::rad2deg(d.get_phi()), d.get_pr(), d.get_ptheta(),
+        d.get_pphi(), d.get_E() };
+      _pyramid->add(t, v);
+    }
+    // With ALL the state goes through event()
+    if (_ring && _singleStep != Options::ALL) {
+      _ring->push("step", 0, t, (const double*)(&d), d.get_E(), d.get_dE());
+    }
+    // theta and phi series are only kept for the output file
+    if (!_file && _singleStep != Options::ALL) return;
+    _ss_t.push_back(t);
+    if (_singleStep == Options::THETA) {
+      _ss_v.push_back(d.get_theta());
+    } else if (_singleStep == Options::PHI) {
+      _ss_v.push_back(d.get_phi());
+    } else if (_singleStep == Options::ALL) {
+      event("step", d, t);
+    }
+  }
+
+  // Also adds every event to summary.
+  void setSummary(Summary* summary) {
+    _summary = summary;
+  }
+
+  // Also adds every single-step sample to pyramid.
+  void setPyramid(PyramidWriter* pyramid) {
+    _pyramid = pyramid;
+  }
+
+  // Also publishes every event and single-step state to ring.
+  void setRing(EventRing* ring) {
+    _ring = ring;
+  }
+
+  // Outputs an event recorded by another Event.
+  void replay(const Record& r) {
+    event(r.name, r.d, r.t);
+  }
+
   void logCollision(const Dipole& new_d, const double t) {
     if (_singleStep != Options::NONE) {
       throw std::logic_error("Collision events should not occur in single step "
                              "mode");
     }
 
-    event("collision", new_d, t);
+    if (_logCollisions) {
+      event("collision", new_d, t);
+    }
+    // Crossings of the next step are tested from the state before the
+    // reflection, where pr only changes sign. The reflection off a magnet
+    // of a layout turns ptheta too, so there they are tested from the
+    // reflected state.
     _d = new_d;
+    if (MagnetLayout::active()) {
+      Physics::reflect(_d);
+    }
+    _t = t;
+    for (int i = 0; i < _surfaces.size(); ++i) {
+      _values[i] = _surfaces[i].evaluate(_d);
+    }
   }
 
  private:
   void event(const std::string& name, const Dipole& d, const double t) {
+    if (_summary) {
+      _summary->add(name, d, t, _n);
+    }
+    if (_records) {
+      Record r = { name, d, t };
+      _records->push_back(r);
+    }
+    if (_ring) {
+      _ring->push(name, _n, t, (const double*)(&d), d.get_E(), d.get_dE());
+    }
+    if (!_file) {
+      _n++;
+      return;
+    }
     fprintf(_file, "%d,%s,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%.2e\n",
             _n, name.c_str(), t, d.get_r(),
             Physics::rad2deg(d.get_theta()), Physics::rad2deg(d.get_phi()),
@@ -151,6 +287,37 @@ class Event {
     _n++;
   }
 
+  // Finds the zero of the surface in the step by the Illinois variant of
+  // regula falsi on the dense output, given the values a and b at the
+  // ends of the step.
+  static bool locate(const EventSurface& surface, const DenseStep& dense,
+                     double a, double b, Dipole& d, double& s) {
+    double s0 = 0, s1 = 1;
+    s = 1;
+    for (int iter = 0; iter < 50 && a != b; ++iter) {
+      s = s0 - a * (s1 - s0) / (b - a);
+      if (!dense.interpolate(s, d)) return false;
+      d.set_theta(Physics::normalizeAngle(d.get_theta()));
+      d.set_phi(Physics::normalizeAngle(d.get_phi()));
+      const double v = surface.evaluate(d);
+      if (fabs(v) < 1e-14 || s1 - s0 < 1e-15) return true;
+      if ((v < 0) == (b < 0)) {
+        s1 = s;
+        b = v;
+        a /= 2;
+      } else {
+        s0 = s;
+        a = v;
+        b /= 2;
+      }
+    }
+    return dense.interpolate(s, d);
+  }
+
+  static bool isEarlier(const Record& a, const Record& b) {
+    return a.t < b.t;
+  }
+
   static int sign(const double d) {
     const double EPSILON = 0.000000000001;
     return (d < -EPSILON) ? -1 : (d > EPSILON) ? 1 : 0;
@@ -168,12 +335,40 @@ class Event {
     return (sign(a) > 0 && sign(b) <= 0);
   }
 
+  static bool isPositiveZeroCrossing(const double a, const double b) {
+    // Return true if we cross zero from negative to positive or from
+    // zero to positive.
+    return (sign(a) < 0 && sign(b) >= 0);
+  }
+
+  static bool isCrossing(const EventSurface::Direction dir,
+                         const double a, const double b) {
+    switch (dir) {
+      case EventSurface::POS: return isPositiveZeroCrossing(a, b);
+      case EventSurface::NEG: return isNegativeZeroCrossing(a, b);
+      default: return isZeroCrossing(a, b);
+    }
+  }
+
  private:
   FILE* _file;
   bool _isStdout;
   int _n;
   Dipole _d;
+  // Time of _d
+  double _t;
   const Options::StateVariable _singleStep;
+  // Event surfaces other than collision, and their values at _d.
+  std::vector<EventSurface> _surfaces;
+  std::vector<double> _values;
+  bool _logCollisions;
+  // If non-null, events are recorded here instead of written
+  std::vector<Record>* _records;
+  Summary* _summary;
+  PyramidWriter* _pyramid;
+  EventRing* _ring;
+  // Events of the current step located on dense output
+  std::vector<Record> _located;
   // Single-step t and variable values.
   std::vector<double> _ss_t;
   std::vector<double> _ss_v;
@@ -0,0 +1,399 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __EVENT_RING_H__
+#define __EVENT_RING_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Single-producer, multi-consumer ring of raw event records in POSIX
+// shared memory (/magphyxring-name), so that local tools can follow a
+// run's output as it is produced without files or parsing.
+//
+// Records are numbered by a sequence number from 0. Record s lives in slot
+// s mod capacity, behind the slot's sequence word: the writer sets it to
+// 2s+1 while writing and to 2s+2 once the record is complete, and then
+// publishes head = s+1. A reader that wants record s checks that the slot
+// holds 2s+2 before and after copying it; anything else means the writer
+// has lapped it.
+//
+// With the OVERWRITE policy the writer never waits, and a reader that
+// falls more than capacity records behind loses the oldest ones (see
+// EventRingReader::lost). With BLOCK, readers that register a cursor hold
+// the writer back until they have read a record, so none is lost, and
+// since the writer cannot overwrite them they may read records in place
+// (peek). The writer drops the cursors of readers whose process is gone.
+// With no registered readers BLOCK writes as OVERWRITE does.
+//
+// The writer unlinks the segment when the run ends, after marking it
+// closed; readers that have it mapped drain what is left.
+class EventRing {
+ public:
+  static const uint32_t VERSION = 1;
+  static const int MAX_TYPES = 32;
+  static const int TYPE_LENGTH = 32;
+  static const int MAX_READERS = 16;
+
+  enum Policy { OVERWRITE, BLOCK };
+
+  // Angles in radians. n is the event number, or 0 for single-step states.
+  struct Record {
+    uint64_t seq;
+    int32_t type;
+    int32_t n;
+    double t;
+    double y[6];
+    double E;
+    double dE;
+  };
+
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    Record record;
+  } __attribute__((aligned(64)));
+
+  struct Cursor {
+    // Process of the reader, or 0 if free
+    std::atomic<int64_t> pid;
+    // Next record the reader will read
+    std::atomic<uint64_t> next;
+  } __attribute__((aligned(64)));
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t policy;
+    uint64_t capacity;
+    int64_t pid;
+    // Records published
+    std::atomic<uint64_t> head;
+    std::atomic<uint32_t> closed;
+    // Event type names, indexed by Record::type
+    std::atomic<uint32_t> numTypes;
+    char types[MAX_TYPES][TYPE_LENGTH];
+    Cursor readers[MAX_READERS];
+  } __attribute__((aligned(64)));
+
+  static std::string path(const std::string& name) {
+    return "/magphyxring-" + name;
+  }
+
+  static size_t size(const uint64_t capacity) {
+    return sizeof(Header) + capacity * sizeof(Slot);
+  }
+
+  // Creates the ring. capacity is rounded up to a power of two.
+  EventRing(const std::string& name, const uint64_t capacity,
+            const Policy policy)
+      : _name(name), _policy(policy), _head(0) {
+    _capacity = 1;
+    while (_capacity < capacity) _capacity *= 2;
+    _size = size(_capacity);
+    const int fd = shm_open(path(name).c_str(),
+                            O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+      throw std::logic_error(
+          "Unable to create shared memory " + path(name) + ". If no run "
+          "uses the name, a crashed run left it in /dev/shm.");
+    }
+    if (ftruncate(fd, _size) != 0) {
+      close(fd);
+      shm_unlink(path(name).c_str());
+      throw std::logic_error("Unable to size shared memory " + path(name));
+    }
+    void* p = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      shm_unlink(path(name).c_str());
+      throw std::logic_error("Unable to map " + path(name));
+    }
+    _header = new (p) Header();
+    _slots = (Slot*)((char*)p + sizeof(Header));
+    for (uint64_t i = 0; i < _capacity; ++i) {
+      new (_slots + i) Slot();
+    }
+    _header->version = VERSION;
+    _header->policy = policy;
+    _header->capacity = _capacity;
+    _header->pid = getpid();
+    // The magic goes last so readers never see a half initialized header
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(_header->magic, "MAGPHYXR", 8);
+  }
+
+  ~EventRing() {
+    _header->closed.store(1, std::memory_order_release);
+    munmap(_header, _size);
+    shm_unlink(path(_name).c_str());
+  }
+
+  // Publishes a record. y is the state with angles in radians.
+  void push(const std::string& type, const int n, const double t,
+            const double y[6], const double E, const double dE) {
+    const uint64_t s = _head;
+    const int typeId = typeIndex(type);
+    if (_policy == BLOCK) {
+      waitForReaders(s);
+    }
+    Slot& slot = _slots[s & (_capacity-1)];
+    slot.seq.store(2*s+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Record& r = slot.record;
+    r.seq = s;
+    r.type = typeId;
+    r.n = n;
+    r.t = t;
+    for (int i = 0; i < 6; ++i) r.y[i] = y[i];
+    r.E = E;
+    r.dE = dE;
+    slot.seq.store(2*s+2, std::memory_order_release);
+    _header->head.store(s+1, std::memory_order_release);
+    ++_head;
+  }
+
+ private:
+  // disallow copies because destructor unmaps
+  EventRing(const EventRing&);
+  void operator=(const EventRing&);
+
+  // Index of type in the header's table, adding it if new. Only the
+  // writer adds types, and it does so before publishing a record of the
+  // type.
+  int typeIndex(const std::string& type) {
+    const int numTypes = _header->numTypes.load(std::memory_order_relaxed);
+    for (int i = 0; i < numTypes; ++i) {
+      if (type == _header->types[i]) return i;
+    }
+    if (numTypes == MAX_TYPES) {
+      throw std::logic_error("Too many event types for the ring");
+    }
+    strncpy(_header->types[numTypes], type.c_str(), TYPE_LENGTH-1);
+    _header->numTypes.store(numTypes+1, std::memory_order_release);
+    return numTypes;
+  }
+
+  // Waits until every registered reader is less than capacity records
+  // behind s
+  void waitForReaders(const uint64_t s) {
+    for (long spins = 0; ; ++spins) {
+      uint64_t slowest = s;
+      for (int i = 0; i < MAX_READERS; ++i) {
+        const Cursor& c = _header->readers[i];
+        if (c.pid.load(std::memory_order_acquire) != 0) {
+          slowest = std::min(slowest,
+                             c.next.load(std::memory_order_acquire));
+        }
+      }
+      if (s - slowest < _capacity) return;
+      if (spins % 1024 == 1023) {
+        dropDeadReaders();
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  void dropDeadReaders() {
+    for (int i = 0; i < MAX_READERS; ++i) {
+      Cursor& c = _header->readers[i];
+      int64_t pid = c.pid.load(std::memory_order_acquire);
+      if (pid != 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+        c.pid.compare_exchange_strong(pid, 0);
+      }
+    }
+  }
+
+ private:
+  const std::string _name;
+  const Policy _policy;
+  uint64_t _capacity;
+  size_t _size;
+  Header* _header;
+  Slot* _slots;
+  // Next sequence number
+  uint64_t _head;
+};
+
+// Reads the records of a ring in order.
+class EventRingReader {
+ public:
+  // Attaches to the ring of a running magphyxc. If fromStart, reading
+  // starts at the oldest record still in the ring, otherwise at the next
+  // one written. If registered, the reader takes a cursor, which under the
+  // BLOCK policy holds the writer back.
+  EventRingReader(const std::string& name, const bool fromStart,
+                  const bool registered = true)
+      : _cursor(0), _next(0), _lost(0) {
+    const int fd = shm_open(EventRing::path(name).c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      throw std::logic_error("No event ring " + EventRing::path(name));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        st.st_size < (off_t)sizeof(EventRing::Header)) {
+      close(fd);
+      throw std::logic_error("Unable to read " + EventRing::path(name));
+    }
+    _size = st.st_size;
+    void* p = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::logic_error("Unable to map " + EventRing::path(name));
+    }
+    _header = (EventRing::Header*)p;
+    _slots = (EventRing::Slot*)((char*)p + sizeof(EventRing::Header));
+    if (memcmp(_header->magic, "MAGPHYXR", 8) != 0 ||
+        _header->version != EventRing::VERSION ||
+        _size < EventRing::size(_header->capacity)) {
+      munmap(p, _size);
+      throw std::logic_error("Not an event ring: " + EventRing::path(name));
+    }
+    _capacity = _header->capacity;
+
+    const uint64_t head = _header->head.load(std::memory_order_acquire);
+    _next = (!fromStart) ? head : (head > _capacity) ? head - _capacity : 0;
+    if (registered) {
+      for (int i = 0; i < EventRing::MAX_READERS && !_cursor; ++i) {
+        EventRing::Cursor& c = _header->readers[i];
+        int64_t free = 0;
+        if (c.pid.compare_exchange_strong(free, getpid())) {
+          _cursor = &c;
+          publish();
+        }
+      }
+      if (!_cursor) {
+        munmap(p, _size);
+        throw std::logic_error("Too many readers of " +
+                               EventRing::path(name));
+      }
+    }
+  }
+
+  ~EventRingReader() {
+    if (_cursor) {
+      _cursor->pid.store(0, std::memory_order_release);
+    }
+    munmap(_header, _size);
+  }
+
+  // Copies the next record to r. Returns false if it is not written yet.
+  bool next(EventRing::Record& r) {
+    while (true) {
+      const EventRing::Slot* slot = available();
+      if (!slot) return false;
+      const uint64_t before = slot->seq.load(std::memory_order_acquire);
+      if (before == 2*_next+2) {
+        memcpy(&r, &slot->record, sizeof(r));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) == before) {
+          advance();
+          return true;
+        }
+      }
+      // Overwritten before or while copying; available() skips ahead
+    }
+  }
+
+  // The next record in place, or 0 if it is not written yet. Valid until
+  // advance(), unless the writer overwrites it, which a registered reader
+  // of a BLOCK ring rules out. Otherwise use next().
+  const EventRing::Record* peek() {
+    const EventRing::Slot* slot = available();
+    return slot ? &slot->record : 0;
+  }
+
+  void advance() {
+    ++_next;
+    publish();
+  }
+
+  // Whether the run has ended and every record has been read
+  bool done() const {
+    return _header->closed.load(std::memory_order_acquire) &&
+        _next >= _header->head.load(std::memory_order_acquire);
+  }
+
+  // Records overwritten before they were read
+  uint64_t lost() const { return _lost; }
+
+  EventRing::Policy policy() const {
+    return (EventRing::Policy)_header->policy;
+  }
+  long pid() const { return _header->pid; }
+
+  // "?" for types that are negative, not yet registered or beyond
+  // MAX_TYPES in a damaged header
+  const char* typeName(const int type) const {
+    if (type < 0 || type >= EventRing::MAX_TYPES ||
+        (uint32_t)type >= _header->numTypes.load(std::memory_order_acquire)) {
+      return "?";
+    }
+    return _header->types[type];
+  }
+
+ private:
+  // disallow copies because destructor unmaps
+  EventRingReader(const EventRingReader&);
+  void operator=(const EventRingReader&);
+
+  // Slot of the next record if it has been published, after skipping
+  // ahead past the records the writer has overwritten
+  const EventRing::Slot* available() {
+    const uint64_t head = _header->head.load(std::memory_order_acquire);
+    if (_next >= head) return 0;
+    const EventRing::Slot* slot = &_slots[_next & (_capacity-1)];
+    if (head - _next > _capacity ||
+        slot->seq.load(std::memory_order_acquire) > 2*_next+2) {
+      // The oldest record the writer cannot be writing over. A reader
+      // this far behind keeps one slot of slack.
+      const uint64_t oldest = head - _capacity + 1;
+      if (oldest > _next) {
+        _lost += oldest - _next;
+        _next = oldest;
+        publish();
+      }
+      slot = &_slots[_next & (_capacity-1)];
+    }
+    return slot;
+  }
+
+  void publish() {
+    if (_cursor) {
+      _cursor->next.store(_next, std::memory_order_release);
+    }
+  }
+
+ private:
+  size_t _size;
+  uint64_t _capacity;
+  EventRing::Header* _header;
+  EventRing::Slot* _slots;
+  EventRing::Cursor* _cursor;
+  uint64_t _next;
+  uint64_t _lost;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __EVENT_STREAM_H__
+#define __EVENT_STREAM_H__
+
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Event.h"
+#include "./Options.h"
+#include "./Stepper.h"
+
+// Pull-based stream of the events of a run. Each call to next() integrates
+// only until the next event is available, so a consumer that wants the
+// first few events after some time, or that stops once a condition holds,
+// pays for exactly the steps it uses:
+//
+//   EventStream stream(d);
+//   Event::Record e;
+//   while (stream.next(e) && e.t < 1e4) {}
+//   for (int i = 0; i < 50 && stream.next(e); ) {
+//     if (e.name == "collision") { ...; ++i; }
+//   }
+//
+// Events are located and reflected as by doSimulation, on the surfaces of
+// --events. Only the events of the last step are buffered, which is at
+// most one per surface plus the collision. The stream holds no threads or
+// files, so a consumer cancels it by not pulling further.
+class EventStream {
+ public:
+  explicit EventStream(const Dipole& d,
+                       const Options::Dynamics dynamics = o.dynamics,
+                       const double eps = o.eps,
+                       const Options::Integrator integrator = o.integrator)
+      : _stepper(d, o.h, o.fixed_h, eps, dynamics, integrator),
+        _event(d, 0, &_buffer), _pos(0), _numSteps(0) {}
+
+  // Sets e to the next event. If maxSteps is not negative, gives up and
+  // returns false after that many steps without an event; the stream can
+  // still be pulled again.
+  bool next(Event::Record& e, const long maxSteps = -1) {
+    long steps = 0;
+    while (_pos == _buffer.size()) {
+      if (maxSteps >= 0 && steps >= maxSteps) return false;
+      _buffer.clear();
+      _pos = 0;
+      const long k = _stepper.advanceStep(
+          [this]() { _event.log(_stepper.d, _stepper.t, &_stepper); },
+          [this]() { _event.logCollision(_stepper.d, _stepper.t); });
+      steps += k;
+      _numSteps += k;
+    }
+    e = _buffer[_pos++];
+    return true;
+  }
+
+  // State and time the integration has reached, which may be past the
+  // last event pulled if it was buffered.
+  const Dipole& state() const { return _stepper.d; }
+  double time() const { return _stepper.t; }
+  double stepSize() const { return _stepper.h; }
+  long numSteps() const { return _numSteps; }
+
+ private:
+  // disallow copies because the event logs into the buffer
+  EventStream(const EventStream&);
+  void operator=(const EventStream&);
+
+ private:
+  Stepper _stepper;
+  std::vector<Event::Record> _buffer;
+  Event _event;
+  // Next event of _buffer to return
+  size_t _pos;
+  long _numSteps;
+};
+
+#endif
@@ -0,0 +1,334 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __EVENT_SURFACE_H__
+#define __EVENT_SURFACE_H__
+
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+
+// An event surface is a scalar function g of the dipole state. An event
+// fires on a step where g crosses zero. Surfaces are given on the command
+// line as
+//   lhs=rhs[:dir]
+// where lhs and rhs are arithmetic expressions (+ - * / and parentheses)
+// over the state variables r, theta, phi, pr, ptheta, pphi and E, and dir
+// is one of any (default), pos (g goes from negative to positive) or neg
+// (g goes from positive to negative). theta and phi are in degrees, as
+// with -i. Two surfaces are built in:
+//   beta=0     the dipole aligns with the field. Uses a sign test on
+//              sin(beta) gated on cos(beta) > 0, so no atan2 is needed.
+//   collision  the dipole hits the fixed sphere (r = 1).
+// Each expression is compiled once into a small stack program.
+class EventSurface {
+ public:
+  enum Kind { EXPRESSION, BETA, COLLISION };
+  enum Direction { ANY, POS, NEG };
+
+ private:
+  enum OpCode { PUSH_CONST, PUSH_VAR, ADD, SUB, MUL, DIV, NEG_OP };
+
+  struct Instr {
+    OpCode op;
+    int var;
+    double value;
+  };
+
+  // Maximum evaluation stack depth of a compiled expression
+  static const int MAX_STACK = 16;
+  // Index of E in variable loads. 0-5 index the dipole state directly.
+  static const int VAR_E = 6;
+
+ public:
+  EventSurface() : _kind(COLLISION), _dir(ANY) {}
+
+  Kind kind() const { return _kind; }
+  Direction direction() const { return _dir; }
+  const std::string& name() const { return _name; }
+
+  // Value of g at dipole state d.
+  double evaluate(const Dipole& d) const {
+    if (_kind == BETA) {
+      double s, c;
+      betaSinCos(d, s, c);
+      return s;
+    }
+    if (_kind == COLLISION) {
+      return 0;
+    }
+
+    const double* y = (const double*)(&d);
+    double stack[MAX_STACK];
+    int top = -1;
+    for (int i = 0; i < _program.size(); ++i) {
+      const Instr& in = _program[i];
+      switch (in.op) {
+        case PUSH_CONST:
+          stack[++top] = in.value;
+          break;
+        case PUSH_VAR:
+          stack[++top] =
+              (in.var == VAR_E ? d.get_E() : y[in.var]) * in.value;
+          break;
+        case ADD: stack[top-1] += stack[top]; --top; break;
+        case SUB: stack[top-1] -= stack[top]; --top; break;
+        case MUL: stack[top-1] *= stack[top]; --top; break;
+        case DIV: stack[top-1] /= stack[top]; --top; break;
+        case NEG_OP: stack[top] = -stack[top]; break;
+      }
+    }
+    return stack[0];
+  }
+
+  // Secondary condition checked only once a crossing has been found.
+  // For beta, a sign change of sin(beta) is only a beta = 0 crossing if
+  // cos(beta) > 0; otherwise it is beta = 180.
+  bool accept(const Dipole& d) const {
+    if (_kind != BETA) return true;
+    double s, c;
+    betaSinCos(d, s, c);
+    return c > 0;
+  }
+
+  // Parses a comma-separated list of surfaces. Throws logic_error on
+  // malformed input.
+  static std::vector<EventSurface> parseList(const std::string& list) {
+    std::vector<EventSurface> surfaces;
+    size_t start = 0;
+    while (start <= list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      const std::string item = trim(list.substr(start, end-start));
+      if (!item.empty()) {
+        surfaces.push_back(parse(item));
+      }
+      start = end+1;
+    }
+    if (surfaces.empty()) {
+      throw std::logic_error("no event surfaces given");
+    }
+    return surfaces;
+  }
+
+  // The events logged when --events is not given.
+  static std::vector<EventSurface> defaults() {
+    return parseList("theta=0, phi=0, beta=0, pr=0:neg, ptheta=0, pphi=0,"
+                     "collision");
+  }
+
+  static EventSurface parse(const std::string& text) {
+    EventSurface s;
+    std::string body = text;
+    if (body == "collision") {
+      s._kind = COLLISION;
+      s._name = "collision";
+      return s;
+    }
+
+    const size_t colon = body.rfind(':');
+    if (colon != std::string::npos) {
+      const std::string dir = trim(body.substr(colon+1));
+      if (dir == "any") s._dir = ANY;
+      else if (dir == "pos") s._dir = POS;
+      else if (dir == "neg") s._dir = NEG;
+      else throw std::logic_error("illegal direction \"" + dir + "\" in " +
+                                  text);
+      body = body.substr(0, colon);
+    }
+
+    const size_t eq = body.find('=');
+    if (eq == std::string::npos || body.find('=', eq+1) != std::string::npos) {
+      throw std::logic_error("expected exactly one '=' in " + text);
+    }
+    const std::string lhs = trim(body.substr(0, eq));
+    const std::string rhs = trim(body.substr(eq+1));
+    s._name = lhs + " = " + rhs;
+
+    if (lhs == "beta") {
+      if (rhs != "0") {
+        throw std::logic_error("beta only supports beta=0");
+      }
+      s._kind = BETA;
+      return s;
+    }
+
+    // Compile lhs - (rhs)
+    s._kind = EXPRESSION;
+    Parser lp(lhs, s._program);
+    lp.parseAll();
+    Parser rp(rhs, s._program);
+    rp.parseAll();
+    s.emit(SUB);
+    s.checkStackDepth(text);
+    return s;
+  }
+
+ private:
+  static void betaSinCos(const Dipole& d, double& s, double& c) {
+    // beta = phi - atan2(3 sin(2 theta), 1 + 3 cos(2 theta)), so
+    // sin(beta) and cos(beta) are s and c up to a common positive factor.
+    // With a layout (bx, by) is its field.
+    const double sin_phi = sin(d.get_phi());
+    const double cos_phi = cos(d.get_phi());
+    double by = 3*sin(2*d.get_theta());
+    double bx = 1+3*cos(2*d.get_theta());
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      layout->field(d.get_r()*cos(d.get_theta()), d.get_r()*sin(d.get_theta()),
+                    bx, by);
+    }
+    s = sin_phi*bx - cos_phi*by;
+    c = cos_phi*bx + sin_phi*by;
+  }
+
+  void emit(const OpCode op, const int var = 0, const double value = 0) {
+    Instr in;
+    in.op = op;
+    in.var = var;
+    in.value = value;
+    _program.push_back(in);
+  }
+
+  void checkStackDepth(const std::string& text) const {
+    int depth = 0;
+    for (int i = 0; i < _program.size(); ++i) {
+      const OpCode op = _program[i].op;
+      if (op == PUSH_CONST || op == PUSH_VAR) ++depth;
+      else if (op != NEG_OP) --depth;
+      if (depth > MAX_STACK) {
+        throw std::logic_error("expression too deeply nested: " + text);
+      }
+    }
+  }
+
+  static std::string trim(const std::string& s) {
+    size_t b = 0, e = s.size();
+    while (b < e && isspace(s[b])) ++b;
+    while (e > b && isspace(s[e-1])) --e;
+    return s.substr(b, e-b);
+  }
+
+  // Recursive descent parser emitting postfix code:
+  //   expr   := term (('+'|'-') term)*
+  //   term   := factor (('*'|'/') factor)*
+  //   factor := number | variable | '-' factor | '(' expr ')'
+  class Parser {
+   public:
+    Parser(const std::string& text, std::vector<Instr>& program)
+        : _text(text), _pos(0), _program(program) {}
+
+    void parseAll() {
+      expr();
+      skipSpace();
+      if (_pos != _text.size()) {
+        fail("unexpected character");
+      }
+    }
+
+   private:
+    void expr() {
+      term();
+      for (char c = peek(); c == '+' || c == '-'; c = peek()) {
+        ++_pos;
+        term();
+        emit(c == '+' ? ADD : SUB);
+      }
+    }
+
+    void term() {
+      factor();
+      for (char c = peek(); c == '*' || c == '/'; c = peek()) {
+        ++_pos;
+        factor();
+        emit(c == '*' ? MUL : DIV);
+      }
+    }
+
+    void factor() {
+      const char c = peek();
+      if (c == '-') {
+        ++_pos;
+        factor();
+        emit(NEG_OP);
+      } else if (c == '(') {
+        ++_pos;
+        expr();
+        if (peek() != ')') fail("expected ')'");
+        ++_pos;
+      } else if (isdigit(c) || c == '.') {
+        const char* begin = _text.c_str() + _pos;
+        char* end;
+        const double value = strtod(begin, &end);
+        _pos += end - begin;
+        emit(PUSH_CONST, 0, value);
+      } else if (isalpha(c)) {
+        const size_t start = _pos;
+        while (_pos < _text.size() && isalpha(_text[_pos])) ++_pos;
+        variable(_text.substr(start, _pos-start));
+      } else {
+        fail("expected a number or variable");
+      }
+    }
+
+    void variable(const std::string& v) {
+      // theta and phi are entered in degrees
+      const double deg = 180.0 / M_PI;
+      if (v == "r") emit(PUSH_VAR, 0, 1);
+      else if (v == "theta") emit(PUSH_VAR, 1, deg);
+      else if (v == "phi") emit(PUSH_VAR, 2, deg);
+      else if (v == "pr") emit(PUSH_VAR, 3, 1);
+      else if (v == "ptheta") emit(PUSH_VAR, 4, 1);
+      else if (v == "pphi") emit(PUSH_VAR, 5, 1);
+      else if (v == "E") emit(PUSH_VAR, VAR_E, 1);
+      else fail("unknown variable \"" + v + "\"");
+    }
+
+    char peek() {
+      skipSpace();
+      return _pos < _text.size() ? _text[_pos] : '\0';
+    }
+
+    void skipSpace() {
+      while (_pos < _text.size() && isspace(_text[_pos])) ++_pos;
+    }
+
+    void emit(const OpCode op, const int var = 0, const double value = 0) {
+      Instr in;
+      in.op = op;
+      in.var = var;
+      in.value = value;
+      _program.push_back(in);
+    }
+
+    void fail(const std::string& msg) const {
+      throw std::logic_error(msg + " at position " + std::to_string(_pos) +
+                             " of \"" + _text + "\"");
+    }
+
+   private:
+    const std::string _text;
+    size_t _pos;
+    std::vector<Instr>& _program;
+  };
+
+ private:
+  Kind _kind;
+  Direction _dir;
+  std::string _name;
+  std::vector<Instr> _program;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef __FIXED_STEP_H__
+#define __FIXED_STEP_H__
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Options.h"
+#include "./Physics.h"
+
+// Fixed step integrators without an error estimate, for -c runs. The
+// state is advanced in place.
+//
+//   RK4          classical fourth order Runge-Kutta, 4 evaluations per step
+//   SYMPLECTICn  Stormer-Verlet (n = 2) and its triple jump compositions
+//                (Yoshida 1990) of order n = 4, 6, 8 with 3^(n/2-1)
+//                stages
+//
+// The symplectic schemes need a separable Hamiltonian. With r fixed at 1
+// the sliding Hamiltonian is p^2/2 + V(theta, phi), so the drift is exact
+// from equations 53-54 and the kick takes the torques from equations
+// 56-57. The bouncing Hamiltonian couples r and ptheta and is rejected.
+// The symplectic schemes keep the energy error bounded over long runs
+// instead of drifting, which is what the spectra of long fixed step runs
+// need.
+//
+// steps(y, h, k) takes k steps at once. For the symplectic schemes the
+// last kick of a step and the first kick of the next are merged, saving
+// one evaluation per step.
+class FixedStep {
+ public:
+  FixedStep(const Options::FixedScheme scheme,
+            const Options::Dynamics dynamics)
+      : _scheme(scheme), _dynamics(dynamics), _numEvaluations(0) {
+    if (scheme == Options::RK4 || scheme == Options::GSL) return;
+    if (dynamics != Options::SLIDING) {
+      throw std::logic_error(std::string(name(scheme)) +
+                             " is only valid with sliding dynamics");
+    }
+    // Verlet substep weights
+    std::vector<double> w(1, 1.0);
+    const int order = (scheme == Options::SYMPLECTIC8) ? 8 :
+        (scheme == Options::SYMPLECTIC6) ? 6 :
+        (scheme == Options::SYMPLECTIC4) ? 4 : 2;
+    for (int k = 2; k < order; k += 2) {
+      const double x1 = 1 / (2 - pow(2.0, 1.0 / (k+1)));
+      const double x0 = 1 - 2*x1;
+      std::vector<double> next;
+      for (int i = 0; i < w.size(); ++i) next.push_back(x1 * w[i]);
+      for (int i = 0; i < w.size(); ++i) next.push_back(x0 * w[i]);
+      for (int i = 0; i < w.size(); ++i) next.push_back(x1 * w[i]);
+      w = next;
+    }
+    // Each substep is kick w/2, drift w, kick w/2; adjacent kicks merge
+    _drift = w;
+    _kick.assign(w.size()+1, 0);
+    for (int i = 0; i < w.size(); ++i) {
+      _kick[i] += w[i] / 2;
+      _kick[i+1] += w[i] / 2;
+    }
+  }
+
+  static const char* name(const Options::FixedScheme scheme) {
+    switch (scheme) {
+      case Options::RK4: return "rk4";
+      case Options::SYMPLECTIC2: return "sym2";
+      case Options::SYMPLECTIC4: return "sym4";
+      case Options::SYMPLECTIC6: return "sym6";
+      case Options::SYMPLECTIC8: return "sym8";
+      default: return "gsl";
+    }
+  }
+
+  long numEvaluations() const { return _numEvaluations; }
+
+  void step(double y[6], const double h) {
+    steps(y, h, 1);
+  }
+
+  void steps(double y[6], const double h, const long k) {
+    if (k <= 0) return;
+    if (_scheme == Options::RK4) {
+      for (long j = 0; j < k; ++j) {
+        rk4(y, h);
+      }
+      return;
+    }
+    const int s = _drift.size();
+    kick(y, _kick[0] * h);
+    for (long j = 0; j < k; ++j) {
+      for (int i = 0; i < s-1; ++i) {
+        drift(y, _drift[i] * h);
+        kick(y, _kick[i+1] * h);
+      }
+      drift(y, _drift[s-1] * h);
+      kick(y, ((j < k-1) ? _kick[s] + _kick[0] : _kick[s]) * h);
+    }
+  }
+
+ private:
+  void derivatives(const double y[6], double f[6]) {
+    ++_numEvaluations;
+    Physics::get_derivatives(*(const Dipole*)(y), f, _dynamics);
+  }
+
+  void rk4(double y[6], const double h) {
+    double k1[6], k2[6], k3[6], k4[6], yt[6];
+    derivatives(y, k1);
+    for (int i = 0; i < 6; ++i) yt[i] = y[i] + 0.5*h*k1[i];
+    derivatives(yt, k2);
+    for (int i = 0; i < 6; ++i) yt[i] = y[i] + 0.5*h*k2[i];
+    derivatives(yt, k3);
+    for (int i = 0; i < 6; ++i) yt[i] = y[i] + h*k3[i];
+    derivatives(yt, k4);
+    for (int i = 0; i < 6; ++i) {
+      y[i] += (h/6) * (k1[i] + 2*k2[i] + 2*k3[i] + k4[i]);
+    }
+  }
+
+  // Positions theta, phi
+  static void drift(double y[6], const double h) {
+    y[1] += h * y[4] / (y[0]*y[0]);
+    y[2] += h * 10 * y[5];
+  }
+
+  // Momenta ptheta, pphi
+  void kick(double y[6], const double h) {
+    double f[6];
+    derivatives(y, f);
+    y[4] += h * f[4];
+    y[5] += h * f[5];
+  }
+
+ private:
+  const Options::FixedScheme _scheme;
+  const Options::Dynamics _dynamics;
+  long _numEvaluations;
+  // Coefficients of the symplectic scheme: kick _kick[0], then drift
+  // _drift[i] and kick _kick[i+1] for each stage i
+  std::vector<double> _drift;
+  std::vector<double> _kick;
+};
+
+#endif
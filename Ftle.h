@@ -0,0 +1,265 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __FTLE_H__
+#define __FTLE_H__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Options.h"
+#include "./Physics.h"
+#include "./Variational.h"
+
+// Finite-time Lyapunov exponents over a grid of initial conditions. The
+// grid varies two state variables of a base initial condition; the other
+// four keep their base values. Each point is integrated once together
+// with its flow map gradient Phi (see Variational.h), and at every horizon
+// T its FTLE is
+//   ln(sigma_max(Phi(T))) / T
+// where sigma_max is the largest singular value, found as the square root
+// of the largest eigenvalue of Phi^T Phi. Sliding runs use the 4x4 block
+// over theta, phi, ptheta and pphi. Collisions are located and the
+// variations jumped by the saltation matrix, as for periodic orbits.
+//
+// Phi grows exponentially, so its entries get a relative error tolerance
+// of eps and Phi is rescaled, with the scale kept as a logarithm, before
+// it can overflow.
+//
+// Points that are not valid initial conditions (r < 1), integrations that
+// fail and trajectories that graze the sphere (|pr| < sqrt(eps) at a
+// collision) have FTLE NaN from then on.
+//
+// The map is written as a binary file: the 8 bytes "MAGPHYXF", uint32
+// version (1), nx, ny, numHorizons, xVar, yVar and dynamics (0 bouncing,
+// 1 sliding), doubles xMin, xMax, yMin, yMax and the horizons, then one
+// float32 image of ny rows of nx values per horizon. Variables are 0-5
+// for r, theta, phi, pr, ptheta and pphi, and angles are in radians.
+class FtleMap {
+ public:
+  FtleMap(const Dipole& base, const Options::GridAxis& x,
+          const Options::GridAxis& y, const std::vector<double>& horizons,
+          const double eps, const Options::Dynamics dynamics)
+      : _base(base), _x(x), _y(y), _horizons(horizons), _eps(eps),
+        _dynamics(dynamics) {
+    if (x.n < 1 || y.n < 1) {
+      throw std::logic_error("An FTLE grid needs at least one point per axis");
+    }
+    if (x.var == y.var) {
+      throw std::logic_error("The FTLE axes must be different variables");
+    }
+    if (dynamics == Options::SLIDING &&
+        (x.var == 0 || x.var == 3 || y.var == 0 || y.var == 3)) {
+      throw std::logic_error("Sliding FTLE maps cannot vary r or pr");
+    }
+    if (horizons.empty()) {
+      throw std::logic_error("An FTLE map needs --horizons");
+    }
+    for (int k = 0; k < horizons.size(); ++k) {
+      if (horizons[k] <= 0 || (k > 0 && horizons[k] <= horizons[k-1])) {
+        throw std::logic_error("Horizons must be positive and increasing");
+      }
+    }
+  }
+
+  long size() const { return (long)_x.n * _y.n; }
+  int numHorizons() const { return _horizons.size(); }
+
+  // Initial condition of grid point i. x varies fastest.
+  Dipole point(const long i) const {
+    double y[6];
+    const double* b = (const double*)(&_base);
+    for (int j = 0; j < 6; ++j) y[j] = b[j];
+    y[_x.var] = value(_x, i % _x.n);
+    y[_y.var] = value(_y, i / _x.n);
+    if (_dynamics == Options::SLIDING) {
+      y[0] = 1;
+      y[3] = 0;
+    }
+    return Dipole(y[0], y[1], y[2], y[3], y[4], y[5]);
+  }
+
+  // Sets ftle[k] to the FTLE of grid point i at horizon k.
+  void compute(const long i, float* ftle) const {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for (int k = 0; k < _horizons.size(); ++k) ftle[k] = nan;
+
+    const Dipole d = point(i);
+    if (d.get_r() < 1) return;
+    double y[42];
+    const double* pd = (const double*)(&d);
+    for (int j = 0; j < 6; ++j) y[j] = pd[j];
+    for (int j = 0; j < 36; ++j) y[6+j] = (j % 7 == 0) ? 1 : 0;
+
+    Options::Dynamics dynamics = _dynamics;
+    gsl_odeiv2_system sys = { variationalFunc, 0, 42, &dynamics };
+    gsl_odeiv2_step* step = gsl_odeiv2_step_alloc(gsl_odeiv2_step_rk8pd, 42);
+    gsl_odeiv2_control* control =
+        gsl_odeiv2_control_standard_new(_eps, _eps, 1, 0);
+    gsl_odeiv2_evolve* evolve = gsl_odeiv2_evolve_alloc(42);
+
+    auto value = [](const double* s) { return s[0] - 1; };
+    auto gradient = [](const double* s, double dg[6]) {
+      (void)(s);
+      for (int j = 0; j < 6; ++j) dg[j] = (j == 0) ? 1 : 0;
+    };
+
+    double t = 0;
+    double h = o.h;
+    double logScale = 0;
+    int k = 0;
+    try {
+      while (k < _horizons.size()) {
+        double y0[42];
+        std::copy(y, y+42, y0);
+        const double t0 = t;
+        const int status = gsl_odeiv2_evolve_apply(
+            evolve, control, step, &sys, &t, _horizons[k], &h, y);
+        if (status != GSL_SUCCESS) {
+          throw std::logic_error(gsl_strerror(status));
+        }
+        if (y[0] < 1 && _dynamics == Options::BOUNCING) {
+          t = t0 + locateCrossing(sys, step, t0, y0, t - t0, y, _dynamics,
+                                  value, gradient);
+          // The saltation diverges as pr -> 0, and a dipole resting on
+          // the sphere chatters without end
+          if (fabs(y[3]) < sqrt(_eps)) {
+            throw std::logic_error("grazing collision");
+          }
+          double fp[6];
+          reflectVariations(y, _dynamics, fp);
+          gsl_odeiv2_evolve_reset(evolve);
+          gsl_odeiv2_step_reset(step);
+        }
+        rescale(y+6, logScale);
+        for (; k < _horizons.size() && t >= _horizons[k]; ++k) {
+          ftle[k] = (logScale + logSigmaMax(y+6)) / _horizons[k];
+        }
+      }
+    } catch (std::logic_error& e) {
+      // The remaining horizons stay NaN
+    }
+    gsl_odeiv2_evolve_free(evolve);
+    gsl_odeiv2_control_free(control);
+    gsl_odeiv2_step_free(step);
+  }
+
+  // Writes the map. ftle holds numHorizons() values per grid point.
+  void write(FILE* out, const std::vector<float>& ftle) const {
+    const uint32_t header[7] = { 1, (uint32_t)_x.n, (uint32_t)_y.n,
+                                 (uint32_t)_horizons.size(),
+                                 (uint32_t)_x.var, (uint32_t)_y.var,
+                                 (uint32_t)_dynamics };
+    const double ranges[4] = { _x.min, _x.max, _y.min, _y.max };
+    fwrite("MAGPHYXF", 1, 8, out);
+    fwrite(header, sizeof(uint32_t), 7, out);
+    fwrite(ranges, sizeof(double), 4, out);
+    fwrite(_horizons.data(), sizeof(double), _horizons.size(), out);
+    std::vector<float> image(size());
+    for (int k = 0; k < _horizons.size(); ++k) {
+      for (long i = 0; i < size(); ++i) {
+        image[i] = ftle[i * _horizons.size() + k];
+      }
+      fwrite(image.data(), sizeof(float), image.size(), out);
+    }
+  }
+
+  static const char* variableName(const int var) {
+    static const char* names[6] =
+        { "r", "theta", "phi", "pr", "ptheta", "pphi" };
+    return names[var];
+  }
+
+ private:
+  static double value(const Options::GridAxis& a, const int i) {
+    return (a.n == 1) ? a.min : a.min + (a.max - a.min) * i / (a.n - 1);
+  }
+
+  // Keeps the entries of Phi below 1e100. The system is linear in Phi, so
+  // it can be scaled at any time.
+  static void rescale(double Phi[36], double& logScale) {
+    double m = 0;
+    for (int j = 0; j < 36; ++j) m = std::max(m, fabs(Phi[j]));
+    if (m > 1e100) {
+      for (int j = 0; j < 36; ++j) Phi[j] /= m;
+      logScale += log(m);
+    }
+  }
+
+  // ln of the largest singular value of Phi, from the largest eigenvalue
+  // of Phi^T Phi by cyclic Jacobi rotations
+  double logSigmaMax(const double Phi[36]) const {
+    static const int ALL[6] = { 0, 1, 2, 3, 4, 5 };
+    static const int ANGULAR[4] = { 1, 2, 4, 5 };
+    const int* idx = (_dynamics == Options::SLIDING) ? ANGULAR : ALL;
+    const int n = (_dynamics == Options::SLIDING) ? 4 : 6;
+
+    double a[6][6];
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        double sum = 0;
+        for (int k = 0; k < n; ++k) {
+          sum += Phi[6*idx[k]+idx[i]] * Phi[6*idx[k]+idx[j]];
+        }
+        a[i][j] = sum;
+      }
+    }
+    for (int sweep = 0; sweep < 50; ++sweep) {
+      double off = 0, diag = 0;
+      for (int i = 0; i < n; ++i) {
+        diag += a[i][i] * a[i][i];
+        for (int j = i+1; j < n; ++j) off += a[i][j] * a[i][j];
+      }
+      if (off <= 1e-30 * diag) break;
+      for (int p = 0; p < n; ++p) {
+        for (int q = p+1; q < n; ++q) {
+          if (a[p][q] == 0) continue;
+          const double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+          const double t = ((theta >= 0) ? 1 : -1) /
+              (fabs(theta) + sqrt(theta * theta + 1));
+          const double c = 1 / sqrt(t * t + 1), s = t * c;
+          for (int k = 0; k < n; ++k) {
+            const double akp = a[k][p], akq = a[k][q];
+            a[k][p] = c * akp - s * akq;
+            a[k][q] = s * akp + c * akq;
+          }
+          for (int k = 0; k < n; ++k) {
+            const double apk = a[p][k], aqk = a[q][k];
+            a[p][k] = c * apk - s * aqk;
+            a[q][k] = s * apk + c * aqk;
+          }
+        }
+      }
+    }
+    double lambda = 0;
+    for (int i = 0; i < n; ++i) lambda = std::max(lambda, a[i][i]);
+    return 0.5 * log(lambda);
+  }
+
+ private:
+  const Dipole _base;
+  const Options::GridAxis _x;
+  const Options::GridAxis _y;
+  const std::vector<double> _horizons;
+  const double _eps;
+  const Options::Dynamics _dynamics;
+};
+
+#endif
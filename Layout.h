@@ -0,0 +1,486 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An arrangement of fixed magnets in the plane of the free sphere, read
+// from a text file (--layout) with one magnet per line:
+//   x y alpha
+// the center in sphere diameters and the moment direction in degrees.
+// Lines starting with # are comments. The default system is the layout
+// "0 0 0". A magnet at the origin is required, since the state keeps the
+// polar coordinates of the free sphere about it, and no two magnets may
+// overlap.
+//
+// All spheres have unit diameter and moment, so the fixed field is
+// B = -grad psi with
+//   psi = sum_k m_k.q_k / (6 |q_k|^3),   q_k = p - p_k
+// which for the magnet at the origin gives Dipole::B. The potential
+// energy of the free sphere with moment m = (cos phi, sin phi) is
+// V = -m.B = m.grad psi.
+//
+// Small layouts are summed exactly. Larger ones are binned into square
+// cells 4 diameters wide over their bounding box and a margin. The
+// magnets in the 3x3 cells around the free sphere are summed exactly and
+// psi of all others, which are at least a cell away, is read from a
+// tensor Chebyshev series precomputed per cell. The series is smooth, so
+// the forces stay the gradient of an energy, and a step costs the same
+// however many magnets are far away. Outside the tabulated region the
+// sum is exact.
+class MagnetLayout {
+ public:
+  // Layouts with at most this many magnets are summed exactly everywhere
+  static const int EXACT_LIMIT = 32;
+  // Chebyshev points per axis of a cell
+  static const int DEGREE = 24;
+  // Cells of margin around the bounding box of the magnets
+  static const int MARGIN = 2;
+
+  struct Magnet {
+    double x;
+    double y;
+    double alpha;
+    // Moment (cos alpha, sin alpha)
+    double mx;
+    double my;
+  };
+
+  // Partial derivatives of psi: d[m][n] is the m-th derivative with n of
+  // them in y, for m = 1..3.
+  struct Potential {
+    double d[4][4];
+  };
+
+  // The layout used by the physics, or 0 for the single fixed magnet at
+  // the origin.
+  static const MagnetLayout* active() { return current(); }
+  static void setActive(const MagnetLayout* layout) { current() = layout; }
+
+  // Reads the layout in filename. Throws logic_error on malformed input.
+  explicit MagnetLayout(const std::string& filename)
+      : _filename(filename), _cell(4), _x0(0), _y0(0), _nx(0), _ny(0) {
+    read(filename);
+    if (_magnets.size() > EXACT_LIMIT) {
+      buildGrid();
+      checkOverlaps();
+      tabulate();
+    } else {
+      checkOverlaps();
+    }
+  }
+
+  const std::string& filename() const { return _filename; }
+  int size() const { return _magnets.size(); }
+  const Magnet& magnet(const int k) const { return _magnets[k]; }
+  bool tabulated() const { return !_far.empty(); }
+
+  // Hash of the magnets, for the configurations of cached and
+  // checkpointed runs.
+  std::string signature() const {
+    uint64_t h = 14695981039346656037ULL;
+    for (int k = 0; k < _magnets.size(); ++k) {
+      const double v[3] = { _magnets[k].x, _magnets[k].y, _magnets[k].alpha };
+      const unsigned char* b = (const unsigned char*)v;
+      for (int i = 0; i < sizeof(v); ++i) {
+        h = (h ^ b[i]) * 1099511628211ULL;
+      }
+    }
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%d:%016llx", size(), (unsigned long long)h);
+    return buf;
+  }
+
+  // Derivatives of psi at (x, y) up to the given order (1 to 3).
+  void potential(const double x, const double y, const int order,
+                 Potential& p) const {
+    for (int m = 0; m < 4; ++m) {
+      for (int n = 0; n < 4; ++n) p.d[m][n] = 0;
+    }
+    int i, j;
+    if (!cellOf(x, y, i, j)) {
+      for (int k = 0; k < _magnets.size(); ++k) {
+        addExact(_magnets[k], x, y, order, p);
+      }
+      return;
+    }
+    for (int ci = std::max(0, i-1); ci <= std::min(_nx-1, i+1); ++ci) {
+      for (int cj = std::max(0, j-1); cj <= std::min(_ny-1, j+1); ++cj) {
+        const std::vector<int>& c = _cells[ci*_ny + cj];
+        for (int k = 0; k < c.size(); ++k) {
+          addExact(_magnets[c[k]], x, y, order, p);
+        }
+      }
+    }
+    addFar(i, j, x, y, order, p);
+  }
+
+  // Field B = -grad psi at (x, y).
+  void field(const double x, const double y, double& bx, double& by) const {
+    Potential p;
+    potential(x, y, 1, p);
+    bx = -p.d[1][0];
+    by = -p.d[1][1];
+  }
+
+  // Potential energy of the free sphere at polar position (r, theta) with
+  // moment angle phi. If g is given, also its gradient with respect to
+  // (r, theta, phi), and if H is given its Hessian in the order rr,
+  // rtheta, rphi, thetatheta, thetaphi, phiphi.
+  double energy(const double r, const double theta, const double phi,
+                double* g = 0, double* H = 0) const {
+    const double c = cos(theta);
+    const double s = sin(theta);
+    const double cp = cos(phi);
+    const double sp = sin(phi);
+    Potential p;
+    potential(r*c, r*s, H ? 3 : (g ? 2 : 1), p);
+    const double (*d)[4] = p.d;
+
+    // V = U(x, y, phi) = cos(phi) psi_x + sin(phi) psi_y
+    const double U = cp*d[1][0] + sp*d[1][1];
+    if (!g) return U;
+    const double Ux = cp*d[2][0] + sp*d[2][1];
+    const double Uy = cp*d[2][1] + sp*d[2][2];
+    const double Up = -sp*d[1][0] + cp*d[1][1];
+    g[0] = c*Ux + s*Uy;
+    g[1] = r*(-s*Ux + c*Uy);
+    g[2] = Up;
+    if (!H) return U;
+    const double Uxx = cp*d[3][0] + sp*d[3][1];
+    const double Uxy = cp*d[3][1] + sp*d[3][2];
+    const double Uyy = cp*d[3][2] + sp*d[3][3];
+    const double Uxp = -sp*d[2][0] + cp*d[2][1];
+    const double Uyp = -sp*d[2][1] + cp*d[2][2];
+    H[0] = c*c*Uxx + 2*c*s*Uxy + s*s*Uyy;
+    H[1] = r*(-c*s*Uxx + (c*c-s*s)*Uxy + c*s*Uyy) + (-s*Ux + c*Uy);
+    H[2] = c*Uxp + s*Uyp;
+    H[3] = r*r*(s*s*Uxx - 2*c*s*Uxy + c*c*Uyy) - r*(c*Ux + s*Uy);
+    H[4] = r*(-s*Uxp + c*Uyp);
+    H[5] = -U;
+    return U;
+  }
+
+  // Distance from (x, y) to the center of the nearest magnet, so that the
+  // free sphere touches it at 1, and the magnet in nearest. Distances
+  // beyond a cell, where nothing can be touched, are reported as a cell
+  // with nearest = -1.
+  double separation(const double x, const double y, int* nearest = 0) const {
+    double best = _cell * _cell;
+    int bestK = -1;
+    int i, j;
+    if (_cells.empty()) {
+      for (int k = 0; k < _magnets.size(); ++k) {
+        nearer(k, x, y, best, bestK);
+      }
+    } else if (cellOf(x, y, i, j)) {
+      for (int ci = std::max(0, i-1); ci <= std::min(_nx-1, i+1); ++ci) {
+        for (int cj = std::max(0, j-1); cj <= std::min(_ny-1, j+1); ++cj) {
+          const std::vector<int>& c = _cells[ci*_ny + cj];
+          for (int k = 0; k < c.size(); ++k) nearer(c[k], x, y, best, bestK);
+        }
+      }
+    }
+    if (nearest) *nearest = bestK;
+    return sqrt(best);
+  }
+
+ private:
+  static const MagnetLayout*& current() {
+    static const MagnetLayout* layout = 0;
+    return layout;
+  }
+
+  void read(const std::string& filename) {
+    FILE* in = fopen(filename.c_str(), "r");
+    if (!in) {
+      throw std::logic_error("Unable to open " + filename);
+    }
+    char line[1024];
+    int lineNumber = 0;
+    bool origin = false;
+    while (fgets(line, sizeof(line), in)) {
+      ++lineNumber;
+      const char* c = line;
+      while (*c == ' ' || *c == '\t') ++c;
+      if (*c == '#' || *c == '\n' || *c == '\r' || *c == 0) continue;
+      Magnet m;
+      char extra;
+      if (sscanf(c, "%lf %lf %lf %c", &m.x, &m.y, &m.alpha, &extra) != 3) {
+        fclose(in);
+        throw std::logic_error(filename + ":" + std::to_string(lineNumber) +
+                               ": expected x y alpha");
+      }
+      m.mx = cos(m.alpha * M_PI / 180);
+      m.my = sin(m.alpha * M_PI / 180);
+      origin = origin || (m.x == 0 && m.y == 0);
+      _magnets.push_back(m);
+    }
+    fclose(in);
+    if (!origin) {
+      throw std::logic_error(filename + " has no magnet at the origin");
+    }
+  }
+
+  void buildGrid() {
+    double xmin = _magnets[0].x, xmax = xmin;
+    double ymin = _magnets[0].y, ymax = ymin;
+    for (int k = 1; k < _magnets.size(); ++k) {
+      xmin = std::min(xmin, _magnets[k].x);
+      xmax = std::max(xmax, _magnets[k].x);
+      ymin = std::min(ymin, _magnets[k].y);
+      ymax = std::max(ymax, _magnets[k].y);
+    }
+    _x0 = xmin - MARGIN * _cell;
+    _y0 = ymin - MARGIN * _cell;
+    _nx = (int)floor((xmax - xmin) / _cell) + 2*MARGIN + 1;
+    _ny = (int)floor((ymax - ymin) / _cell) + 2*MARGIN + 1;
+    _cells.resize(_nx * _ny);
+    for (int k = 0; k < _magnets.size(); ++k) {
+      int i = 0, j = 0;
+      cellOf(_magnets[k].x, _magnets[k].y, i, j);
+      _cells[i*_ny + j].push_back(k);
+    }
+  }
+
+  void checkOverlaps() const {
+    for (int k = 0; k < _magnets.size(); ++k) {
+      double best = 1;
+      int bestK = -1;
+      if (_cells.empty()) {
+        for (int l = 0; l < _magnets.size(); ++l) {
+          if (l != k) nearer(l, _magnets[k].x, _magnets[k].y, best, bestK);
+        }
+      } else {
+        // Neighbors within a diameter are in the 3x3 cells around
+        int i = 0, j = 0;
+        cellOf(_magnets[k].x, _magnets[k].y, i, j);
+        for (int ci = i-1; ci <= i+1; ++ci) {
+          for (int cj = j-1; cj <= j+1; ++cj) {
+            const std::vector<int>& c = _cells[ci*_ny + cj];
+            for (int l = 0; l < c.size(); ++l) {
+              if (c[l] != k) {
+                nearer(c[l], _magnets[k].x, _magnets[k].y, best, bestK);
+              }
+            }
+          }
+        }
+      }
+      if (bestK >= 0 && best < 1) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "Magnets at (%g, %g) and (%g, %g) overlap",
+                 _magnets[k].x, _magnets[k].y, _magnets[bestK].x,
+                 _magnets[bestK].y);
+        throw std::logic_error(_filename + ": " + buf);
+      }
+    }
+  }
+
+  // Chebyshev series of psi of the magnets outside the 3x3 cells around
+  // each cell, from its values at the Chebyshev points. Each of these
+  // sums over the layout, so the columns of cells are split over threads.
+  void tabulate() {
+    const int N = DEGREE;
+    std::vector<double> nodes(N);
+    std::vector<double> T(N * N);
+    for (int p = 0; p < N; ++p) {
+      nodes[p] = cos(M_PI * (p + 0.5) / N);
+      for (int a = 0; a < N; ++a) {
+        T[a*N + p] = cos(M_PI * a * (p + 0.5) / N) * (a == 0 ? 1.0 : 2.0) / N;
+      }
+    }
+    std::vector<int> cellI(_magnets.size()), cellJ(_magnets.size());
+    for (int k = 0; k < _magnets.size(); ++k) {
+      cellOf(_magnets[k].x, _magnets[k].y, cellI[k], cellJ[k]);
+    }
+
+    _far.assign(_nx * _ny * N * N, 0);
+    auto column = [&](const int i) {
+      std::vector<double> f(N * N), g(N * N);
+      for (int j = 0; j < _ny; ++j) {
+        for (int p = 0; p < N; ++p) {
+          const double x = _x0 + _cell * (i + (nodes[p] + 1) / 2);
+          for (int q = 0; q < N; ++q) {
+            const double y = _y0 + _cell * (j + (nodes[q] + 1) / 2);
+            double psi = 0;
+            for (int k = 0; k < _magnets.size(); ++k) {
+              if (abs(cellI[k] - i) <= 1 && abs(cellJ[k] - j) <= 1) continue;
+              const double qx = x - _magnets[k].x;
+              const double qy = y - _magnets[k].y;
+              const double r2 = qx*qx + qy*qy;
+              psi += (_magnets[k].mx*qx + _magnets[k].my*qy) /
+                  (6 * r2 * sqrt(r2));
+            }
+            f[p*N + q] = psi;
+          }
+        }
+        // Transform in y, then in x
+        for (int p = 0; p < N; ++p) {
+          for (int b = 0; b < N; ++b) {
+            double sum = 0;
+            for (int q = 0; q < N; ++q) sum += T[b*N + q] * f[p*N + q];
+            g[p*N + b] = sum;
+          }
+        }
+        double* c = &_far[(i*_ny + j) * N * N];
+        for (int a = 0; a < N; ++a) {
+          for (int b = 0; b < N; ++b) {
+            double sum = 0;
+            for (int p = 0; p < N; ++p) sum += T[a*N + p] * g[p*N + b];
+            c[a*N + b] = sum;
+          }
+        }
+      }
+    };
+    const int numThreads = std::max(1, std::min(
+        (int)std::thread::hardware_concurrency(), _nx));
+    std::vector<std::thread> threads;
+    for (int w = 0; w < numThreads; ++w) {
+      threads.push_back(std::thread([&, w]() {
+        for (int i = w; i < _nx; i += numThreads) column(i);
+      }));
+    }
+    for (int w = 0; w < threads.size(); ++w) {
+      threads[w].join();
+    }
+  }
+
+  bool cellOf(const double x, const double y, int& i, int& j) const {
+    if (_cells.empty()) return false;
+    const double fx = floor((x - _x0) / _cell);
+    const double fy = floor((y - _y0) / _cell);
+    if (fx < 0 || fx >= _nx || fy < 0 || fy >= _ny) return false;
+    i = (int)fx;
+    j = (int)fy;
+    return true;
+  }
+
+  void nearer(const int k, const double x, const double y, double& best,
+              int& bestK) const {
+    const double dx = x - _magnets[k].x;
+    const double dy = y - _magnets[k].y;
+    const double d2 = dx*dx + dy*dy;
+    if (d2 < best) {
+      best = d2;
+      bestK = k;
+    }
+  }
+
+  // Adds the derivatives of psi of magnet m, with
+  //   psi_i   = -(3 a q_i / r^5 - m_i / r^3) / 6
+  //   psi_ij  = -((m_i q_j + m_j q_i + a d_ij) / r^5 - 5 a q_i q_j / r^7) / 2
+  //   psi_ijk = -((m_i d_jk + m_j d_ik + m_k d_ij) / r^5
+  //               - 5 (m_i q_j q_k + m_j q_i q_k + m_k q_i q_j
+  //                    + a (d_ij q_k + d_ik q_j + d_jk q_i)) / r^7
+  //               + 35 a q_i q_j q_k / r^9) / 2
+  // where q = p - p_m, a = m.q and d is the Kronecker delta.
+  static void addExact(const Magnet& m, const double x, const double y,
+                       const int order, Potential& p) {
+    const double q[2] = { x - m.x, y - m.y };
+    const double mm[2] = { m.mx, m.my };
+    const double r2 = q[0]*q[0] + q[1]*q[1];
+    // Only placeholder states such as Dipole() can be at a center, since
+    // collisions keep the free sphere a diameter away
+    if (r2 == 0) return;
+    const double ir2 = 1 / r2;
+    const double ir3 = ir2 / sqrt(r2);
+    const double ir5 = ir3 * ir2;
+    const double ir7 = ir5 * ir2;
+    const double a = mm[0]*q[0] + mm[1]*q[1];
+    for (int i = 0; i < 2; ++i) {
+      p.d[1][i] -= (3*a*q[i]*ir5 - mm[i]*ir3) / 6;
+    }
+    if (order < 2) return;
+    for (int n = 0; n < 3; ++n) {
+      const int i = (n >= 2), j = (n >= 1);
+      p.d[2][n] -= ((mm[i]*q[j] + mm[j]*q[i] + a*(i == j)) * ir5 -
+                    5*a*q[i]*q[j]*ir7) / 2;
+    }
+    if (order < 3) return;
+    const double ir9 = ir7 * ir2;
+    for (int n = 0; n < 4; ++n) {
+      const int i = (n >= 3), j = (n >= 2), k = (n >= 1);
+      const double t5 = mm[i]*(j == k) + mm[j]*(i == k) + mm[k]*(i == j);
+      const double t7 = mm[i]*q[j]*q[k] + mm[j]*q[i]*q[k] + mm[k]*q[i]*q[j] +
+          a*((i == j)*q[k] + (i == k)*q[j] + (j == k)*q[i]);
+      p.d[3][n] -= (t5*ir5 - 5*t7*ir7 + 35*a*q[i]*q[j]*q[k]*ir9) / 2;
+    }
+  }
+
+  // Chebyshev polynomials T_a at X and their derivatives up to order
+  static void chebyshev(const double X, const int order, double T[4][DEGREE]) {
+    for (int k = 0; k <= order; ++k) {
+      T[k][0] = (k == 0) ? 1 : 0;
+      T[k][1] = (k == 0) ? X : (k == 1 ? 1 : 0);
+      for (int a = 1; a+1 < DEGREE; ++a) {
+        T[k][a+1] = 2*X*T[k][a] - T[k][a-1] + (k > 0 ? 2*k*T[k-1][a] : 0);
+      }
+    }
+  }
+
+  // Adds the derivatives of the tabulated far psi of cell (i, j)
+  void addFar(const int i, const int j, const double x, const double y,
+              const int order, Potential& p) const {
+    const int N = DEGREE;
+    const double scale = 2 / _cell;
+    double tx[4][DEGREE];
+    double ty[4][DEGREE];
+    chebyshev(scale * (x - _x0) - 2*i - 1, order, tx);
+    chebyshev(scale * (y - _y0) - 2*j - 1, order, ty);
+    // rows[n][a] = sum_b c_ab T_b^(n)(Y)
+    const double* c = &_far[(i*_ny + j) * N * N];
+    double rows[4][DEGREE];
+    for (int a = 0; a < N; ++a) {
+      for (int n = 0; n <= order; ++n) {
+        double sum = 0;
+        for (int b = 0; b < N; ++b) sum += c[a*N + b] * ty[n][b];
+        rows[n][a] = sum;
+      }
+    }
+    double s = 1;
+    for (int m = 1; m <= order; ++m) {
+      s *= scale;
+      for (int n = 0; n <= m; ++n) {
+        double sum = 0;
+        for (int a = 0; a < N; ++a) sum += tx[m-n][a] * rows[n][a];
+        p.d[m][n] += s * sum;
+      }
+    }
+  }
+
+ private:
+  const std::string _filename;
+  std::vector<Magnet> _magnets;
+  // Cell side in diameters
+  const double _cell;
+  // Grid of cells with corner (_x0, _y0), empty if summed exactly
+  double _x0;
+  double _y0;
+  int _nx;
+  int _ny;
+  std::vector<std::vector<int> > _cells;
+  // Chebyshev coefficients c_ab of each cell, DEGREE^2 per cell
+  std::vector<double> _far;
+};
+
+#endif
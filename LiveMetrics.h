@@ -0,0 +1,271 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __LIVE_METRICS_H__
+#define __LIVE_METRICS_H__
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+// Live counters of a running magphyxc, one slot per worker, published
+// where magphyx-top can read them while the simulation runs.
+//
+// With a name the counters live in the POSIX shared memory segment
+// /magphyx-name, which is removed when the run ends; otherwise in private
+// memory, where only the progress line reads them. Each slot is written
+// by its worker alone, behind a sequence counter: the writer makes it odd
+// while updating, and readers retry until they copy the slot with the
+// same even count before and after. Neither side ever waits on the other.
+//
+// Workers publish steps, t and h after every step, which is a handful of
+// stores to a cache line the worker owns, and dE only when an event is
+// logged, since it needs the energy. Rates are left to the reader.
+class LiveMetrics {
+ public:
+  static const uint32_t VERSION = 1;
+
+  enum State { IDLE, RUNNING, DONE };
+
+  // Consistent copy of a slot
+  struct Snapshot {
+    int state;
+    // Ensemble record being run, or -1
+    long record;
+    long runs;
+    long steps;
+    long events;
+    double t;
+    double h;
+    double dE;
+  };
+
+  class Slot {
+   public:
+    void start(const long record) {
+      begin();
+      _state.store(RUNNING, std::memory_order_relaxed);
+      _record.store(record, std::memory_order_relaxed);
+      _steps.store(0, std::memory_order_relaxed);
+      _events.store(0, std::memory_order_relaxed);
+      _t.store(0, std::memory_order_relaxed);
+      _dE.store(0, std::memory_order_relaxed);
+      end();
+    }
+
+    void step(const long steps, const long events, const double t,
+              const double h) {
+      begin();
+      _steps.store(steps, std::memory_order_relaxed);
+      _events.store(events, std::memory_order_relaxed);
+      _t.store(t, std::memory_order_relaxed);
+      _h.store(h, std::memory_order_relaxed);
+      end();
+    }
+
+    void energy(const double dE) {
+      begin();
+      _dE.store(dE, std::memory_order_relaxed);
+      end();
+    }
+
+    // The run is over. The slot is idle until the next start().
+    void finish() {
+      begin();
+      _state.store(IDLE, std::memory_order_relaxed);
+      _runs.store(_runs.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+      end();
+    }
+
+    // The worker has no more runs.
+    void done() {
+      begin();
+      _state.store(DONE, std::memory_order_relaxed);
+      end();
+    }
+
+    // Returns false if the slot stays mid-update, as when its process died
+    // while writing.
+    bool read(Snapshot& s) const {
+      for (int tries = 0; tries < 100000; ++tries) {
+        const uint64_t before = _seq.load(std::memory_order_acquire);
+        s.state = _state.load(std::memory_order_relaxed);
+        s.record = _record.load(std::memory_order_relaxed);
+        s.runs = _runs.load(std::memory_order_relaxed);
+        s.steps = _steps.load(std::memory_order_relaxed);
+        s.events = _events.load(std::memory_order_relaxed);
+        s.t = _t.load(std::memory_order_relaxed);
+        s.h = _h.load(std::memory_order_relaxed);
+        s.dE = _dE.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((before & 1) == 0 &&
+            _seq.load(std::memory_order_relaxed) == before) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+   private:
+    void begin() {
+      _seq.store(_seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end() {
+      _seq.store(_seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+    }
+
+   private:
+    std::atomic<uint64_t> _seq;
+    std::atomic<int> _state;
+    std::atomic<long> _record;
+    std::atomic<long> _runs;
+    std::atomic<long> _steps;
+    std::atomic<long> _events;
+    std::atomic<double> _t;
+    std::atomic<double> _h;
+    std::atomic<double> _dE;
+  } __attribute__((aligned(64)));
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numWorkers;
+    int64_t pid;
+    // Wall clock at start, seconds since the epoch
+    double startTime;
+    // Records of this shard, or 0 for a single run
+    int64_t numRecords;
+    // Events (or steps) per single run, for the progress fraction
+    int64_t numEvents;
+  } __attribute__((aligned(64)));
+
+  // Creates the counters. An empty name keeps them private.
+  LiveMetrics(const std::string& name, const int numWorkers,
+              const long numRecords, const long numEvents)
+      : _name(name), _size(sizeof(Header) + numWorkers * sizeof(Slot)),
+        _header(0), _slots(0), _owner(true) {
+    void* p;
+    if (name.empty()) {
+      p = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    } else {
+      const int fd = shm_open(path(name).c_str(),
+                              O_CREAT | O_EXCL | O_RDWR, 0644);
+      if (fd < 0) {
+        throw std::logic_error(
+            "Unable to create shared memory " + path(name) + ". If no run "
+            "uses the name, a crashed run left it; see magphyx-top --clean.");
+      }
+      if (ftruncate(fd, _size) != 0) {
+        close(fd);
+        shm_unlink(path(name).c_str());
+        throw std::logic_error("Unable to size shared memory " + path(name));
+      }
+      p = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+    }
+    if (p == MAP_FAILED) {
+      throw std::logic_error("Unable to map live metrics");
+    }
+    _header = new (p) Header();
+    _slots = (Slot*)((char*)p + sizeof(Header));
+    for (int i = 0; i < numWorkers; ++i) {
+      new (_slots + i) Slot();
+    }
+    _header->version = VERSION;
+    _header->numWorkers = numWorkers;
+    _header->pid = getpid();
+    _header->startTime = now();
+    _header->numRecords = numRecords;
+    _header->numEvents = numEvents;
+    // The magic goes last so readers never see a half initialized header
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(_header->magic, "MAGPHYXM", 8);
+  }
+
+  // Attaches read-only to the counters of a running magphyxc.
+  explicit LiveMetrics(const std::string& name)
+      : _name(name), _size(0), _header(0), _slots(0), _owner(false) {
+    const int fd = shm_open(path(name).c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw std::logic_error("No live metrics " + path(name));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+      close(fd);
+      throw std::logic_error("Unable to read live metrics " + path(name));
+    }
+    _size = st.st_size;
+    void* p = mmap(0, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::logic_error("Unable to map live metrics " + path(name));
+    }
+    _header = (Header*)p;
+    _slots = (Slot*)((char*)p + sizeof(Header));
+    if (memcmp(_header->magic, "MAGPHYXM", 8) != 0 ||
+        _header->version != VERSION ||
+        _size < sizeof(Header) + _header->numWorkers * sizeof(Slot)) {
+      munmap(p, _size);
+      throw std::logic_error("Not a live metrics segment: " + path(name));
+    }
+  }
+
+  ~LiveMetrics() {
+    munmap(_header, _size);
+    if (_owner && !_name.empty()) {
+      shm_unlink(path(_name).c_str());
+    }
+  }
+
+  static std::string path(const std::string& name) {
+    return "/magphyx-" + name;
+  }
+
+  static double now() {
+    return std::chrono::duration<double>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  const Header& header() const { return *_header; }
+  int numWorkers() const { return _header->numWorkers; }
+  Slot& slot(const int i) { return _slots[i]; }
+  const Slot& slot(const int i) const { return _slots[i]; }
+
+ private:
+  // disallow copies because destructor unmaps
+  LiveMetrics(const LiveMetrics&);
+  void operator=(const LiveMetrics&);
+
+ private:
+  const std::string _name;
+  size_t _size;
+  Header* _header;
+  Slot* _slots;
+  const bool _owner;
+};
+
+#endif
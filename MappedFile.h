@@ -0,0 +1,72 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+// Read-only memory mapping of a whole file. Pages are brought in by the
+// kernel as the file is read, so files far larger than memory can be
+// streamed. Only depends on POSIX so that the tools can use it.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& filename)
+      : _data(0), _size(0) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::logic_error("Unable to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::logic_error("Unable to stat " + filename);
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+      void* p = mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw std::logic_error("Unable to map " + filename);
+      }
+      madvise(p, _size, MADV_SEQUENTIAL);
+      _data = (const char*)p;
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (_data) {
+      munmap((void*)_data, _size);
+    }
+  }
+
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+
+ private:
+  // disallow copies because destructor unmaps
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+
+ private:
+  const char* _data;
+  size_t _size;
+};
+
+#endif
@@ -0,0 +1,249 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __MICROCANONICAL_H__
+#define __MICROCANONICAL_H__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "./Dipole.h"
+#include "./Ensemble.h"
+#include "./Options.h"
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011). Each
+// block of four 32 bit words is a pure function of the key and a 128 bit
+// counter, so a stream is fixed by (seed, stream) alone and no state is
+// shared between streams.
+class Philox {
+ public:
+  Philox(const uint64_t seed, const uint64_t stream)
+      : _block(0), _used(4) {
+    _key[0] = (uint32_t)seed;
+    _key[1] = (uint32_t)(seed >> 32);
+    _ctr[0] = (uint32_t)stream;
+    _ctr[1] = (uint32_t)(stream >> 32);
+  }
+
+  // Uniform in [0, 1) with 53 random bits
+  double uniform() {
+    if (_used > 2) refill();
+    const uint64_t hi = _out[_used++] >> 5;
+    const uint64_t lo = _out[_used++] >> 6;
+    return (hi * 67108864.0 + lo) * (1.0 / 9007199254740992.0);
+  }
+
+ private:
+  void refill() {
+    uint32_t c[4] = { _ctr[0], _ctr[1], (uint32_t)_block,
+                      (uint32_t)(_block >> 32) };
+    uint32_t k[2] = { _key[0], _key[1] };
+    for (int round = 0; round < 10; ++round) {
+      const uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+      const uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+      const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k[0];
+      const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k[1];
+      c[0] = n0;
+      c[1] = (uint32_t)p1;
+      c[2] = n2;
+      c[3] = (uint32_t)p0;
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    for (int i = 0; i < 4; ++i) _out[i] = c[i];
+    ++_block;
+    _used = 0;
+  }
+
+ private:
+  uint32_t _key[2];
+  uint32_t _ctr[2];
+  uint64_t _block;
+  uint32_t _out[4];
+  int _used;
+};
+
+// Generates an ensemble of initial conditions distributed uniformly
+// (microcanonically) on the energy shell H = E, as a reader that doEnsemble
+// consumes like an ensemble file. Record i is drawn from Philox stream i of
+// the seed, so it does not depend on n, the shard or the thread.
+//
+// With T = pr^2/2 + ptheta^2/(2r^2) + 5pphi^2 and K = E - V(r, theta, phi),
+// the shell measure delta(H - E) dq dp integrates over the momentum
+// ellipsoid T = K to a position density proportional to
+//   r sqrt(K)   bouncing
+//   1           sliding (r = 1, pr = 0)
+// on K > 0. Positions are drawn from it by rejection, which costs no
+// integration. The momentum direction is then uniform on the unit sphere
+// (circle) in the coordinates where T is |u|^2/2, and its magnitude is
+// solved from T = K.
+//
+// On the collision surface (r = 1, pr > 0, bouncing only) the invariant
+// measure of the section is dtheta dphi dptheta dpphi, which is what the
+// collisions of long runs sample. theta and phi have density proportional
+// to K, ptheta and pphi are uniform in the ellipse ptheta^2/2 + 5pphi^2 < K
+// and pr is solved from the energy.
+//
+// Angles are in [-pi, pi). For E >= 0 the shell is unbounded and rMax is
+// required; for E < 0 it ends at r^3 = 1/(3|E|), where V = E at best.
+class MicrocanonicalReader : public EnsembleReader {
+ public:
+  MicrocanonicalReader(const double E, const long n, const uint64_t seed,
+                       const bool collisionSurface, const double rMax,
+                       const int defaultNumEvents,
+                       const Options::Dynamics dynamics)
+      : EnsembleReader(defaultNumEvents, dynamics), _E(E), _n(n),
+        _seed(seed), _collisionSurface(collisionSurface),
+        _dynamics(dynamics) {
+    // V >= -1/3, reached at r = 1 with theta = phi = 0
+    if (E <= -1.0/3) {
+      throw std::logic_error("The energy shell is empty for E <= -1/3");
+    }
+    if (collisionSurface && dynamics != Options::BOUNCING) {
+      throw std::logic_error(
+          "The collision surface is only valid with bouncing dynamics");
+    }
+    _rMax = 1;
+    if (dynamics == Options::BOUNCING && !collisionSurface) {
+      if (E < 0) {
+        _rMax = cbrt(1 / (-3 * E));
+        if (rMax > 0) _rMax = std::min(_rMax, rMax);
+      } else if (rMax > 0) {
+        _rMax = rMax;
+      } else {
+        throw std::logic_error("An energy shell with E >= 0 needs --rMax");
+      }
+      if (_rMax < 1) {
+        throw std::logic_error("rMax must be at least 1");
+      }
+    }
+  }
+
+  bool next(EnsembleRecord& rec) {
+    if (_index >= _n) return false;
+    Philox rng(_seed, _index);
+    double y[6];
+    if (_dynamics == Options::SLIDING) {
+      sliding(rng, y);
+    } else if (_collisionSurface) {
+      collision(rng, y);
+    } else {
+      bouncing(rng, y);
+    }
+    fill(rec, y, -1, -1);
+    return true;
+  }
+
+  void rewind() {
+    _index = 0;
+  }
+
+ private:
+  // Proposals per record before giving up, for shells too thin to hit
+  static const long MAX_TRIES = 100000000;
+
+  static double angle(Philox& rng) {
+    return M_PI * (2 * rng.uniform() - 1);
+  }
+
+  // Kinetic energy K = E - V at a position. With no momenta get_E() is V.
+  double kinetic(const double r, const double theta, const double phi) const {
+    return _E - Dipole(r, theta, phi, 0, 0, 0).get_E();
+  }
+
+  void tooThin() const {
+    throw std::logic_error("No position on the energy shell found for record " +
+                           std::to_string(_index));
+  }
+
+  void bouncing(Philox& rng, double y[6]) const {
+    const double bound = _rMax * sqrt(_E + 1.0/3);
+    double r, theta, phi, K;
+    long tries = 0;
+    do {
+      if (++tries > MAX_TRIES) tooThin();
+      r = 1 + (_rMax - 1) * rng.uniform();
+      theta = angle(rng);
+      phi = angle(rng);
+      K = kinetic(r, theta, phi);
+    } while (K <= 0 || rng.uniform() * bound >= r * sqrt(K));
+
+    // Uniform direction on the sphere, scaled to T = K
+    const double z = 2 * rng.uniform() - 1;
+    const double a = angle(rng);
+    const double s = sqrt(1 - z*z);
+    const double u = sqrt(2 * K);
+    y[0] = r;
+    y[1] = theta;
+    y[2] = phi;
+    y[3] = u * z;
+    y[4] = u * r * s * cos(a);
+    y[5] = u * s * sin(a) / sqrt(10.0);
+  }
+
+  void sliding(Philox& rng, double y[6]) const {
+    double theta, phi, K;
+    long tries = 0;
+    do {
+      if (++tries > MAX_TRIES) tooThin();
+      theta = angle(rng);
+      phi = angle(rng);
+      K = kinetic(1, theta, phi);
+    } while (K <= 0);
+
+    const double a = angle(rng);
+    const double u = sqrt(2 * K);
+    y[0] = 1;
+    y[1] = theta;
+    y[2] = phi;
+    y[3] = 0;
+    y[4] = u * cos(a);
+    y[5] = u * sin(a) / sqrt(10.0);
+  }
+
+  void collision(Philox& rng, double y[6]) const {
+    const double bound = _E + 1.0/3;
+    double theta, phi, K;
+    long tries = 0;
+    do {
+      if (++tries > MAX_TRIES) tooThin();
+      theta = angle(rng);
+      phi = angle(rng);
+      K = kinetic(1, theta, phi);
+    } while (K <= 0 || rng.uniform() * bound >= K);
+
+    // Uniform in the unit disk, scaled to the ellipse T_angular < K
+    const double rho2 = rng.uniform();
+    const double a = angle(rng);
+    const double rho = sqrt(rho2);
+    y[0] = 1;
+    y[1] = theta;
+    y[2] = phi;
+    y[3] = sqrt(2 * K * (1 - rho2));
+    y[4] = sqrt(2 * K) * rho * cos(a);
+    y[5] = sqrt(K / 5) * rho * sin(a);
+  }
+
+ private:
+  const double _E;
+  const long _n;
+  const uint64_t _seed;
+  const bool _collisionSurface;
+  const Options::Dynamics _dynamics;
+  double _rMax;
+};
+
+#endif
@@ -39,6 +39,15 @@ vector<string> split(string str, char delimiter) {
   return internal;
 }
 
+// Index of a state variable in the dipole state, or -1
+int stateIndex(const string& name) {
+  const char* names[6] = { "r", "theta", "phi", "pr", "ptheta", "pphi" };
+  for (int j = 0; j < 6; ++j) {
+    if (name == names[j]) return j;
+  }
+  return -1;
+}
+
 Dipole initDipole(const string& filename) {
   ifstream in(filename);
   string line;
@@ -97,11 +106,100 @@ bool Options::ProcessArg(int& i, char** argv) {
     ++i;
     o.eps = atof(argv[i]);
     ++i;
+  } else if (strcmp(argv[i], "--sampleDt") == 0) {
+    ++i;
+    o.sampleDt = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--project") == 0) {
+    ++i;
+    o.projectEvery = atoi(argv[i]);
+    ++i;
   } else if (strcmp(argv[i], "-f") == 0) {
     ++i;
     o.dipole = initDipole(argv[i]);
     o.initialized = true;
     ++i;
+  } else if (strcmp(argv[i], "--ensemble") == 0) {
+    ++i;
+    o.ensembleFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--shard") == 0) {
+    ++i;
+    if (sscanf(argv[i], "%d/%d", &o.shardIndex, &o.numShards) != 2 ||
+        o.numShards < 1 || o.shardIndex < 0 || o.shardIndex >= o.numShards) {
+      fprintf(stderr, "Illegal value for shard. Expected k/N with "
+              "0 <= k < N\n");
+      return false;
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--threads") == 0) {
+    ++i;
+    o.numThreads = max(1, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--writeBinaryEnsemble") == 0) {
+    ++i;
+    o.binaryEnsembleFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--screen") == 0) {
+    ++i;
+    o.screenEps = atof(argv[i++]);
+    o.screenEvents = (int)atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--screenAudit") == 0) {
+    ++i;
+    o.screenAudit = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--screenGrid") == 0) {
+    ++i;
+    o.screenGrid = max(0L, atol(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--screenReport") == 0) {
+    ++i;
+    o.screenReportFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--cache") == 0) {
+    ++i;
+    o.cacheDir = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--metrics") == 0) {
+    ++i;
+    o.metricsName = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--ring") == 0) {
+    ++i;
+    o.ringName = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--ringSize") == 0) {
+    ++i;
+    o.ringSize = max(1L, atol(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--ringBlock") == 0) {
+    ++i;
+    o.ringBlock = true;
+  } else if (strcmp(argv[i], "--shell") == 0) {
+    ++i;
+    o.shellEnergy = atof(argv[i++]);
+    o.shellSize = (long)atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--seed") == 0) {
+    ++i;
+    o.seed = strtoul(argv[i], 0, 10);
+    ++i;
+  } else if (strcmp(argv[i], "--collisionSurface") == 0) {
+    ++i;
+    o.collisionSurface = true;
+  } else if (strcmp(argv[i], "--rMax") == 0) {
+    ++i;
+    o.rMax = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--pyramid") == 0) {
+    ++i;
+    o.pyramidDir = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--pyramidMinLevel") == 0) {
+    ++i;
+    o.pyramidMinLevel = max(0, atoi(argv[i]));
+    ++i;
   } else if (strcmp(argv[i], "--fft") == 0) {
     ++i;
     o.fft = true;
@@ -127,6 +225,127 @@ bool Options::ProcessArg(int& i, char** argv) {
       return false;
     }
     ++i;
+  } else if (strcmp(argv[i], "--layout") == 0) {
+    ++i;
+    o.layoutFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--integrator") == 0) {
+    ++i;
+    if (string(argv[i]) == "rk8pd") {
+      o.integrator = RK8PD;
+    } else if (string(argv[i]) == "rkf45") {
+      o.integrator = RKF45;
+    } else if (string(argv[i]) == "taylor") {
+      o.integrator = TAYLOR;
+    } else {
+      fprintf(stderr, "Illegal value for integrator. Legal values are "
+              "\"rk8pd\", \"rkf45\" and \"taylor\"\n");
+      return false;
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--scheme") == 0) {
+    ++i;
+    const string scheme = argv[i];
+    if (scheme == "gsl") {
+      o.fixedScheme = GSL;
+    } else if (scheme == "rk4") {
+      o.fixedScheme = RK4;
+    } else if (scheme == "sym2") {
+      o.fixedScheme = SYMPLECTIC2;
+    } else if (scheme == "sym4") {
+      o.fixedScheme = SYMPLECTIC4;
+    } else if (scheme == "sym6") {
+      o.fixedScheme = SYMPLECTIC6;
+    } else if (scheme == "sym8") {
+      o.fixedScheme = SYMPLECTIC8;
+    } else {
+      fprintf(stderr, "Illegal value for scheme. Legal values are "
+              "\"gsl\", \"rk4\", \"sym2\", \"sym4\", \"sym6\" and "
+              "\"sym8\"\n");
+      return false;
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--workPrecision") == 0) {
+    ++i;
+    o.workPrecisionT = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--periodic") == 0) {
+    ++i;
+    o.periodicReturns = max(1, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--orbitTol") == 0) {
+    ++i;
+    o.orbitTol = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--continuation") == 0) {
+    ++i;
+    o.continuationStep = atof(argv[i++]);
+    o.continuationSteps = max(0, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--ftle") == 0) {
+    ++i;
+    for (int a = 0; a < 2; ++a) {
+      Options::GridAxis& axis = o.ftleAxes[a];
+      axis.var = stateIndex(argv[i++]);
+      if (axis.var < 0) {
+        fprintf(stderr, "Illegal variable for ftle. Legal values are "
+                "\"r\", \"theta\", \"phi\", \"pr\", \"ptheta\" and "
+                "\"pphi\"\n");
+        return false;
+      }
+      axis.min = atof(argv[i++]);
+      axis.max = atof(argv[i++]);
+      axis.n = max(1, atoi(argv[i++]));
+      if (axis.var == 1 || axis.var == 2) {
+        axis.min = Physics::deg2rad(axis.min);
+        axis.max = Physics::deg2rad(axis.max);
+      }
+    }
+  } else if (strcmp(argv[i], "--horizons") == 0) {
+    ++i;
+    const vector<string> tokens = split(argv[i], ',');
+    o.horizons.clear();
+    for (int j = 0; j < tokens.size(); ++j) {
+      o.horizons.push_back(atof(tokens[j].c_str()));
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--summary") == 0) {
+    ++i;
+    o.summaryFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--checkpoints") == 0) {
+    ++i;
+    o.checkpointFilename = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--checkpointEvery") == 0) {
+    ++i;
+    o.checkpointEvery = max(1, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--replay") == 0) {
+    ++i;
+    o.replayFilename = argv[i];
+    ++i;
+    if (sscanf(argv[i], "%d:%d", &o.replayFirst, &o.replayLast) != 2 ||
+        o.replayFirst < 1 || o.replayLast < o.replayFirst) {
+      fprintf(stderr, "Illegal value for replay events: %s\n", argv[i]);
+      return false;
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--take") == 0) {
+    ++i;
+    o.take = max(1, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--after") == 0) {
+    ++i;
+    o.after = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--only") == 0) {
+    ++i;
+    o.onlyTypes.push_back(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--noEvents") == 0) {
+    o.noEvents = true;
+    ++i;
   } else if (strcmp(argv[i], "-o") == 0) {
     ++i;
     outFilename = argv[i];
@@ -145,6 +364,57 @@ bool Options::ProcessArg(int& i, char** argv) {
       return false;
     }
     ++i;
+  } else if (strcmp(argv[i], "--events") == 0) {
+    ++i;
+    try {
+      const vector<EventSurface> surfaces = EventSurface::parseList(argv[i]);
+      o.events.insert(o.events.end(), surfaces.begin(), surfaces.end());
+    } catch (logic_error& e) {
+      fprintf(stderr, "Illegal value for events: %s\n", e.what());
+      return false;
+    }
+    ++i;
+  } else if (strcmp(argv[i], "--recurrence") == 0) {
+    ++i;
+    o.recurrenceTol = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--maxPeriod") == 0) {
+    ++i;
+    o.maxPeriod = max(1, atoi(argv[i]));
+    ++i;
+  } else if (strcmp(argv[i], "--parareal") == 0) {
+    ++i;
+    o.pararealSlice = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--pararealTol") == 0) {
+    ++i;
+    o.pararealTol = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--coarseEps") == 0) {
+    ++i;
+    o.coarseEps = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--maxDrift") == 0) {
+    ++i;
+    o.maxDrift = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--driftSegment") == 0) {
+    ++i;
+    o.driftSegment = atof(argv[i]);
+    ++i;
+  } else if (strcmp(argv[i], "--driftLog") == 0) {
+    ++i;
+    o.driftLog = argv[i];
+    ++i;
+  } else if (strcmp(argv[i], "--section") == 0) {
+    ++i;
+    try {
+      o.section = EventSurface::parse(argv[i]);
+    } catch (logic_error& e) {
+      fprintf(stderr, "Illegal value for section: %s\n", e.what());
+      return false;
+    }
+    ++i;
   } else if (strcmp(argv[i], "-I") == 0) {
     ++i;
     o.interactive = true;
@@ -20,6 +20,7 @@
 #include <map>
 
 #include "./Dipole.h"
+#include "./EventSurface.h"
 
 //------------------------------------------------------------------------------
 // Options
@@ -28,30 +29,148 @@ struct Options {
  public:
   enum Dynamics { BOUNCING, SLIDING };
   enum StateVariable { NONE, R, THETA, PHI, ALL };
+  enum Integrator { RK8PD, RKF45, TAYLOR };
+  enum FixedScheme { GSL, RK4, SYMPLECTIC2, SYMPLECTIC4, SYMPLECTIC6,
+                     SYMPLECTIC8 };
 
  public:
   bool initialized;
   Dipole dipole;
 
   std::string outFilename;
+  // If set, a JSON summary of the events is written to this file
+  std::string summaryFilename;
+  // Count events without writing them
+  bool noEvents;
   Dynamics dynamics;
+  // If set, the fixed magnets are read from this file (see Layout.h)
+  // instead of the single magnet at the origin
+  std::string layoutFilename;
   int numEvents;
   int numSteps;
   bool fft;
   double h;
   bool fixed_h;
   double eps;
+  Integrator integrator;
+  // Fixed step scheme used with -c. GSL steps with the integrator.
+  FixedScheme fixedScheme;
+  // If positive, single-step output is resampled at this uniform interval
+  double sampleDt;
+  // With singleStep, also write a level-of-detail pyramid here
+  std::string pyramidDir;
+  int pyramidMinLevel;
+  // If positive, the state is projected onto the initial energy surface
+  // every projectEvery accepted steps and after each reflection
+  int projectEvery;
   bool interactive;
   StateVariable singleStep;
+  // Ensemble of initial conditions to run instead of -i/-f
+  std::string ensembleFilename;
+  // This process runs shard shardIndex of numShards of the ensemble
+  int shardIndex;
+  int numShards;
+  // Number of worker threads for ensemble runs
+  int numThreads;
+  // If set, the ensemble is converted to the binary format in this file
+  std::string binaryEnsembleFilename;
+  // Two tier ensemble runs: if screenEps is positive, every record is
+  // first run with rkf45 at screenEps for screenEvents events, and only
+  // doubtful ones (and an audit fraction) are rerun at full accuracy
+  double screenEps;
+  int screenEvents;
+  double screenAudit;
+  // Row length of the grid the ensemble records were laid out on, row by
+  // row, for the --screen neighbor test. 0 compares records in file order.
+  long screenGrid;
+  std::string screenReportFilename;
+  // If set, finished runs are cached in this directory
+  std::string cacheDir;
+  // If set, live counters are published in shared memory under this name
+  // for magphyx-top
+  std::string metricsName;
+  // If set, events are published to a shared memory ring of ringSize
+  // records under this name, and ringBlock makes the run wait for readers
+  std::string ringName;
+  long ringSize;
+  bool ringBlock;
+  // If shellSize is positive, the ensemble is generated on the energy shell
+  // E = shellEnergy instead of read from ensembleFilename
+  double shellEnergy;
+  long shellSize;
+  unsigned long seed;
+  bool collisionSurface;
+  double rMax;
+  // Event surfaces to log. Empty means EventSurface::defaults().
+  std::vector<EventSurface> events;
+  // If take is positive, output only the first take events at or after
+  // time after, of the onlyTypes if any, and stop
+  int take;
+  double after;
+  std::vector<std::string> onlyTypes;
+  // If checkpointFilename is set, write a checkpoint of the run every
+  // checkpointEvery events. If replayFilename is set, replay events
+  // replayFirst to replayLast of a run from its checkpoints.
+  std::string checkpointFilename;
+  int checkpointEvery;
+  std::string replayFilename;
+  int replayFirst;
+  int replayLast;
+  // Recurrence detection. Off if recurrenceTol is 0.
+  double recurrenceTol;
+  int maxPeriod;
+  int recurrenceConfirm;
+  EventSurface section;
+  // Parareal integration of a single run. Off if pararealSlice is 0.
+  double pararealSlice;
+  double pararealTol;
+  double coarseEps;
+  // Energy drift budget of a single run, with the tolerance adapted per
+  // segment of length driftSegment. Off if maxDrift is 0. Segments are
+  // logged to driftLog.
+  double maxDrift;
+  double driftSegment;
+  std::string driftLog;
+  // If positive, compare integrators over runs of this length and exit
+  double workPrecisionT;
+  // If positive, find the periodic orbit that returns to the section after
+  // this many crossings, near the initial condition, and exit
+  int periodicReturns;
+  double orbitTol;
+  // Energy continuation of the periodic orbit: numbers of steps and step
+  int continuationSteps;
+  double continuationStep;
+  // Axis of a grid of initial conditions: state variable (0-5 for r,
+  // theta, phi, pr, ptheta, pphi), range and number of points
+  struct GridAxis {
+    int var;
+    double min;
+    double max;
+    int n;
+  };
+  // If ftleAxes[0].n is positive, map the FTLE over the grid of initial
+  // conditions at each of the horizons and exit
+  GridAxis ftleAxes[2];
+  std::vector<double> horizons;
   std::map<std::string, std::string> key2value;
 
  public:
   Options(const int numEvents_, const double h_, const double eps_,
           const Dynamics dynamics_)
-      : initialized(false), dynamics(dynamics_),
+      : initialized(false), noEvents(false), dynamics(dynamics_),
         numEvents(numEvents_), numSteps(-1), fft(false),
-        h(h_), fixed_h(false), eps(eps_),
-        interactive(false) {
+        h(h_), fixed_h(false), eps(eps_), integrator(RK8PD),
+        fixedScheme(GSL), sampleDt(0), pyramidMinLevel(6),
+        projectEvery(0), interactive(false), shardIndex(0), numShards(1),
+        numThreads(1), screenEps(0), screenEvents(0), screenAudit(0.01),
+        screenGrid(0), ringSize(65536), ringBlock(false), shellEnergy(0),
+        shellSize(0), seed(1), collisionSurface(false), rMax(0), take(0),
+        after(0), checkpointEvery(1000), replayFirst(0), replayLast(0),
+        recurrenceTol(0), maxPeriod(64), recurrenceConfirm(3),
+        pararealSlice(0), pararealTol(1e-8), coarseEps(1e-6),
+        maxDrift(0), driftSegment(10),
+        workPrecisionT(0), periodicReturns(0), orbitTol(1e-8),
+        continuationSteps(0), continuationStep(0), ftleAxes() {
     ReadOptionsFile();
   }
 
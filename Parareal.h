@@ -0,0 +1,196 @@
+#ifndef __PARAREAL_H__
+#define __PARAREAL_H__
+
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Event.h"
+#include "./Physics.h"
+#include "./Stepper.h"
+
+// Parallel-in-time integration of a single trajectory.
+//
+// Time is cut into windows of numSlices slices of length sliceLength. In a
+// window with slice start states U_0 ... U_N, parareal iteration k runs the
+// accurate propagator F (--integrator at --eps) on every unconverged slice in
+// parallel and then corrects the start states serially with the cheap
+// propagator G (rkf45 at a loose tolerance):
+//   U_n+1 <- G(U_n new) + F(U_n old) - G(U_n old)
+// After k iterations the first k slices are exact, so a window needs at
+// most numSlices iterations; it is converged once no start state moves by
+// more than tol. Both propagators reflect at collisions inside a slice in
+// the same way as doSimulation, so the correction is applied to states on
+// the same side of each collision.
+//
+// The output trajectory is the fine one: events are recorded by each
+// slice's last fine run and replayed in order. Slice boundaries differ
+// from the preceding slice's fine end state by at most tol.
+class Parareal {
+ public:
+  struct Window {
+    int iterations;
+    // Fine steps of the output trajectory
+    long fineSteps;
+    // Wall time of the fine runs behind the output trajectory, i.e. an
+    // estimate of the serial time, and the wall time of the window
+    double serialSeconds;
+    double seconds;
+  };
+
+  Parareal(const int numSlices, const double sliceLength, const double tol,
+           const double coarseEps, const Options::Dynamics dynamics)
+      : _numSlices(numSlices), _sliceLength(sliceLength), _tol(tol),
+        _coarseEps(coarseEps), _dynamics(dynamics) {}
+
+  // Advances (d, t) by one window. Events of the window are appended to
+  // records in order.
+  Window window(Dipole& d, double& t, std::vector<Event::Record>& records) {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+
+    const int N = _numSlices;
+    std::vector<Dipole> U(N+1, d);
+    std::vector<Dipole> G(N, d);
+    std::vector<Dipole> F(N, d);
+    std::vector<long> steps(N, 0);
+    std::vector<double> seconds(N, 0);
+    std::vector<std::vector<Event::Record> > sliceRecords(N);
+
+    // Initial coarse sweep
+    for (int n = 0; n < N; ++n) {
+      G[n] = coarse(U[n], sliceStart(t, n), sliceStart(t, n+1));
+      U[n+1] = G[n];
+    }
+
+    Window w;
+    w.iterations = 0;
+    // Slices before first have exact start states and are done
+    int first = 0;
+    while (first < N) {
+      ++w.iterations;
+      std::vector<std::thread> threads;
+      // An exception escaping a thread would terminate, so a slice's
+      // error is kept and rethrown here once all slices are joined
+      std::vector<std::exception_ptr> errors(N);
+      for (int n = first; n < N; ++n) {
+        threads.push_back(std::thread([&, n]() {
+          try {
+            const Clock::time_point s = Clock::now();
+            sliceRecords[n].clear();
+            F[n] = fine(U[n], sliceStart(t, n), sliceStart(t, n+1),
+                        sliceRecords[n], steps[n]);
+            seconds[n] = std::chrono::duration<double>(
+                Clock::now() - s).count();
+          } catch (std::logic_error&) {
+            errors[n] = std::current_exception();
+          }
+        }));
+      }
+      for (int i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+      }
+      for (int n = first; n < N; ++n) {
+        if (errors[n]) std::rethrow_exception(errors[n]);
+      }
+
+      double change = distance(U[first+1], F[first]);
+      U[first+1] = F[first];
+      for (int n = first+1; n < N; ++n) {
+        const Dipole g = coarse(U[n], sliceStart(t, n), sliceStart(t, n+1));
+        const Dipole u = correct(g, F[n], G[n]);
+        G[n] = g;
+        change = std::max(change, distance(U[n+1], u));
+        U[n+1] = u;
+      }
+      ++first;
+      if (change < _tol) break;
+    }
+
+    w.fineSteps = 0;
+    w.serialSeconds = 0;
+    for (int n = 0; n < N; ++n) {
+      records.insert(records.end(), sliceRecords[n].begin(),
+                     sliceRecords[n].end());
+      w.fineSteps += steps[n];
+      w.serialSeconds += seconds[n];
+    }
+    d = F[N-1];
+    t = sliceStart(t, N);
+    w.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return w;
+  }
+
+ private:
+  double sliceStart(const double t, const int n) const {
+    return t + n * _sliceLength;
+  }
+
+  Dipole coarse(const Dipole& d, const double t0, const double t1) const {
+    Stepper stepper(d, o.h, false, _coarseEps, _dynamics, Options::RKF45);
+    stepper.t = t0;
+    stepper.advance(t1, []() {}, []() {});
+    return stepper.d;
+  }
+
+  Dipole fine(const Dipole& d, const double t0, const double t1,
+              std::vector<Event::Record>& records, long& numSteps) const {
+    Stepper stepper(d, o.h, o.fixed_h, o.eps, _dynamics);
+    Event event(d, t0, &records);
+    stepper.t = t0;
+    numSteps = stepper.advance(
+        t1,
+        [&]() { event.log(stepper.d, stepper.t, &stepper); },
+        [&]() { event.logCollision(stepper.d, stepper.t); });
+    return stepper.d;
+  }
+
+  // Difference of two states with angle differences wrapped to [-pi, pi]
+  static void difference(const Dipole& a, const Dipole& b, double diff[6]) {
+    const double* ya = (const double*)(&a);
+    const double* yb = (const double*)(&b);
+    for (int i = 0; i < 6; ++i) {
+      diff[i] = ya[i] - yb[i];
+    }
+    for (int i = 1; i <= 2; ++i) {
+      diff[i] -= 2*M_PI * floor(diff[i] / (2*M_PI) + 0.5);
+    }
+  }
+
+  static double distance(const Dipole& a, const Dipole& b) {
+    double diff[6];
+    difference(a, b, diff);
+    double m = 0;
+    for (int i = 0; i < 6; ++i) {
+      m = std::max(m, fabs(diff[i]));
+    }
+    return m;
+  }
+
+  // g + (f - gOld)
+  static Dipole correct(const Dipole& g, const Dipole& f, const Dipole& gOld) {
+    double diff[6];
+    difference(f, gOld, diff);
+    Dipole u = g;
+    u.set_r(g.get_r() + diff[0]);
+    u.set_theta(Physics::normalizeAngle(g.get_theta() + diff[1]));
+    u.set_phi(Physics::normalizeAngle(g.get_phi() + diff[2]));
+    u.set_pr(g.get_pr() + diff[3]);
+    u.set_ptheta(g.get_ptheta() + diff[4]);
+    u.set_pphi(g.get_pphi() + diff[5]);
+    return u;
+  }
+
+ private:
+  const int _numSlices;
+  const double _sliceLength;
+  const double _tol;
+  const double _coarseEps;
+  const Options::Dynamics _dynamics;
+};
+
+#endif
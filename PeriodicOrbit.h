@@ -0,0 +1,519 @@
+#ifndef __PERIODIC_ORBIT_H__
+#define __PERIODIC_ORBIT_H__
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./EventSurface.h"
+#include "./Options.h"
+#include "./Physics.h"
+#include "./Variational.h"
+
+// Finds periodic orbits as fixed points of the k-th return map P of a
+// Poincare section (collisions or any event surface), by Newton's method
+// on
+//   P(x) - x = 0,  g(x) = 0,  E(x) - E = 0
+// where g is the section and E the energy of the wanted orbit. The system
+// is solved in the least squares sense: the energy row selects one orbit
+// of the family, and the section row removes the time shift along the
+// orbit. Sliding runs keep r and pr fixed.
+//
+// The Jacobian of P comes from the variational equations integrated
+// along with the trajectory, using Physics::get_jacobian. If the return
+// takes time T and ends at y with velocity f and section gradient dg,
+//   DP = (I - f dg^T / (dg . f)) Phi(T)
+// At a collision (r = 1, reflection R: pr -> -pr) the variations jump by
+// the saltation matrix
+//   S = R + (f+ - R f-) e_r^T / pr-
+// where f- and f+ are the velocities before and after reflection. With
+// the collision section, P ends after the k-th reflection, and DP above
+// uses f+ and S Phi, which equals R (I - f- e_r^T / pr-) Phi.
+//
+// The Floquet multipliers of a converged orbit are the eigenvalues of the
+// monodromy matrix over one period, including the final saltation (4x4
+// over theta, phi, ptheta, pphi when sliding). Two multipliers are 1
+// (time shift and energy); the orbit is linearly
+// stable if the others lie on the unit circle.
+class PeriodicOrbit {
+ public:
+  struct Orbit {
+    // Point of the orbit on the section, and the period
+    Dipole d;
+    double T;
+    double E;
+    bool converged;
+    int iterations;
+    double residual;
+    std::vector<std::complex<double> > multipliers;
+
+    double maxMultiplier() const {
+      double m = 0;
+      for (int i = 0; i < multipliers.size(); ++i) {
+        m = std::max(m, std::abs(multipliers[i]));
+      }
+      return m;
+    }
+
+    bool stable() const {
+      return maxMultiplier() < 1 + 1e-6;
+    }
+  };
+
+  PeriodicOrbit(const EventSurface& section, const int k, const double eps,
+                const double tol, const Options::Dynamics dynamics)
+      : _section(section), _k(k), _eps(eps), _tol(tol), _dynamics(dynamics),
+        _numIntegrations(0) {}
+
+  // Number of trajectory integrations so far
+  long numIntegrations() const { return _numIntegrations; }
+
+  // The first section crossing of the trajectory from d, to start Newton
+  // from.
+  Dipole toSection(const Dipole& d) {
+    Return ret;
+    integrate(d, 1, ret);
+    return ret.y;
+  }
+
+  // Newton iteration from guess for the orbit with energy E.
+  Orbit solve(const Dipole& guess, const double E) {
+    const int MAX_ITERATIONS = 40;
+    Orbit orbit;
+    orbit.E = E;
+    orbit.converged = false;
+    orbit.iterations = 0;
+
+    Dipole x = onSection(guess);
+    Return ret;
+    double res[8];
+    double norm = residual(x, E, ret, res);
+    while (norm >= _tol && orbit.iterations < MAX_ITERATIONS) {
+      ++orbit.iterations;
+      double delta[6];
+      newtonStep(x, ret, res, delta);
+
+      // Backtrack while the residual grows
+      double lambda = 1;
+      Dipole xt;
+      Return rt;
+      double rest[8];
+      double normt;
+      for (int i = 0; i < 5; ++i) {
+        xt = onSection(add(x, delta, lambda));
+        normt = residual(xt, E, rt, rest);
+        if (normt < norm) break;
+        lambda /= 2;
+      }
+      x = xt;
+      ret = rt;
+      norm = normt;
+      std::copy(rest, rest+8, res);
+    }
+
+    orbit.d = x;
+    orbit.T = ret.T;
+    orbit.residual = norm;
+    orbit.converged = (norm < _tol);
+    if (orbit.converged) {
+      // Sliding variations of r and pr are trivial
+      std::vector<int> v;
+      for (int i = 0; i < 6; ++i) {
+        if (_dynamics == Options::SLIDING && (i == 0 || i == 3)) continue;
+        v.push_back(i);
+      }
+      std::vector<double> M;
+      for (int i = 0; i < v.size(); ++i) {
+        for (int j = 0; j < v.size(); ++j) {
+          M.push_back(ret.M[6*v[i]+v[j]]);
+        }
+      }
+      orbit.multipliers = eigenvalues(M, v.size());
+    }
+    return orbit;
+  }
+
+  // Eigenvalues of a real n x n matrix (row-major) by the shifted QR
+  // algorithm in complex arithmetic. Throws logic_error if it does not
+  // converge.
+  static std::vector<std::complex<double> > eigenvalues(
+      const std::vector<double>& A, const int n) {
+    typedef std::complex<double> C;
+    std::vector<std::vector<C> > a(n, std::vector<C>(n));
+    double norm = 0;
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        a[i][j] = A[n*i+j];
+        norm += A[n*i+j] * A[n*i+j];
+      }
+    }
+    norm = sqrt(norm);
+
+    std::vector<C> lambda;
+    int m = n;
+    int iterations = 0;
+    while (m > 1) {
+      // Deflate once the last row is negligible
+      double off = 0;
+      for (int j = 0; j < m-1; ++j) {
+        off = std::max(off, std::abs(a[m-1][j]));
+      }
+      if (off <= 1e-15 * norm || off < 1e-300) {
+        lambda.push_back(a[m-1][m-1]);
+        --m;
+        iterations = 0;
+        continue;
+      }
+      if (++iterations > 500) {
+        throw std::logic_error("eigenvalues did not converge");
+      }
+
+      // Wilkinson shift, with an exceptional shift now and then
+      const C p = a[m-2][m-2], q = a[m-2][m-1];
+      const C r = a[m-1][m-2], s = a[m-1][m-1];
+      const C half = (p + s) / 2.0;
+      const C disc = std::sqrt(half*half - (p*s - q*r));
+      const C l1 = half + disc, l2 = half - disc;
+      C mu = (std::abs(l1 - s) < std::abs(l2 - s)) ? l1 : l2;
+      if (iterations % 20 == 0) {
+        mu += off;
+      }
+
+      // a - mu = QR by Givens rotations, then a = RQ + mu
+      for (int i = 0; i < m; ++i) a[i][i] -= mu;
+      std::vector<C> cs, ss;
+      std::vector<int> rows;
+      for (int j = 0; j < m-1; ++j) {
+        for (int i = m-1; i > j; --i) {
+          const double h = std::sqrt(std::norm(a[i-1][j]) + std::norm(a[i][j]));
+          if (h == 0) continue;
+          const C c = a[i-1][j] / h, sn = a[i][j] / h;
+          for (int k = 0; k < m; ++k) {
+            const C x = a[i-1][k], y = a[i][k];
+            a[i-1][k] = std::conj(c)*x + std::conj(sn)*y;
+            a[i][k] = -sn*x + c*y;
+          }
+          cs.push_back(c);
+          ss.push_back(sn);
+          rows.push_back(i);
+        }
+      }
+      for (int l = 0; l < rows.size(); ++l) {
+        const int i = rows[l];
+        const C c = cs[l], sn = ss[l];
+        for (int k = 0; k < m; ++k) {
+          const C x = a[k][i-1], y = a[k][i];
+          a[k][i-1] = x*c + y*sn;
+          a[k][i] = -x*std::conj(sn) + y*std::conj(c);
+        }
+      }
+      for (int i = 0; i < m; ++i) a[i][i] += mu;
+    }
+    lambda.push_back(a[0][0]);
+    return lambda;
+  }
+
+ private:
+  // End of a k-th return
+  struct Return {
+    // State at the k-th crossing, after reflection for collisions
+    Dipole y;
+    double T;
+    // Poincare map Jacobian and monodromy matrix
+    double DP[36];
+    double M[36];
+  };
+
+  bool collisionSection() const {
+    return _section.kind() == EventSurface::COLLISION;
+  }
+
+  // Projects x onto the section's side constraints: sliding keeps r = 1
+  // and pr = 0, and a collision section needs r >= 1.
+  Dipole onSection(const Dipole& x) const {
+    Dipole d = x;
+    if (_dynamics == Options::SLIDING) {
+      d.set_r(1);
+      d.set_pr(0);
+    } else if (collisionSection() && d.get_r() < 1) {
+      d.set_r(1);
+    }
+    d.set_theta(Physics::normalizeAngle(d.get_theta()));
+    d.set_phi(Physics::normalizeAngle(d.get_phi()));
+    return d;
+  }
+
+  static Dipole add(const Dipole& x, const double delta[6],
+                    const double lambda) {
+    const double* y = (const double*)(&x);
+    return Dipole(y[0] + lambda*delta[0], y[1] + lambda*delta[1],
+                  y[2] + lambda*delta[2], y[3] + lambda*delta[3],
+                  y[4] + lambda*delta[4], y[5] + lambda*delta[5]);
+  }
+
+  double sectionValue(const Dipole& d) const {
+    return collisionSection() ? d.get_r() - 1 : _section.evaluate(d);
+  }
+
+  void sectionGradient(const Dipole& d, double g[6]) const {
+    for (int i = 0; i < 6; ++i) g[i] = 0;
+    if (collisionSection()) {
+      g[0] = 1;
+      return;
+    }
+    const double h = 1e-7;
+    for (int i = 0; i < 6; ++i) {
+      Dipole a = d, b = d;
+      ((double*)(&a))[i] += h;
+      ((double*)(&b))[i] -= h;
+      g[i] = (_section.evaluate(a) - _section.evaluate(b)) / (2*h);
+    }
+  }
+
+  bool crosses(const double a, const double b) const {
+    switch (_section.direction()) {
+      case EventSurface::POS: return a < 0 && b >= 0;
+      case EventSurface::NEG: return a > 0 && b <= 0;
+      default: return (a < 0 && b >= 0) || (a > 0 && b <= 0);
+    }
+  }
+
+  // Residual of the Newton system at x; returns its max norm
+  double residual(const Dipole& x, const double E, Return& ret,
+                  double res[8]) {
+    integrate(x, _k, ret);
+    const double* px = (const double*)(&x);
+    const double* py = (const double*)(&ret.y);
+    for (int i = 0; i < 6; ++i) {
+      res[i] = py[i] - px[i];
+    }
+    res[1] = Physics::normalizeAngle(res[1]);
+    res[2] = Physics::normalizeAngle(res[2]);
+    res[6] = sectionValue(x);
+    res[7] = x.get_E() - E;
+    double norm = 0;
+    for (int i = 0; i < 8; ++i) {
+      norm = std::max(norm, fabs(res[i]));
+    }
+    return norm;
+  }
+
+  // Least squares solution of
+  //   [DP - I; dg; dE] delta = -res
+  // over the free variables.
+  void newtonStep(const Dipole& x, const Return& ret, const double res[8],
+                  double delta[6]) const {
+    std::vector<int> free;
+    for (int j = 0; j < 6; ++j) {
+      if (_dynamics == Options::SLIDING && (j == 0 || j == 3)) continue;
+      free.push_back(j);
+    }
+    const int n = free.size();
+    double dg[6], dE[6];
+    sectionGradient(x, dg);
+    x.get_grad_E(dE);
+
+    std::vector<double> A(8*n), b(8);
+    for (int i = 0; i < 8; ++i) {
+      for (int j = 0; j < n; ++j) {
+        const int c = free[j];
+        double v;
+        if (i < 6) {
+          v = ret.DP[6*i+c] - (i == c ? 1 : 0);
+        } else if (i == 6) {
+          v = dg[c];
+        } else {
+          v = dE[c];
+        }
+        A[n*i+j] = v;
+      }
+      b[i] = -res[i];
+    }
+    std::vector<double> z(n);
+    leastSquares(A, b, 8, n, z);
+    for (int j = 0; j < 6; ++j) delta[j] = 0;
+    for (int j = 0; j < n; ++j) delta[free[j]] = z[j];
+  }
+
+  // Solves min |Ax - b| for the m x n matrix A (m >= n) by Householder
+  // QR. Components along negligible pivots are set to 0.
+  static void leastSquares(std::vector<double> A, std::vector<double> b,
+                           const int m, const int n, std::vector<double>& x) {
+    std::vector<double> diag(n);
+    for (int j = 0; j < n; ++j) {
+      double norm = 0;
+      for (int i = j; i < m; ++i) norm += A[n*i+j] * A[n*i+j];
+      norm = sqrt(norm);
+      if (norm == 0) {
+        diag[j] = 0;
+        continue;
+      }
+      const double alpha = (A[n*j+j] > 0) ? -norm : norm;
+      // v = a_j - alpha e_j, stored in place
+      A[n*j+j] -= alpha;
+      double vv = 0;
+      for (int i = j; i < m; ++i) vv += A[n*i+j] * A[n*i+j];
+      for (int k = j+1; k < n; ++k) {
+        double dot = 0;
+        for (int i = j; i < m; ++i) dot += A[n*i+j] * A[n*i+k];
+        for (int i = j; i < m; ++i) A[n*i+k] -= 2 * dot / vv * A[n*i+j];
+      }
+      double dot = 0;
+      for (int i = j; i < m; ++i) dot += A[n*i+j] * b[i];
+      for (int i = j; i < m; ++i) b[i] -= 2 * dot / vv * A[n*i+j];
+      diag[j] = alpha;
+    }
+    double maxDiag = 0;
+    for (int j = 0; j < n; ++j) maxDiag = std::max(maxDiag, fabs(diag[j]));
+    for (int j = n-1; j >= 0; --j) {
+      if (fabs(diag[j]) <= 1e-12 * maxDiag) {
+        x[j] = 0;
+        continue;
+      }
+      double sum = b[j];
+      for (int k = j+1; k < n; ++k) sum -= A[n*j+k] * x[k];
+      x[j] = sum / diag[j];
+    }
+  }
+
+  // Integrates the state and its variations from x to the k-th section
+  // crossing. Throws logic_error if there is none before MAX_TIME.
+  void integrate(const Dipole& x, const int k, Return& ret) {
+    // Crossings closer than this to the start are the start itself
+    const double MIN_TIME = 1e-6;
+    const double MAX_TIME = 1e4;
+    ++_numIntegrations;
+
+    double y[42];
+    const double* px = (const double*)(&x);
+    for (int i = 0; i < 6; ++i) y[i] = px[i];
+    for (int i = 0; i < 36; ++i) y[6+i] = (i % 7 == 0) ? 1 : 0;
+
+    Options::Dynamics dynamics = _dynamics;
+    gsl_odeiv2_system sys = { variationalFunc, 0, 42, &dynamics };
+    gsl_odeiv2_step* step = gsl_odeiv2_step_alloc(gsl_odeiv2_step_rk8pd, 42);
+    gsl_odeiv2_control* control =
+        gsl_odeiv2_control_standard_new(_eps, 0, 1, 0);
+    gsl_odeiv2_evolve* evolve = gsl_odeiv2_evolve_alloc(42);
+
+    double t = 0;
+    double h = o.h;
+    double g0 = sectionValue(x);
+    int numCrossings = 0;
+    bool done = false;
+    try {
+      while (!done) {
+        double y0[42];
+        std::copy(y, y+42, y0);
+        const double t0 = t;
+        const int status = gsl_odeiv2_evolve_apply(
+            evolve, control, step, &sys, &t, MAX_TIME, &h, y);
+        if (status != GSL_SUCCESS) {
+          throw std::logic_error(gsl_strerror(status));
+        }
+        if (t >= MAX_TIME) {
+          throw std::logic_error("no return to the section before t = " +
+                                 std::to_string(MAX_TIME));
+        }
+
+        if (y[0] < 1 && _dynamics == Options::BOUNCING) {
+          // Collision: locate r = 1, reflect and jump the variations
+          t = t0 + locate(sys, step, t0, y0, t - t0, y, true);
+          double fp[6];
+          reflectVariations(y, _dynamics, fp);
+          gsl_odeiv2_evolve_reset(evolve);
+          gsl_odeiv2_step_reset(step);
+          if (collisionSection()) {
+            if (++numCrossings == k) {
+              finish(ret, y, t, fp);
+              done = true;
+            }
+          } else {
+            g0 = sectionValue(*(const Dipole*)(y));
+          }
+          continue;
+        }
+
+        if (!collisionSection()) {
+          const Dipole& d = *(const Dipole*)(y);
+          const double g1 = sectionValue(d);
+          // Crossing time estimated by linear interpolation
+          const double tc = t0 + (t - t0) * g0 / (g0 - g1);
+          if (crosses(g0, g1) && tc > MIN_TIME && _section.accept(d) &&
+              ++numCrossings == k) {
+            t = t0 + locate(sys, step, t0, y0, t - t0, y, false);
+            double f[6];
+            Physics::get_derivatives(*(const Dipole*)(y), f, _dynamics);
+            finish(ret, y, t, f);
+            done = true;
+          }
+          g0 = g1;
+        }
+      }
+    } catch (std::logic_error& e) {
+      gsl_odeiv2_evolve_free(evolve);
+      gsl_odeiv2_control_free(control);
+      gsl_odeiv2_step_free(step);
+      throw;
+    }
+    gsl_odeiv2_evolve_free(evolve);
+    gsl_odeiv2_control_free(control);
+    gsl_odeiv2_step_free(step);
+  }
+
+  // Fills ret at the final crossing from the state, velocity and
+  // variations there, after reflection for collisions.
+  void finish(Return& ret, const double y[42], const double T,
+              const double f[6]) const {
+    ret.y = Dipole(y[0], y[1], y[2], y[3], y[4], y[5]);
+    ret.T = T;
+    double dg[6];
+    sectionGradient(ret.y, dg);
+    double dgf = 0;
+    for (int i = 0; i < 6; ++i) dgf += dg[i] * f[i];
+    double P[36];
+    for (int i = 0; i < 6; ++i) {
+      for (int j = 0; j < 6; ++j) {
+        P[6*i+j] = ((i == j) ? 1 : 0) - f[i] * dg[j] / dgf;
+      }
+    }
+    std::copy(y+6, y+42, ret.M);
+    std::copy(y+6, y+42, ret.DP);
+    multiply6(P, ret.DP);
+  }
+
+  // Locates the section (or r = 1 if collision) inside the step of
+  // length hStep from y0 at t0 by safeguarded Newton on the step length.
+  // y is set to the state at the crossing. Returns the step length.
+  double locate(gsl_odeiv2_system& sys, gsl_odeiv2_step* step,
+                const double t0, const double y0[42], const double hStep,
+                double y[42], const bool collision) const {
+    auto value = [&](const double* s) {
+      const Dipole& d = *(const Dipole*)(s);
+      return collision ? d.get_r() - 1 : _section.evaluate(d);
+    };
+    auto gradient = [&](const double* s, double dg[6]) {
+      if (collision) {
+        for (int j = 0; j < 6; ++j) dg[j] = (j == 0) ? 1 : 0;
+      } else {
+        sectionGradient(*(const Dipole*)(s), dg);
+      }
+    };
+    return locateCrossing(sys, step, t0, y0, hStep, y, _dynamics, value,
+                          gradient);
+  }
+
+ private:
+  const EventSurface _section;
+  const int _k;
+  const double _eps;
+  const double _tol;
+  const Options::Dynamics _dynamics;
+  long _numIntegrations;
+};
+
+#endif
@@ -32,7 +32,9 @@ class Physics {
   //----------------------------------------
   // dxdt is an array of size 6 of the form
   //   [ dr_dt, dtheta_dt, dphi_dt, dpr_dt, dptheta_dt, dpphi_dt ]
-  static void get_derivatives(const Dipole& d, double dxdt[]) {
+  static void get_derivatives(
+      const Dipole& d, double dxdt[],
+      const Options::Dynamics dynamics = o.dynamics) {
     const double r = d.get_r();
     const double theta = d.get_theta();
     const double phi = d.get_phi();
@@ -40,6 +42,22 @@ class Physics {
     const double ptheta = d.get_ptheta();
     const double pphi = d.get_pphi();
 
+    // With a layout of fixed magnets the forces and torque are the
+    // gradient of its energy, in place of the terms of equations 55-57
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      const double r3 = r * r * r;
+      double g[3];
+      layout->energy(r, theta, phi, g);
+      const bool bouncing = (dynamics == Options::BOUNCING);
+      dxdt[0] = bouncing ? pr : 0;
+      dxdt[1] = ptheta / (r * r);
+      dxdt[2] = 10 * pphi;
+      dxdt[3] = bouncing ? ptheta * ptheta / r3 - g[0] : 0;
+      dxdt[4] = -g[1];
+      dxdt[5] = -g[2];
+      return;
+    }
+
     // Pre-computations
     const double r2 = r * r;
     const double r3 = r2 * r;
@@ -50,7 +68,7 @@ class Physics {
     const double cos2 = cos(phi-2*theta);
     const double sin2 = sin(phi-2*theta);
 
-    if (o.dynamics == Options::BOUNCING) {
+    if (dynamics == Options::BOUNCING) {
       dxdt[0] = pr;
       dxdt[3] = ptheta * ptheta / r3 -
           (1/(4*r4)) * (cos_phi + 3*cos2);
@@ -76,7 +94,8 @@ class Physics {
     dxdt[5] = -(1/(12*r3)) * (sin_phi + 3*sin2);
   }
 
-  static void get_jacobian(const Dipole& d, double* dfdy) {
+  static void get_jacobian(const Dipole& d, double* dfdy,
+                           const Options::Dynamics dynamics = o.dynamics) {
     const double r = d.get_r();
     const double theta = d.get_theta();
     const double phi = d.get_phi();
@@ -138,9 +157,40 @@ class Physics {
     gsl_matrix_set(m, 5, 3, 0);
     gsl_matrix_set(m, 5, 4, 0);
     gsl_matrix_set(m, 5, 5, 0);
+
+    // With a layout the force and torque rows come from the Hessian of its
+    // energy
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      double g[3];
+      double H[6];
+      layout->energy(r, theta, phi, g, H);
+      gsl_matrix_set(m, 3, 0, -(3*ptheta*ptheta/r4) - H[0]);
+      gsl_matrix_set(m, 3, 1, -H[1]);
+      gsl_matrix_set(m, 3, 2, -H[2]);
+      gsl_matrix_set(m, 4, 0, -H[1]);
+      gsl_matrix_set(m, 4, 1, -H[3]);
+      gsl_matrix_set(m, 4, 2, -H[4]);
+      gsl_matrix_set(m, 5, 0, -H[2]);
+      gsl_matrix_set(m, 5, 1, -H[4]);
+      gsl_matrix_set(m, 5, 2, -H[5]);
+    }
+
+    // r and pr are constant when sliding
+    if (dynamics == Options::SLIDING) {
+      for (int j = 0; j < 6; ++j) {
+        gsl_matrix_set(m, 0, j, 0);
+        gsl_matrix_set(m, 3, j, 0);
+      }
+    }
   }
 
   static double B_dir(const Dipole& d) {
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      double bx, by;
+      layout->field(d.get_r() * cos(d.get_theta()),
+                    d.get_r() * sin(d.get_theta()), bx, by);
+      return atan2(by, bx);
+    }
     return atan2(3*sin(2*d.get_theta()), 1+3*cos(2*d.get_theta()));
   }
 
@@ -155,6 +205,11 @@ class Physics {
     const double r = d.get_r();
     const double theta = d.get_theta();
     const double phi = d.get_phi();
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      double g[3];
+      layout->energy(r, theta, phi, g);
+      return make_double2(-g[0], -g[1] / r);
+    }
 
     const double r2 = r*r;
     const double cr = -1 / (4 * r2 * r2);
@@ -170,10 +225,59 @@ class Physics {
     const double r = d.get_r();
     const double theta = d.get_theta();
     const double phi = d.get_phi();
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      double g[3];
+      layout->energy(r, theta, phi, g);
+      return -g[2];
+    }
 
     return (-1/(12*r*r*r)) * (sin(phi) + 3*sin(phi-2*theta));
   }
 
+  // Distance from d to the center of the nearest fixed magnet, so that the
+  // spheres touch at 1. Without a layout this is r.
+  static double separation(const Dipole& d) {
+    const MagnetLayout* layout = MagnetLayout::active();
+    if (!layout) return d.get_r();
+    return layout->separation(d.get_r() * cos(d.get_theta()),
+                              d.get_r() * sin(d.get_theta()));
+  }
+
+  // Specular reflection of d off the nearest fixed magnet: the velocity
+  // pr r_hat + (ptheta/r) theta_hat is mirrored about the contact normal.
+  // Without a layout the normal is r_hat and only pr changes sign.
+  // Reflecting twice gives back d.
+  static void reflect(Dipole& d) {
+    const MagnetLayout* layout = MagnetLayout::active();
+    if (!layout) {
+      d.set_pr(-d.get_pr());
+      return;
+    }
+    const double r = d.get_r();
+    const double c = cos(d.get_theta());
+    const double s = sin(d.get_theta());
+    int k;
+    layout->separation(r*c, r*s, &k);
+    double nx = c;
+    double ny = s;
+    if (k >= 0) {
+      nx = r*c - layout->magnet(k).x;
+      ny = r*s - layout->magnet(k).y;
+      const double n = sqrt(nx*nx + ny*ny);
+      nx /= n;
+      ny /= n;
+    }
+    const double vr = d.get_pr();
+    const double vtheta = d.get_ptheta() / r;
+    double vx = vr*c - vtheta*s;
+    double vy = vr*s + vtheta*c;
+    const double vn = vx*nx + vy*ny;
+    vx -= 2*vn*nx;
+    vy -= 2*vn*ny;
+    d.set_pr(vx*c + vy*s);
+    d.set_ptheta(r * (-vx*s + vy*c));
+  }
+
 };
 
 #endif
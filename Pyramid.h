@@ -0,0 +1,285 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __PYRAMID_H__
+#define __PYRAMID_H__
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./MappedFile.h"
+
+// Level-of-detail pyramid of a single-step trajectory, for plotting runs
+// too long to load. Level k cuts the samples into buckets of 2^k
+// consecutive samples and keeps, per bucket, the time span and the min,
+// max and mean of each variable. A window of the run is drawn from the
+// lowest level with about one bucket per pixel, so the cost of a plot
+// depends on its width and not on the length of the run.
+//
+// The pyramid is a directory holding
+//   level<k>.bin  buckets of level k, for minLevel <= k <= maxLevel
+//   index.txt     written when the run ends (see writeIndex)
+// maxLevel is the first level with a single bucket. Buckets are records of
+// RECORD_SIZE doubles
+//   t0 t1 n min[NUM_VARIABLES] max[NUM_VARIABLES] mean[NUM_VARIABLES]
+// where t0 and t1 are the times of the first and last samples and n the
+// number of samples, which is 2^k except in the last bucket of a level.
+// Bucket i of a level is at byte RECORD_SIZE * 8 * i, and buckets are in
+// time order, so a window is found by binary search on t0. Variables are
+// r, theta, phi, pr, ptheta, pphi and E, with angles in degrees as in the
+// event output.
+//
+// The writer keeps one open bucket per level, so it uses memory
+// logarithmic in the run length and amortized constant time per sample.
+// Complete buckets are appended as the run goes, so a pyramid can be read
+// while it is written: the buckets of a level are then its file size over
+// the record size.
+class Pyramid {
+ public:
+  static const int NUM_VARIABLES = 7;
+  static const int RECORD_SIZE = 3 + 3 * NUM_VARIABLES;
+
+  static const char* variableName(const int i) {
+    static const char* names[NUM_VARIABLES] =
+        { "r", "theta", "phi", "pr", "ptheta", "pphi", "E" };
+    return names[i];
+  }
+
+  // Levels above this are never written
+  static const int MAX_LEVEL = 62;
+
+  static std::string levelFilename(const std::string& dir, const int k) {
+    return dir + "/level" + std::to_string(k) + ".bin";
+  }
+};
+
+class PyramidWriter {
+ public:
+  PyramidWriter(const std::string& dir, const int minLevel)
+      : _dir(dir), _minLevel(std::max(0, minLevel)), _numSamples(0) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::logic_error("Unable to create pyramid directory " + dir);
+    }
+    // Levels left by an earlier, longer run would be read as this one's
+    for (int k = 0; k <= Pyramid::MAX_LEVEL; ++k) {
+      unlink(Pyramid::levelFilename(dir, k).c_str());
+    }
+    unlink((dir + "/index.txt").c_str());
+  }
+
+  ~PyramidWriter() {
+    for (int k = 0; k < _files.size(); ++k) {
+      if (_files[k]) fclose(_files[k]);
+    }
+  }
+
+  // Adds the next sample. v holds the NUM_VARIABLES variables.
+  void add(const double t, const double v[Pyramid::NUM_VARIABLES]) {
+    Bucket b;
+    b.t0 = b.t1 = t;
+    b.n = 1;
+    for (int j = 0; j < Pyramid::NUM_VARIABLES; ++j) {
+      b.min[j] = b.max[j] = b.sum[j] = v[j];
+    }
+    ++_numSamples;
+    push(0, b);
+  }
+
+  // Ends the run: writes the last, partial bucket of every level up to the
+  // first with a single bucket, and the index.
+  void finish() {
+    if (_numSamples == 0) return;
+    int maxLevel = _minLevel;
+    while ((1L << maxLevel) < _numSamples) ++maxLevel;
+    // The samples after the last complete bucket of level k
+    Bucket carry = empty();
+    for (int k = 0; k < maxLevel; ++k) {
+      Bucket partial = (k < _open.size()) ? _open[k] : empty();
+      if (carry.n > 0) merge(partial, carry);
+      carry = partial;
+      if (carry.n > 0) write(k+1, carry);
+    }
+    writeIndex(maxLevel);
+  }
+
+ private:
+  struct Bucket {
+    double t0;
+    double t1;
+    double n;
+    double min[Pyramid::NUM_VARIABLES];
+    double max[Pyramid::NUM_VARIABLES];
+    double sum[Pyramid::NUM_VARIABLES];
+  };
+
+  static void merge(Bucket& a, const Bucket& b) {
+    if (a.n == 0) {
+      a = b;
+      return;
+    }
+    a.t1 = b.t1;
+    a.n += b.n;
+    for (int j = 0; j < Pyramid::NUM_VARIABLES; ++j) {
+      a.min[j] = std::min(a.min[j], b.min[j]);
+      a.max[j] = std::max(a.max[j], b.max[j]);
+      a.sum[j] += b.sum[j];
+    }
+  }
+
+  static Bucket empty() {
+    Bucket b;
+    b.n = 0;
+    return b;
+  }
+
+  // Adds a complete bucket of level k. It is written, and every second one
+  // completes a bucket of level k+1. _open[k] holds the first half of the
+  // next level k+1 bucket.
+  void push(const int k, const Bucket& b) {
+    if (k >= _open.size()) {
+      _open.resize(k+1, empty());
+      _children.resize(k+1, 0);
+    }
+    write(k, b);
+    merge(_open[k], b);
+    if (++_children[k] == 2) {
+      const Bucket full = _open[k];
+      _open[k] = empty();
+      _children[k] = 0;
+      push(k+1, full);
+    }
+  }
+
+  void write(const int k, const Bucket& b) {
+    if (k < _minLevel) return;
+    if (k >= _files.size()) {
+      _files.resize(k+1, 0);
+      _numWritten.resize(k+1, 0);
+    }
+    if (!_files[k]) {
+      _files[k] = fopen(Pyramid::levelFilename(_dir, k).c_str(), "wb");
+      if (!_files[k]) {
+        throw std::logic_error("Unable to write pyramid level " +
+                               Pyramid::levelFilename(_dir, k));
+      }
+    }
+    double record[Pyramid::RECORD_SIZE];
+    record[0] = b.t0;
+    record[1] = b.t1;
+    record[2] = b.n;
+    for (int j = 0; j < Pyramid::NUM_VARIABLES; ++j) {
+      record[3+j] = b.min[j];
+      record[3+Pyramid::NUM_VARIABLES+j] = b.max[j];
+      record[3+2*Pyramid::NUM_VARIABLES+j] = b.sum[j] / b.n;
+    }
+    fwrite(record, sizeof(double), Pyramid::RECORD_SIZE, _files[k]);
+    ++_numWritten[k];
+  }
+
+  // index.txt:
+  //   magphyx-pyramid 1
+  //   samples <n>
+  //   variables r theta phi pr ptheta pphi E
+  //   levels <minLevel> <maxLevel>
+  //   level <k> <buckets>       one line per level
+  void writeIndex(const int maxLevel) {
+    FILE* out = fopen((_dir + "/index.txt").c_str(), "w");
+    if (!out) {
+      throw std::logic_error("Unable to write pyramid index in " + _dir);
+    }
+    fprintf(out, "magphyx-pyramid 1\n");
+    fprintf(out, "samples %ld\n", _numSamples);
+    fprintf(out, "variables");
+    for (int j = 0; j < Pyramid::NUM_VARIABLES; ++j) {
+      fprintf(out, " %s", Pyramid::variableName(j));
+    }
+    fprintf(out, "\n");
+    fprintf(out, "levels %d %d\n", _minLevel, maxLevel);
+    for (int k = _minLevel; k <= maxLevel; ++k) {
+      fprintf(out, "level %d %ld\n", k,
+              (k < _numWritten.size()) ? _numWritten[k] : 0L);
+    }
+    fclose(out);
+  }
+
+ private:
+  const std::string _dir;
+  const int _minLevel;
+  long _numSamples;
+  std::vector<Bucket> _open;
+  std::vector<int> _children;
+  std::vector<FILE*> _files;
+  std::vector<long> _numWritten;
+};
+
+// Reads windows of a pyramid, also while it is being written.
+class PyramidReader {
+ public:
+  explicit PyramidReader(const std::string& dir) : _dir(dir) {
+    for (int k = 0; k <= Pyramid::MAX_LEVEL; ++k) {
+      struct stat st;
+      if (stat(Pyramid::levelFilename(dir, k).c_str(), &st) == 0) {
+        _levels.push_back(k);
+      }
+    }
+    if (_levels.empty()) {
+      throw std::logic_error("No pyramid in " + dir);
+    }
+  }
+
+  // Calls f(record) for the buckets overlapping [t0, t1] of the lowest
+  // level that has at most maxBuckets of them, or of the top level.
+  // Returns the level. Only the buckets output and two binary searches per
+  // level tried are read.
+  template <typename F>
+  int window(const double t0, const double t1, const long maxBuckets,
+             F f) const {
+    const int R = Pyramid::RECORD_SIZE;
+    for (int i = 0; i < _levels.size(); ++i) {
+      const MappedFile file(Pyramid::levelFilename(_dir, _levels[i]));
+      const double* records = (const double*)file.data();
+      const long n = file.size() / (R * sizeof(double));
+      // First bucket ending at or after t0, and first starting after t1
+      long a = 0, b = n;
+      while (a < b) {
+        const long m = (a + b) / 2;
+        if (records[m*R+1] < t0) a = m+1; else b = m;
+      }
+      long c = a, d = n;
+      while (c < d) {
+        const long m = (c + d) / 2;
+        if (records[m*R] <= t1) c = m+1; else d = m;
+      }
+      if (c - a <= maxBuckets || i+1 == _levels.size()) {
+        for (long j = a; j < c; ++j) {
+          f(records + j*R);
+        }
+        return _levels[i];
+      }
+    }
+    return -1;
+  }
+
+ private:
+  const std::string _dir;
+  std::vector<int> _levels;
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __RECURRENCE_H__
+#define __RECURRENCE_H__
+
+#include <stdint.h>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./EventSurface.h"
+
+// Classifies a run from its section crossings so that it can stop early.
+//
+// Each time the trajectory crosses the Poincare section (collisions by
+// default, or any event surface), the state is quantized to cells of
+// size q and hashed. A small table maps each hash to the crossing where
+// it was last seen. A repeat after p crossings proposes period p; the run
+// is periodic once every crossing for numConfirm whole periods has
+// repeated the one p crossings earlier.
+//
+// Independently, the run has escaped once pr > 0 and pr^2/2 > 1/(3 r^3).
+// The radial force is at least -1/r^4, so from there on the remaining
+// potential cannot stop the dipole from moving off to infinity.
+class RecurrenceDetector {
+ public:
+  enum Fate { UNRESOLVED, PERIODIC, ESCAPED };
+
+  static const char* fateName(const Fate fate) {
+    switch (fate) {
+      case PERIODIC: return "periodic";
+      case ESCAPED: return "escaped";
+      default: return "unresolved";
+    }
+  }
+
+  RecurrenceDetector(const double q, const int maxPeriod,
+                     const int numConfirm, const EventSurface& section,
+                     const Dipole& d)
+      : _q(q), _maxPeriod(maxPeriod), _numConfirm(numConfirm),
+        _section(section), _d(d), _value(section.evaluate(d)),
+        _k(0), _period(0), _matches(0), _fate(UNRESOLVED) {
+    // Table holds at least 2*maxPeriod entries; a power of 2 so that
+    // hashes can be masked
+    int size = 1;
+    while (size < 2*maxPeriod) size *= 2;
+    _table.resize(size);
+    _history.resize(maxPeriod+1);
+  }
+
+  bool enabled() const { return _q > 0; }
+  bool done() const { return _fate != UNRESOLVED; }
+  Fate fate() const { return _fate; }
+  // Period in section crossings if periodic
+  int period() const { return _fate == PERIODIC ? _period : 0; }
+
+  // Call after each accepted step that is not a collision.
+  void step(const Dipole& d) {
+    if (escaped(d)) {
+      _fate = ESCAPED;
+      return;
+    }
+    if (_section.kind() != EventSurface::COLLISION) {
+      const double value = _section.evaluate(d);
+      if (crosses(_value, value) && _section.accept(d)) {
+        cross(Dipole::interpolateZeroCrossing(_d, d, _value, value));
+      }
+      _d = d;
+      _value = value;
+    }
+  }
+
+  // Call at each collision, before reflection.
+  void collision(const Dipole& d) {
+    if (_section.kind() == EventSurface::COLLISION) {
+      cross(d);
+    } else {
+      _d = d;
+      _value = _section.evaluate(d);
+    }
+  }
+
+ private:
+  struct Entry {
+    Entry() : hash(0), k(-1) {}
+    uint64_t hash;
+    long k;
+  };
+
+  static bool escaped(const Dipole& d) {
+    const double r = d.get_r();
+    const double pr = d.get_pr();
+    return pr > 0 && pr*pr/2 > 1/(3*r*r*r);
+  }
+
+  bool crosses(const double a, const double b) const {
+    switch (_section.direction()) {
+      case EventSurface::POS: return a < 0 && b >= 0;
+      case EventSurface::NEG: return a > 0 && b <= 0;
+      default: return (a < 0 && b >= 0) || (a > 0 && b <= 0);
+    }
+  }
+
+  uint64_t quantize(const Dipole& d) const {
+    const double* y = (const double*)(&d);
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < 6; ++i) {
+      const int64_t cell = (int64_t)floor(y[i] / _q);
+      // splitmix64 finalizer on each component
+      uint64_t x = (uint64_t)cell + 0x9e3779b97f4a7c15ULL * (i+1);
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      h = (h ^ (x ^ (x >> 31))) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  void cross(const Dipole& d) {
+    const uint64_t hash = quantize(d);
+    const int historySize = _history.size();
+
+    if (_period > 0 && _k >= _period &&
+        _history[(_k - _period) % historySize] == hash) {
+      ++_matches;
+    } else {
+      // Propose the period from the last crossing with the same hash
+      const Entry& e = _table[hash & (_table.size()-1)];
+      const long p = (e.hash == hash && e.k >= 0) ? _k - e.k : 0;
+      _period = (p > 0 && p <= _maxPeriod) ? p : 0;
+      _matches = (_period > 0) ? 1 : 0;
+    }
+
+    Entry& e = _table[hash & (_table.size()-1)];
+    e.hash = hash;
+    e.k = _k;
+    _history[_k % historySize] = hash;
+    ++_k;
+
+    if (_period > 0 && _matches >= _numConfirm * _period) {
+      _fate = PERIODIC;
+    }
+  }
+
+ private:
+  const double _q;
+  const int _maxPeriod;
+  const int _numConfirm;
+  const EventSurface _section;
+  // Previous state and section value, for non-collision sections
+  Dipole _d;
+  double _value;
+
+  // Number of section crossings so far
+  long _k;
+  std::vector<Entry> _table;
+  // Hashes of the last maxPeriod+1 crossings
+  std::vector<uint64_t> _history;
+  // Candidate period and number of consecutive crossings matching it
+  long _period;
+  long _matches;
+  Fate _fate;
+};
+
+#endif
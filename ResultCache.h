@@ -0,0 +1,298 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __RESULT_CACHE_H__
+#define __RESULT_CACHE_H__
+
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Ensemble.h"
+#include "./Options.h"
+#include "./Recurrence.h"
+
+// On-disk cache of finished runs, addressed by a hash of everything that
+// determines a run except its length: the initial condition, the options
+// that affect the trajectory or its output, and ENGINE_VERSION. Bump
+// ENGINE_VERSION with any change to the numerics so that old entries are
+// no longer found.
+//
+// A run of length limit ("e<numEvents>" or "s<numSteps>") is stored in
+// dir/<hash>/ as
+//   <limit>.run   final state and enough to continue the run (below)
+//   <limit>.csv   event output, if it was written to a file
+//   <limit>.json  --summary output, if any
+// The .run file is written last and renamed into place, so entries are
+// complete once visible and concurrent writers do not corrupt each other.
+//
+// A run is found either exactly, or as the longest shorter run of the same
+// kind, which can be continued to the new length from its final state if
+// resumable(). The continued run is identical to a run from the start.
+class ResultCache {
+ public:
+  static const int ENGINE_VERSION = 1;
+
+  struct Entry {
+    RunResult result;
+    int numEvents;
+    int numSteps;
+    bool hasEvents;
+    bool hasSummary;
+    // Path without extension
+    std::string base;
+  };
+
+  explicit ResultCache(const std::string& dir) : _dir(dir) {
+    makeDir(dir);
+  }
+
+  // Everything but the length that determines a run of ic
+  static std::string config(const Dipole& ic,
+                            const Options::Dynamics dynamics) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "engine %d ic %a %a %a %a %a %a dynamics %d h %a fixed_h %d "
+             "eps %a integrator %d scheme %d project %d sampleDt %a "
+             "singleStep %d fft %d recurrence %a %d %d",
+             ENGINE_VERSION, ic.get_r(), ic.get_theta(), ic.get_phi(),
+             ic.get_pr(), ic.get_ptheta(), ic.get_pphi(), (int)dynamics,
+             o.h, (int)o.fixed_h, o.eps, (int)o.integrator,
+             (int)o.fixedScheme, o.projectEvery, o.sampleDt,
+             (int)o.singleStep, (int)o.fft, o.recurrenceTol, o.maxPeriod,
+             o.recurrenceConfirm);
+    std::string s = buf;
+    s += " events";
+    for (int i = 0; i < o.events.size(); ++i) {
+      s += " " + surfaceName(o.events[i]);
+    }
+    if (o.recurrenceTol > 0) {
+      s += " section " + surfaceName(o.section);
+    }
+    if (const MagnetLayout* layout = MagnetLayout::active()) {
+      s += " layout " + layout->signature();
+    }
+    return s;
+  }
+
+  // Whether a run with the current options can be continued from the
+  // state of a shorter one. Excluded are the options with state that is
+  // not kept: streaming summaries, energy projection, recurrence
+  // detection and resampled or single-step output.
+  static bool resumable() {
+    return o.summaryFilename.empty() && o.projectEvery == 0 &&
+        o.recurrenceTol == 0 && o.sampleDt == 0 &&
+        o.singleStep == Options::NONE;
+  }
+
+  // Finds the run of config with the given length. If there is none and
+  // allowShorter, finds the longest shorter run instead. Returns false if
+  // nothing was found.
+  bool find(const std::string& config, const int numEvents,
+            const int numSteps, const bool allowShorter, Entry& e) const {
+    const std::string dir = _dir + "/" + hash(config);
+    if (read(dir + "/" + limitName(numEvents, numSteps), config, e)) {
+      return true;
+    }
+    if (!allowShorter) return false;
+
+    const std::string kind = (numEvents != -1) ? "e" : "s";
+    const long limit = (numEvents != -1) ? numEvents : numSteps;
+    long best = -1;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    while (struct dirent* f = readdir(d)) {
+      const std::string name = f->d_name;
+      if (name.compare(0, kind.size(), kind) != 0 ||
+          name.size() < 5 || name.compare(name.size()-4, 4, ".run") != 0) {
+        continue;
+      }
+      const long n = atol(name.c_str() + kind.size());
+      if (n < limit && n > best) best = n;
+    }
+    closedir(d);
+    if (best < 0) return false;
+    return read(dir + "/" + kind + std::to_string(best), config, e);
+  }
+
+  // Stores a finished run. eventsFilename and summaryFilename are copied
+  // into the cache unless empty.
+  void store(const std::string& config, const int numEvents,
+             const int numSteps, const RunResult& result,
+             const std::string& eventsFilename,
+             const std::string& summaryFilename) const {
+    const std::string dir = _dir + "/" + hash(config);
+    makeDir(dir);
+    const std::string base = dir + "/" + limitName(numEvents, numSteps);
+    if (!eventsFilename.empty()) {
+      copyInto(eventsFilename, base + ".csv");
+    }
+    if (!summaryFilename.empty()) {
+      copyInto(summaryFilename, base + ".json");
+    }
+
+    std::string tmp;
+    FILE* out = temporary(base, tmp);
+    const Dipole& d = result.d;
+    fprintf(out, "# magphyx-cache %d\n", ENGINE_VERSION);
+    fprintf(out, "config %s\n", config.c_str());
+    fprintf(out, "limit %d %d\n", numEvents, numSteps);
+    fprintf(out, "state %a %a %a %a %a %a %a\n", d.get_r(), d.get_theta(),
+            d.get_phi(), d.get_pr(), d.get_ptheta(), d.get_pphi(),
+            d.get_E0());
+    fprintf(out, "result %a %d %ld %d %d %a %d\n", result.t,
+            result.numEvents, result.numSteps, (int)result.fate,
+            result.period, result.h, (int)result.atCollision);
+    fprintf(out, "outputs %d %d\n", (int)!eventsFilename.empty(),
+            (int)!summaryFilename.empty());
+    fclose(out);
+    commit(tmp, base + ".run");
+  }
+
+  // Copies a cached output file to filename, or to stdout if empty.
+  static void copy(const std::string& from, const std::string& filename) {
+    FILE* in = fopen(from.c_str(), "rb");
+    if (!in) {
+      throw std::logic_error("Unable to open " + from);
+    }
+    FILE* out = filename.empty() ? stdout : fopen(filename.c_str(), "wb");
+    if (!out) {
+      fclose(in);
+      throw std::logic_error("Unable to open " + filename);
+    }
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    if (out != stdout) {
+      fclose(out);
+    }
+  }
+
+  // Hex digest of two 64 bit FNV-1a hashes with different offsets. The
+  // full config is kept in the entry and compared, so a collision only
+  // costs a miss.
+  static std::string hash(const std::string& s) {
+    uint64_t a = 14695981039346656037ULL;
+    uint64_t b = 0x6c62272e07bb0142ULL;
+    for (size_t i = 0; i < s.size(); ++i) {
+      a = (a ^ (unsigned char)s[i]) * 1099511628211ULL;
+      b = (b ^ (unsigned char)s[i]) * 1099511628211ULL;
+      b ^= b >> 29;
+    }
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)a,
+             (unsigned long long)b);
+    return buf;
+  }
+
+ private:
+  static std::string surfaceName(const EventSurface& s) {
+    return s.name() + ":" + std::to_string((int)s.direction());
+  }
+
+  static std::string limitName(const int numEvents, const int numSteps) {
+    return (numEvents != -1) ? "e" + std::to_string(numEvents) :
+        "s" + std::to_string(numSteps);
+  }
+
+  static void makeDir(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::logic_error("Unable to create cache directory " + dir);
+    }
+  }
+
+  // Reads base.run. Returns false if missing or for another config.
+  static bool read(const std::string& base, const std::string& config,
+                   Entry& e) {
+    FILE* in = fopen((base + ".run").c_str(), "r");
+    if (!in) return false;
+    std::vector<std::string> lines;
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+      lines.push_back(line);
+      if (!lines.back().empty() && lines.back().back() == '\n') {
+        lines.back().pop_back();
+      }
+    }
+    fclose(in);
+    if (lines.size() != 6 || lines[1] != "config " + config) return false;
+
+    double y[7];
+    int fate, atCollision, hasEvents, hasSummary;
+    RunResult& r = e.result;
+    if (sscanf(lines[2].c_str(), "limit %d %d", &e.numEvents,
+               &e.numSteps) != 2 ||
+        sscanf(lines[3].c_str(), "state %la %la %la %la %la %la %la", &y[0],
+               &y[1], &y[2], &y[3], &y[4], &y[5], &y[6]) != 7 ||
+        sscanf(lines[4].c_str(), "result %la %d %ld %d %d %la %d", &r.t,
+               &r.numEvents, &r.numSteps, &fate, &r.period, &r.h,
+               &atCollision) != 7 ||
+        sscanf(lines[5].c_str(), "outputs %d %d", &hasEvents,
+               &hasSummary) != 2) {
+      return false;
+    }
+    // Dipole's constructor takes E0 from the state; restore the original
+    r.d = Dipole(y[0], y[1], y[2], y[3], y[4], y[5]);
+    r.d.set_E0(y[6]);
+    r.fate = (RecurrenceDetector::Fate)fate;
+    r.atCollision = (atCollision != 0);
+    e.hasEvents = (hasEvents != 0);
+    e.hasSummary = (hasSummary != 0);
+    e.base = base;
+    return true;
+  }
+
+  // Opens a new temporary file next to base
+  static FILE* temporary(const std::string& base, std::string& tmp) {
+    std::vector<char> name(base.begin(), base.end());
+    const char suffix[] = ".tmpXXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix));
+    const int fd = mkstemp(name.data());
+    if (fd < 0) {
+      throw std::logic_error("Unable to write to cache " + base);
+    }
+    tmp = name.data();
+    return fdopen(fd, "w");
+  }
+
+  static void commit(const std::string& tmp, const std::string& filename) {
+    if (rename(tmp.c_str(), filename.c_str()) != 0) {
+      unlink(tmp.c_str());
+      throw std::logic_error("Unable to write to cache " + filename);
+    }
+  }
+
+  static void copyInto(const std::string& from, const std::string& to) {
+    std::string tmp;
+    fclose(temporary(to, tmp));
+    copy(from, tmp);
+    commit(tmp, to);
+  }
+
+ private:
+  const std::string _dir;
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+#ifndef __RESULT_FILE_H__
+#define __RESULT_FILE_H__
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Result file of an ensemble run (or one shard of it). The file is
+// self-describing: it starts with "# key value" lines giving the format,
+// the ensemble, the shard and the settings the runs used, followed by a
+// CSV column header and one row per run in increasing run order. Rows use
+// %.17g so that results survive a round trip exactly.
+//
+// Only depends on the standard library so that magphyx-merge can use it
+// without linking the simulator.
+class ResultFile {
+ public:
+  typedef std::vector<std::pair<std::string, std::string> > Header;
+
+  static const char* format() { return "magphyx-result 2"; }
+
+  static const char* columns() {
+    return "run, r0, theta0, phi0, pr0, ptheta0, pphi0,"
+        " events, t, r, theta, phi, pr, ptheta, pphi, E, dE, fate, period";
+  }
+
+  static void writeHeader(FILE* out, const Header& header) {
+    fprintf(out, "# format %s\n", format());
+    for (int i = 0; i < header.size(); ++i) {
+      fprintf(out, "# %s %s\n",
+              header[i].first.c_str(), header[i].second.c_str());
+    }
+    fprintf(out, "%s\n", columns());
+  }
+
+  // Opens a result file and reads its header.
+  explicit ResultFile(const std::string& filename)
+      : _filename(filename), _in(filename.c_str()) {
+    if (!_in) {
+      throw std::logic_error("Unable to open result file " + filename);
+    }
+    std::string line;
+    while (getline(_in, line)) {
+      if (line.empty() || line[0] != '#') break;
+      const size_t key = line.find_first_not_of(" ", 1);
+      const size_t sp = line.find(' ', key);
+      if (key == std::string::npos) continue;
+      if (sp == std::string::npos) {
+        _header.push_back(make_pair(line.substr(key), std::string()));
+      } else {
+        _header.push_back(make_pair(line.substr(key, sp-key),
+                                    line.substr(sp+1)));
+      }
+    }
+    if (value("format") != format()) {
+      throw std::logic_error(filename + " is not a magphyx result file");
+    }
+    if (line != columns()) {
+      throw std::logic_error(filename + " has unexpected columns");
+    }
+  }
+
+  const std::string& filename() const { return _filename; }
+  const Header& header() const { return _header; }
+
+  std::string value(const std::string& key) const {
+    for (int i = 0; i < _header.size(); ++i) {
+      if (_header[i].first == key) return _header[i].second;
+    }
+    return "";
+  }
+
+  // Reads the next row. run is the row's run index.
+  bool nextRow(long& run, std::string& row) {
+    while (getline(_in, row)) {
+      if (row.empty()) continue;
+      run = atol(row.c_str());
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  const std::string _filename;
+  std::ifstream _in;
+  Header _header;
+};
+
+#endif
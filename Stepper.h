@@ -3,35 +3,67 @@
 
 #include <stdexcept>
 
+#include "./Event.h"
+#include "./FixedStep.h"
 #include "./Physics.h"
+#include "./Taylor.h"
+
+// Passed to func and jac through sys.params
+struct StepperParams {
+  Options::Dynamics dynamics;
+  // Number of right-hand side evaluations
+  long numEvaluations;
+};
 
 int func(double t, const double y[], double f[], void *params) {
   (void)(t); /* avoid unused parameter warning */
-  Physics::get_derivatives(*(const Dipole*)(y), f);
+  StepperParams* p = (StepperParams*)(params);
+  ++p->numEvaluations;
+  Physics::get_derivatives(*(const Dipole*)(y), f, p->dynamics);
   return GSL_SUCCESS;
 }
 
 int jac(double t, const double y[], double *dfdy, double dfdt[], void *params) {
   (void)(t); /* avoid unused parameter warning */
-  Physics::get_jacobian(*(const Dipole*)(y), dfdy);
+  Physics::get_jacobian(*(const Dipole*)(y), dfdy,
+                        ((const StepperParams*)(params))->dynamics);
   for (int i = 0; i < 6; ++i) {
     dfdt[i] = 0.0;
   }
   return GSL_SUCCESS;
 }
 
-class Stepper {
+class Stepper : public DenseStep {
  public:
   Stepper(const Dipole& freeDipole, const double h_, const bool fixed_h_,
-          const double eps_abs_) :
-      d0(freeDipole), d(freeDipole), eps_abs(eps_abs_), eps_rel(0),
-      a_y(1), a_dydt(0), t1(1e100),
-      t(0), h(h_), _fixed_h(fixed_h_) {
+          const double eps_abs_,
+          const Options::Dynamics dynamics_ = o.dynamics,
+          const Options::Integrator integrator = o.integrator,
+          const Options::FixedScheme scheme = o.fixedScheme) :
+      d(freeDipole), t(0), h(h_), _step(0), control(0), evolve(0),
+      _fixed_h(fixed_h_), eps_abs(eps_abs_), eps_rel(0), a_y(1), a_dydt(0),
+      t1(1e100), _fixed(0), _taylor(0), _hExpand(-1), _tau(0), _tau0(0),
+      d0(freeDipole) {
+    _params.dynamics = dynamics_;
+    _params.numEvaluations = 0;
+
+    if (fixed_h_ && scheme != Options::GSL) {
+      _fixed = new FixedStep(scheme, dynamics_);
+      return;
+    }
+
+    if (integrator == Options::TAYLOR) {
+      _taylor = new TaylorSeries(eps_abs, dynamics_);
+      return;
+    }
 
     const gsl_odeiv2_step_type* step_type = gsl_odeiv2_step_rk8pd;
+    if (integrator == Options::RKF45) {
+      step_type = gsl_odeiv2_step_rkf45;
+    }
     // const gsl_odeiv2_step_type* step_type = gsl_odeiv2_step_bsimp;
  
-    sys = { func, jac, 6, 0 };
+    sys = { func, jac, 6, &_params };
 
     _step = gsl_odeiv2_step_alloc(step_type, 6);
     control = gsl_odeiv2_control_standard_new(eps_abs, eps_rel, a_y, a_dydt);
@@ -39,11 +71,25 @@ class Stepper {
   }
 
   ~Stepper() {
+    if (_fixed) {
+      delete _fixed;
+      return;
+    }
+    if (_taylor) {
+      delete _taylor;
+      return;
+    }
     gsl_odeiv2_evolve_free (evolve);
     gsl_odeiv2_control_free (control);
     gsl_odeiv2_step_free(_step);
   }
 
+  // Right-hand side evaluations so far. For the Taylor backend, the
+  // number of series expansions.
+  long numEvaluations() const {
+    return _fixed ? _fixed->numEvaluations() : _params.numEvaluations;
+  }
+
   void step() {
     doStep(false);
   }
@@ -56,27 +102,123 @@ class Stepper {
     doStep(true);
   }
 
+  // Adaptive steps will not go past t1_, and the step that reaches it
+  // ends exactly on t1_.
+  void setEnd(const double t1_) {
+    t1 = t1_;
+  }
+
+  // Takes k steps without logging in between. With a fixed step scheme
+  // the steps are batched; see FixedStep.
+  void steps(const long k) {
+    if (_fixed) {
+      _fixed->steps((double*)(&d), h, k);
+      t += k * h;
+      return;
+    }
+    for (long j = 0; j < k; ++j) {
+      step();
+    }
+  }
+
   // Backup one step 
   void undo() {
+    // Fixed step schemes keep no backup
+    if (_fixed) {
+      throw std::logic_error("No undo when using a fixed step scheme.");
+    }
     d = d0;
-    // t = t0;
+    t = t0;
     h = h0;
-    reset();
+    // The Taylor series stays valid since it was expanded at or before t0
+    if (_taylor) {
+      _tau = _tau0;
+    } else {
+      reset();
+    }
   }
 
   void reset() {
+    if (_fixed) return;
+    if (_taylor) {
+      _hExpand = -1;
+      return;
+    }
     gsl_odeiv2_step_reset(_step);
     gsl_odeiv2_evolve_reset(evolve);
   }
 
+  // Dense output is only available with the Taylor backend, where the
+  // last step is read from its series.
+  bool interpolate(const double s, Dipole& out) const {
+    if (!_taylor || _hExpand <= 0) return false;
+    out = d;
+    _taylor->evaluate(_tau0 + s * (_tau - _tau0), (double*)(&out));
+    return true;
+  }
+
+  // Integrates to exactly tEnd, reflecting at collisions in the same way
+  // as doSimulation. log() is called after each accepted step and
+  // collision() at each collision, before reflection. Returns the number
+  // of steps.
+  template <typename Log, typename Collision>
+  long advance(const double tEnd, Log log, Collision collision) {
+    setEnd(tEnd);
+    long numSteps = 0;
+    while (t < tEnd) {
+      numSteps += advanceStep(log, collision);
+    }
+    return numSteps;
+  }
+
+  // Takes one step of advance(): a single step, or if it ends inside the
+  // sphere, the half steps that locate the collision and the reflection.
+  // Returns the number of steps.
+  template <typename Log, typename Collision>
+  long advanceStep(Log log, Collision collision) {
+    step();
+    long numSteps = 1;
+    d.set_theta(Physics::normalizeAngle(d.get_theta()));
+    d.set_phi(Physics::normalizeAngle(d.get_phi()));
+    if (Physics::separation(d) < 1) {
+      undo();
+      while (Physics::separation(d) > 1.0000000000001) {
+        stepHalf();
+        ++numSteps;
+        if (Physics::separation(d) < 1) {
+          undo();
+        } else {
+          log();
+        }
+      }
+      collision();
+      Physics::reflect(d);
+      reset();
+    } else {
+      log();
+    }
+    return numSteps;
+  }
+
  private:
   void doStep(const bool fixed) {
+    if (_fixed) {
+      _fixed->step((double*)(&d), h);
+      t += h;
+      return;
+    }
+
     d0 = d;
     t0 = t;
     h0 = h;
 
     // d and y are linked!
     double* y = (double*)(&d);
+    if (_taylor) {
+      _tau0 = _tau;
+      taylorStep(y, fixed || _fixed_h);
+      return;
+    }
     int status;
     if (fixed || _fixed_h) {
       status = gsl_odeiv2_evolve_apply_fixed_step(
@@ -91,6 +233,33 @@ class Stepper {
     }
   }
 
+  void taylorStep(double* y, const bool fixed) {
+    // Steps that end inside the last expanded step, such as the half
+    // steps that locate a collision, are read from the series. The offset
+    // into the step is kept separately from t, which may be too large to
+    // resolve the last halvings.
+    if (fixed && _hExpand > 0 && _tau + h <= _hExpand) {
+      _tau += h;
+      _taylor->evaluate(_tau, y);
+      t += h;
+      return;
+    }
+
+    const double hMax = _taylor->expand(y);
+    ++_params.numEvaluations;
+    const double step = fixed ? h : std::min(hMax, t1 - t);
+    _taylor->evaluate(step, y);
+    t = (!fixed && step == t1 - t) ? t1 : t + step;
+    _hExpand = step;
+    _tau0 = 0;
+    _tau = step;
+    // Next step size, and the step that undo() restores
+    if (!fixed) {
+      h = step;
+      h0 = step;
+    }
+  }
+
  public:
   Dipole d;
   double t;
@@ -102,12 +271,23 @@ class Stepper {
   gsl_odeiv2_control* control;
   gsl_odeiv2_evolve* evolve;
   const bool _fixed_h;
+  StepperParams _params;
   const double eps_abs;
   const double eps_rel;
   const double a_y;
   const double a_dydt;
-  const double t1;
+  double t1;
   
+  // Fixed step scheme, or 0
+  FixedStep* _fixed;
+
+  // Taylor series backend, or 0 for GSL. The series was last expanded
+  // for a step of length _hExpand; the state is at offset _tau into it.
+  TaylorSeries* _taylor;
+  double _hExpand;
+  double _tau;
+  double _tau0;
+
   // backups
   Dipole d0;
   double t0;
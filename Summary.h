@@ -0,0 +1,389 @@
+#ifndef __SUMMARY_H__
+#define __SUMMARY_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./Physics.h"
+
+// Streaming statistics of the events of a run, for studies that only need
+// aggregates. Every accumulator uses memory independent of the number of
+// events.
+
+// Mean, variance, min and max by Welford's algorithm.
+class Moments {
+ public:
+  Moments() : _n(0), _mean(0), _m2(0), _min(INFINITY), _max(-INFINITY) {}
+
+  void add(const double x) {
+    ++_n;
+    const double delta = x - _mean;
+    _mean += delta / _n;
+    _m2 += delta * (x - _mean);
+    _min = std::min(_min, x);
+    _max = std::max(_max, x);
+  }
+
+  long n() const { return _n; }
+  double mean() const { return _mean; }
+  double variance() const { return (_n > 1) ? _m2 / (_n-1) : 0; }
+  double min() const { return _min; }
+  double max() const { return _max; }
+
+ private:
+  long _n;
+  double _mean;
+  double _m2;
+  double _min;
+  double _max;
+};
+
+// Quantile sketch with relative accuracy alpha (DDSketch, Masson et al.
+// 2019). Values are counted in logarithmic bins of ratio
+// gamma = (1+alpha)/(1-alpha), separately for each sign, so any quantile
+// is returned within a factor 1 +- alpha of the true value.
+class QuantileSketch {
+ public:
+  explicit QuantileSketch(const double alpha = 0.01)
+      : _logGamma(log((1+alpha)/(1-alpha))), _zeros(0), _n(0) {}
+
+  void add(const double x) {
+    ++_n;
+    if (fabs(x) < 1e-300) {
+      ++_zeros;
+    } else if (x > 0) {
+      ++_positive[bin(x)];
+    } else {
+      ++_negative[bin(-x)];
+    }
+  }
+
+  double quantile(const double q) const {
+    if (_n == 0) return 0;
+    const long rank = (long)(q * (_n-1));
+    long seen = 0;
+    for (Store::const_reverse_iterator it = _negative.rbegin();
+         it != _negative.rend(); ++it) {
+      seen += it->second;
+      if (seen > rank) return -value(it->first);
+    }
+    seen += _zeros;
+    if (seen > rank) return 0;
+    for (Store::const_iterator it = _positive.begin();
+         it != _positive.end(); ++it) {
+      seen += it->second;
+      if (seen > rank) return value(it->first);
+    }
+    return value(_positive.rbegin()->first);
+  }
+
+ private:
+  typedef std::map<int, long> Store;
+
+  int bin(const double x) const {
+    return (int)ceil(log(x) / _logGamma);
+  }
+
+  // Midpoint (in relative terms) of bin i
+  double value(const int i) const {
+    const double gamma = exp(_logGamma);
+    return 2 * exp(i * _logGamma) / (gamma + 1);
+  }
+
+ private:
+  const double _logGamma;
+  Store _positive;
+  Store _negative;
+  long _zeros;
+  long _n;
+};
+
+// Histogram with numBins equal bins on [min, max] and counts of values
+// outside.
+class Histogram {
+ public:
+  Histogram(const double min, const double max, const int numBins)
+      : _min(min), _max(max), _counts(numBins, 0), _under(0), _over(0) {}
+
+  void add(const double x) {
+    if (x < _min) {
+      ++_under;
+    } else if (x > _max) {
+      ++_over;
+    } else {
+      const int n = _counts.size();
+      ++_counts[std::min(n-1, (int)(n * (x - _min) / (_max - _min)))];
+    }
+  }
+
+  void writeJson(FILE* out) const {
+    fprintf(out, "{\"min\":%.17g,\"max\":%.17g,\"under\":%ld,\"over\":%ld,"
+            "\"counts\":", _min, _max, _under, _over);
+    writeCounts(out, _counts);
+    fprintf(out, "}");
+  }
+
+  static void writeCounts(FILE* out, const std::vector<long>& counts) {
+    fprintf(out, "[");
+    for (int i = 0; i < counts.size(); ++i) {
+      fprintf(out, "%s%ld", i ? "," : "", counts[i]);
+    }
+    fprintf(out, "]");
+  }
+
+ private:
+  const double _min;
+  const double _max;
+  std::vector<long> _counts;
+  long _under;
+  long _over;
+};
+
+// Histogram of |x| with binsPerDecade bins per decade from 10^log10Min to
+// 10^log10Max.
+class LogHistogram {
+ public:
+  LogHistogram(const int log10Min, const int log10Max, const int binsPerDecade)
+      : _log10Min(log10Min), _binsPerDecade(binsPerDecade),
+        _counts((log10Max - log10Min) * binsPerDecade, 0),
+        _under(0), _over(0) {}
+
+  void add(const double x) {
+    const double l = (log10(fabs(x)) - _log10Min) * _binsPerDecade;
+    if (!(l >= 0)) {
+      ++_under;
+    } else if (l >= _counts.size()) {
+      ++_over;
+    } else {
+      ++_counts[(int)l];
+    }
+  }
+
+  void writeJson(FILE* out) const {
+    fprintf(out, "{\"log10Min\":%d,\"binsPerDecade\":%d,\"under\":%ld,"
+            "\"over\":%ld,\"counts\":", _log10Min, _binsPerDecade,
+            _under, _over);
+    Histogram::writeCounts(out, _counts);
+    fprintf(out, "}");
+  }
+
+ private:
+  const int _log10Min;
+  const int _binsPerDecade;
+  std::vector<long> _counts;
+  long _under;
+  long _over;
+};
+
+// The k events with the largest values.
+class TopK {
+ public:
+  struct Entry {
+    double value;
+    int n;
+    double t;
+    bool operator<(const Entry& e) const { return value > e.value; }
+  };
+
+  explicit TopK(const int k) : _k(k) {}
+
+  void add(const double value, const int n, const double t) {
+    if (_heap.size() < _k) {
+      Entry e = { value, n, t };
+      _heap.push_back(e);
+      std::push_heap(_heap.begin(), _heap.end());
+    } else if (value > _heap.front().value) {
+      std::pop_heap(_heap.begin(), _heap.end());
+      Entry& e = _heap.back();
+      e.value = value;
+      e.n = n;
+      e.t = t;
+      std::push_heap(_heap.begin(), _heap.end());
+    }
+  }
+
+  // Largest first
+  std::vector<Entry> entries() const {
+    std::vector<Entry> sorted = _heap;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+  }
+
+ private:
+  const int _k;
+  // Min heap on value
+  std::vector<Entry> _heap;
+};
+
+// Accumulates per event type:
+//   - count and first/last time
+//   - moments and quantiles of dt (time since the previous event of the
+//     same type, e.g. inter-collision times), r, theta, phi, pr, ptheta,
+//     pphi, beta and dE
+//   - fixed-bin histograms of theta, phi, beta (degrees) and pr, whose
+//     range is bounded by energy: pr^2 <= 2(E0 + 1/3) for r >= 1. The
+//     bound is for the single fixed magnet, so main rejects --summary
+//     with --layout.
+//   - log-bin histograms of dt and dE
+//   - the events with the largest dE
+class Summary {
+ public:
+  enum Quantity { DT, R, THETA, PHI, PR, PTHETA, PPHI, BETA, DE,
+                  NUM_QUANTITIES };
+
+  static const char* quantityName(const int q) {
+    static const char* names[NUM_QUANTITIES] = {
+      "dt", "r", "theta", "phi", "pr", "ptheta", "pphi", "beta", "dE" };
+    return names[q];
+  }
+
+  Summary(const Dipole& d, const int topK = 10)
+      : _E0(d.get_E()), _prMax(sqrt(2*std::max(0.0, d.get_E() + 1.0/3))),
+        _topK(topK), _numEvents(0) {}
+
+  ~Summary() {
+    for (Types::iterator it = _types.begin(); it != _types.end(); ++it) {
+      delete it->second;
+    }
+  }
+
+  void add(const std::string& name, const Dipole& d, const double t,
+           const int n) {
+    Type*& type = _types[name];
+    if (!type) {
+      type = new Type(_prMax, _topK);
+      _order.push_back(name);
+      type->first = t;
+    } else {
+      type->add(DT, t - type->last);
+      type->dt.add(t - type->last);
+    }
+    type->last = t;
+    ++type->count;
+    ++_numEvents;
+
+    const double theta = Physics::rad2deg(d.get_theta());
+    const double phi = Physics::rad2deg(d.get_phi());
+    const double beta =
+        Physics::rad2deg(Physics::normalizeAngle(Physics::get_beta(d)));
+    const double dE = d.get_dE();
+    type->add(R, d.get_r());
+    type->add(THETA, theta);
+    type->add(PHI, phi);
+    type->add(PR, d.get_pr());
+    type->add(PTHETA, d.get_ptheta());
+    type->add(PPHI, d.get_pphi());
+    type->add(BETA, beta);
+    type->add(DE, dE);
+    type->theta.add(theta);
+    type->phi.add(phi);
+    type->beta.add(beta);
+    type->pr.add(d.get_pr());
+    type->dE.add(dE);
+    type->topDE.add(dE, n, t);
+  }
+
+  // Writes the summary as a single JSON object.
+  void writeJson(FILE* out) const {
+    static const double quantiles[] = { 0.01, 0.1, 0.5, 0.9, 0.99 };
+    fprintf(out, "{\"E0\":%.17g,\"events\":%ld,\"types\":{", _E0, _numEvents);
+    for (int i = 0; i < _order.size(); ++i) {
+      const Type& type = *_types.find(_order[i])->second;
+      fprintf(out, "%s\n", i ? "," : "");
+      writeString(out, _order[i]);
+      fprintf(out, ":{\"count\":%ld,\"first\":%.17g,\"last\":%.17g,"
+              "\"stats\":{", type.count, type.first, type.last);
+      bool first = true;
+      for (int q = 0; q < NUM_QUANTITIES; ++q) {
+        const Moments& m = type.moments[q];
+        if (m.n() == 0) continue;
+        fprintf(out, "%s\"%s\":{\"n\":%ld,\"mean\":%.17g,\"std\":%.17g,"
+                "\"min\":%.17g,\"max\":%.17g,\"quantiles\":{",
+                first ? "" : ",", quantityName(q), m.n(), m.mean(),
+                sqrt(m.variance()), m.min(), m.max());
+        for (int j = 0; j < 5; ++j) {
+          fprintf(out, "%s\"%g\":%.17g", j ? "," : "", quantiles[j],
+                  type.sketches[q].quantile(quantiles[j]));
+        }
+        fprintf(out, "}}");
+        first = false;
+      }
+      fprintf(out, "},\"histograms\":{\"theta\":");
+      type.theta.writeJson(out);
+      fprintf(out, ",\"phi\":");
+      type.phi.writeJson(out);
+      fprintf(out, ",\"beta\":");
+      type.beta.writeJson(out);
+      fprintf(out, ",\"pr\":");
+      type.pr.writeJson(out);
+      fprintf(out, ",\"dt\":");
+      type.dt.writeJson(out);
+      fprintf(out, ",\"dE\":");
+      type.dE.writeJson(out);
+      fprintf(out, "},\"topDE\":[");
+      const std::vector<TopK::Entry> top = type.topDE.entries();
+      for (int j = 0; j < top.size(); ++j) {
+        fprintf(out, "%s{\"n\":%d,\"t\":%.17g,\"dE\":%.17g}",
+                j ? "," : "", top[j].n, top[j].t, top[j].value);
+      }
+      fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+  }
+
+ private:
+  // disallow copies because destructor deletes the types
+  Summary(const Summary&);
+  void operator=(const Summary&);
+
+  struct Type {
+    Type(const double prMax, const int topK)
+        : count(0), first(0), last(0),
+          theta(-180, 180, 72), phi(-180, 180, 72), beta(-180, 180, 72),
+          pr(-prMax, prMax, 64), dt(-6, 6, 8), dE(-18, 0, 4), topDE(topK) {}
+
+    void add(const int q, const double x) {
+      moments[q].add(x);
+      sketches[q].add(x);
+    }
+
+    long count;
+    double first;
+    double last;
+    Moments moments[NUM_QUANTITIES];
+    QuantileSketch sketches[NUM_QUANTITIES];
+    Histogram theta;
+    Histogram phi;
+    Histogram beta;
+    Histogram pr;
+    LogHistogram dt;
+    LogHistogram dE;
+    TopK topDE;
+  };
+  typedef std::map<std::string, Type*> Types;
+
+  static void writeString(FILE* out, const std::string& s) {
+    fputc('"', out);
+    for (int i = 0; i < s.size(); ++i) {
+      if (s[i] == '"' || s[i] == '\\') fputc('\\', out);
+      fputc(s[i], out);
+    }
+    fputc('"', out);
+  }
+
+ private:
+  const double _E0;
+  const double _prMax;
+  const int _topK;
+  long _numEvents;
+  Types _types;
+  // Types in order of first occurrence
+  std::vector<std::string> _order;
+};
+
+#endif
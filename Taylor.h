@@ -0,0 +1,145 @@
+#ifndef __TAYLOR_H__
+#define __TAYLOR_H__
+
+#include <algorithm>
+#include <cmath>
+
+#include "./Options.h"
+
+// Taylor series integrator for equations 52-57.
+//
+// The right-hand side only needs u = 1/r and its powers, products, and
+// sin/cos of phi and phi-2theta, so the Taylor coefficients of the
+// solution follow from the usual automatic differentiation recurrences.
+// With x_k the k-th coefficient of x(t0 + tau) = sum x_k tau^k:
+//   u_k = -(sum_{j=1..k} r_j u_{k-j}) / r_0
+//   (ab)_k = sum_{j=0..k} a_j b_{k-j}
+//   sin(a)_k = (1/k) sum_{j=1..k} j a_j cos(a)_{k-j}
+//   cos(a)_k = -(1/k) sum_{j=1..k} j a_j sin(a)_{k-j}
+//   y_{k+1} = f(y)_k / (k+1)
+// Order and step size follow Jorba and Zou (2005): the order is
+// ceil(1 - ln(eps)/2) and the step is the smaller of
+// (eps/|y_j|)^(1/j) for the last two coefficients j = p-1, p.
+//
+// The series is a dense output for the whole step, so points inside a
+// step (e.g. when locating a collision) cost one polynomial evaluation.
+class TaylorSeries {
+ public:
+  // An enumerator, so std::min below does not need a definition of it
+  enum { MAX_ORDER = 40 };
+
+  TaylorSeries(const double eps, const Options::Dynamics dynamics)
+      : _eps(eps), _dynamics(dynamics) {
+    const int p = (int)ceil(1 - 0.5*log(eps));
+    _order = std::min<int>(MAX_ORDER, std::max(8, p));
+  }
+
+  int order() const { return _order; }
+
+  // Computes the series at y. Returns the step size that meets the
+  // tolerance.
+  double expand(const double y[6]) {
+    for (int i = 0; i < 6; ++i) {
+      _x[i][0] = y[i];
+    }
+    const double* r = _x[0];
+    const double* theta = _x[1];
+    const double* phi = _x[2];
+    const double* ptheta = _x[4];
+    const double* pphi = _x[5];
+    const bool bouncing = (_dynamics == Options::BOUNCING);
+
+    for (int k = 0; k < _order; ++k) {
+      // Auxiliary series at order k
+      if (k == 0) {
+        _u[0] = 1 / r[0];
+      } else {
+        double sum = 0;
+        for (int j = 1; j <= k; ++j) sum += r[j] * _u[k-j];
+        _u[k] = -sum / r[0];
+      }
+      _u2[k] = product(_u, _u, k);
+      _u3[k] = product(_u2, _u, k);
+      _u4[k] = product(_u2, _u2, k);
+      _psi[k] = phi[k] - 2*theta[k];
+      sinCos(phi, _s1, _c1, k);
+      sinCos(_psi, _s2, _c2, k);
+      _pt2[k] = product(ptheta, ptheta, k);
+      _a[k] = _c1[k] + 3*_c2[k];
+      _b[k] = _s1[k] + 3*_s2[k];
+
+      // Right-hand side at order k
+      double f[6];
+      f[0] = bouncing ? _x[3][k] : 0;
+      f[1] = product(ptheta, _u2, k);
+      f[2] = 10 * pphi[k];
+      f[3] = bouncing ?
+          product(_pt2, _u3, k) - 0.25 * product(_u4, _a, k) : 0;
+      f[4] = 0.5 * product(_u3, _s2, k);
+      f[5] = -(1.0/12) * product(_u3, _b, k);
+      for (int i = 0; i < 6; ++i) {
+        _x[i][k+1] = f[i] / (k+1);
+      }
+    }
+
+    double h = 1e100;
+    for (int j = _order-1; j <= _order; ++j) {
+      double norm = 0;
+      for (int i = 0; i < 6; ++i) {
+        norm = std::max(norm, fabs(_x[i][j]));
+      }
+      if (norm > 0) {
+        h = std::min(h, pow(_eps / norm, 1.0 / j));
+      }
+    }
+    return h;
+  }
+
+  // Evaluates the series at tau by Horner's rule.
+  void evaluate(const double tau, double y[6]) const {
+    for (int i = 0; i < 6; ++i) {
+      double v = _x[i][_order];
+      for (int k = _order-1; k >= 0; --k) {
+        v = v * tau + _x[i][k];
+      }
+      y[i] = v;
+    }
+  }
+
+ private:
+  static double product(const double* a, const double* b, const int k) {
+    double sum = 0;
+    for (int j = 0; j <= k; ++j) sum += a[j] * b[k-j];
+    return sum;
+  }
+
+  static void sinCos(const double* a, double* s, double* c, const int k) {
+    if (k == 0) {
+      s[0] = sin(a[0]);
+      c[0] = cos(a[0]);
+      return;
+    }
+    double ss = 0, cc = 0;
+    for (int j = 1; j <= k; ++j) {
+      ss += j * a[j] * c[k-j];
+      cc += j * a[j] * s[k-j];
+    }
+    s[k] = ss / k;
+    c[k] = -cc / k;
+  }
+
+ private:
+  const double _eps;
+  const Options::Dynamics _dynamics;
+  int _order;
+  // Coefficients of the state
+  double _x[6][MAX_ORDER+1];
+  // Coefficients of auxiliary series
+  double _u[MAX_ORDER+1], _u2[MAX_ORDER+1], _u3[MAX_ORDER+1];
+  double _u4[MAX_ORDER+1], _psi[MAX_ORDER+1], _pt2[MAX_ORDER+1];
+  double _s1[MAX_ORDER+1], _c1[MAX_ORDER+1];
+  double _s2[MAX_ORDER+1], _c2[MAX_ORDER+1];
+  double _a[MAX_ORDER+1], _b[MAX_ORDER+1];
+};
+
+#endif
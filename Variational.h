@@ -0,0 +1,127 @@
+#ifndef __VARIATIONAL_H__
+#define __VARIATIONAL_H__
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_odeiv2.h>
+
+#include "./Dipole.h"
+#include "./Options.h"
+#include "./Physics.h"
+
+// Variational equations along a trajectory, shared by PeriodicOrbit and
+// FtleMap. The state is followed by the 6x6 matrix of variations Phi
+// (row-major), 42 values in all:
+//   y' = f(y), Phi' = J(y) Phi
+// with the dynamics passed in params.
+inline int variationalFunc(double t, const double y[], double f[], void *params) {
+  (void)(t); /* avoid unused parameter warning */
+  const Options::Dynamics dynamics = *(const Options::Dynamics*)(params);
+  const Dipole& d = *(const Dipole*)(y);
+  Physics::get_derivatives(d, f, dynamics);
+  double J[36];
+  Physics::get_jacobian(d, J, dynamics);
+  const double* Phi = y + 6;
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 6; ++j) {
+      double sum = 0;
+      for (int k = 0; k < 6; ++k) {
+        sum += J[6*i+k] * Phi[6*k+j];
+      }
+      f[6+6*i+j] = sum;
+    }
+  }
+  return GSL_SUCCESS;
+}
+
+// B <- A B for 6x6 matrices
+inline void multiply6(const double A[36], double B[36]) {
+  double C[36];
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 6; ++j) {
+      double sum = 0;
+      for (int k = 0; k < 6; ++k) sum += A[6*i+k] * B[6*k+j];
+      C[6*i+j] = sum;
+    }
+  }
+  std::copy(C, C+36, B);
+}
+
+// Reflects y at a collision (r = 1, reflection R: pr -> -pr) and jumps
+// the variations by the saltation matrix
+//   S = R + (f+ - R f-) e_r^T / pr-
+// where f- and f+ are the velocities before and after reflection. fp is
+// set to f+. r is set to exactly 1, so that the next step cannot start
+// inside the sphere and find a crossing that is not there.
+inline void reflectVariations(double y[42], const Options::Dynamics dynamics,
+                              double fp[6]) {
+  y[0] = 1;
+  double fm[6];
+  Physics::get_derivatives(*(const Dipole*)(y), fm, dynamics);
+  const double prm = y[3];
+  y[3] = -y[3];
+  Physics::get_derivatives(*(const Dipole*)(y), fp, dynamics);
+  double S[36];
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 6; ++j) {
+      S[6*i+j] = (i == j) ? ((i == 3) ? -1 : 1) : 0;
+    }
+    const double rfm = (i == 3) ? -fm[i] : fm[i];
+    S[6*i+0] += (fp[i] - rfm) / prm;
+  }
+  multiply6(S, y+6);
+}
+
+// Locates the zero of value(y) inside the step of length hStep from y0 at
+// t0 by safeguarded Newton on the step length, with the slope
+// gradient(y, dg) . f. y is set to the state at the zero. Returns the
+// step length.
+template <typename Value, typename Gradient>
+double locateCrossing(gsl_odeiv2_system& sys, gsl_odeiv2_step* step,
+                      const double t0, const double y0[42],
+                      const double hStep, double y[42],
+                      const Options::Dynamics dynamics, Value value,
+                      Gradient gradient) {
+  double yerr[42];
+  auto advance = [&](const double tau, double* out) {
+    std::copy(y0, y0+42, out);
+    if (tau <= 0) return;
+    gsl_odeiv2_step_reset(step);
+    const int status =
+        gsl_odeiv2_step_apply(step, t0, tau, out, yerr, 0, 0, &sys);
+    if (status != GSL_SUCCESS) {
+      throw std::logic_error(gsl_strerror(status));
+    }
+  };
+
+  double a = 0, b = hStep;
+  double ga = value(y0), gb = value(y);
+  double tau = b * ga / (ga - gb);
+  for (int i = 0; i < 50; ++i) {
+    if (!(tau > a && tau < b)) tau = (a + b) / 2;
+    advance(tau, y);
+    const double g = value(y);
+    if (fabs(g) < 1e-14 || b - a < 1e-15 * (1 + hStep)) break;
+    if ((g < 0) == (ga < 0)) {
+      a = tau;
+      ga = g;
+    } else {
+      b = tau;
+      gb = g;
+    }
+    // Newton step with dg/dtau = dg . f
+    double f[6];
+    Physics::get_derivatives(*(const Dipole*)(y), f, dynamics);
+    double dg[6];
+    gradient(y, dg);
+    double slope = 0;
+    for (int j = 0; j < 6; ++j) slope += dg[j] * f[j];
+    tau = (slope != 0) ? tau - g / slope : (a + b) / 2;
+  }
+  return tau;
+}
+
+#endif
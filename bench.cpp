@@ -0,0 +1,255 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// magphyx-bench measures cost against accuracy of every integrator on a
+// fixed set of scenarios: the bouncing demo from the usage examples, a
+// low energy bouncing case with frequent collisions and the sliding
+// example. Each scenario is run to a fixed time with each adaptive
+// integrator over a range of tolerances and with each fixed step scheme
+// over a range of step sizes. Output is one row per run (CSV or JSON)
+// for plotting. Given a previous CSV output, runs that need noticeably
+// more right-hand side evaluations or lose accuracy are reported and the
+// exit status is nonzero, so the benchmark can guard against regressions.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_odeiv2.h>
+
+#include "./Benchmark.h"
+#include "./Options.h"
+#include "./Physics.h"
+
+using namespace std;
+
+// Global Options object. Declared in Options.h.
+Options o(1e5, 1e-2, 1e-10, Options::BOUNCING);
+
+void printUsage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "\t./magphyx-bench [options]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "DESCRIPTION\n");
+  fprintf(stderr,
+          "\tRuns the benchmark scenarios with rk8pd, rkf45 and taylor at\n"
+          "\teps = 1e-4 ... 1e-14 and with every --scheme of magphyxc at\n"
+          "\tfixed step sizes h = 1e-1 ... 1e-3 (gsl meaning rk8pd),\n"
+          "\tand outputs per run the steps, RHS evaluations, wall time,\n"
+          "\tfinal dE and the error against an rk8pd reference at\n"
+          "\teps = 1e-14. The reference error column is the difference\n"
+          "\tof the reference from a taylor run at eps = 1e-16; smaller\n"
+          "\terrors are not resolved. Fixed step runs of scenarios with\n"
+          "\tcollisions are reported as not ok.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "\t-o outFilename\n");
+  fprintf(stderr, "\t\tFilename to output to. Default = output to stdout.\n");
+  fprintf(stderr, "\t--format (csv | json)\n");
+  fprintf(stderr, "\t\tOutput format. Default = csv.\n");
+  fprintf(stderr, "\t--scenario name\n");
+  fprintf(stderr, "\t\tRun only the given scenario (demo7, collisions or\n"
+          "\t\tsliding). May be given more than once.\n");
+  fprintf(stderr, "\t-T T\n");
+  fprintf(stderr, "\t\tLength of every run. Default = 100.\n");
+  fprintf(stderr, "\t--minTime seconds\n");
+  fprintf(stderr, "\t\tRepeat each run for at least this long to time it.\n"
+          "\t\tDefault = 0.2.\n");
+  fprintf(stderr, "\t--compare baseline.csv\n");
+  fprintf(stderr, "\t\tCompare against an earlier CSV output. Runs with more\n"
+          "\t\tthan 1.2 times the RHS evaluations or more than 10 times\n"
+          "\t\tthe error (above 1e-13 and the reference error) of the\n"
+          "\t\tbaseline are listed on stderr and the exit status is 2.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "EXAMPLES\n");
+  fprintf(stderr, "\t./magphyx-bench -o baseline.csv\n");
+  fprintf(stderr, "\t./magphyx-bench --compare baseline.csv -o new.csv\n");
+  fprintf(stderr, "\n");
+}
+
+Scenario makeScenario(const string& name, const Options::Dynamics dynamics,
+                      const double r, const double theta, const double phi,
+                      const double pr, const double ptheta, const double pphi,
+                      const double T) {
+  Scenario s;
+  s.name = name;
+  s.d = Dipole(r, Physics::deg2rad(theta), Physics::deg2rad(phi),
+               pr, ptheta, pphi);
+  s.dynamics = dynamics;
+  s.T = T;
+  return s;
+}
+
+// Lists the runs that regressed against the baseline. Returns the number
+// of regressions.
+int compare(const vector<BenchmarkRun>& runs,
+            const vector<BenchmarkRun>& baseline) {
+  map<string, BenchmarkRun> old;
+  for (int i = 0; i < baseline.size(); ++i) {
+    old[baseline[i].key()] = baseline[i];
+  }
+  int numRegressions = 0;
+  for (int i = 0; i < runs.size(); ++i) {
+    const BenchmarkRun& r = runs[i];
+    map<string, BenchmarkRun>::const_iterator it = old.find(r.key());
+    if (it == old.end()) continue;
+    const BenchmarkRun& b = it->second;
+    string reason;
+    if (b.ok && !r.ok) {
+      reason = "failed";
+    } else if (b.ok && r.ok) {
+      if (r.numEvaluations > 1.2 * b.numEvaluations) {
+        reason = "evaluations " + to_string(b.numEvaluations) + " -> " +
+            to_string(r.numEvaluations);
+      } else if (r.error > 10 * b.error &&
+                 r.error > max(1e-13, r.referenceError)) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "error %.2e -> %.2e", b.error, r.error);
+        reason = buf;
+      }
+    }
+    if (!reason.empty()) {
+      fprintf(stderr, "regression: %s: %s\n", r.key().c_str(), reason.c_str());
+      ++numRegressions;
+    }
+  }
+  return numRegressions;
+}
+
+int main(int argc, char** argv) {
+  string outFilename, baselineFilename;
+  vector<string> names;
+  bool json = false;
+  double T = 100;
+  double minSeconds = 0.2;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const bool hasValue = (i+1 < argc);
+      if (strcmp(argv[i], "-o") == 0 && hasValue) {
+        outFilename = argv[++i];
+      } else if (strcmp(argv[i], "--format") == 0 && hasValue) {
+        const string format = argv[++i];
+        if (format != "csv" && format != "json") {
+          throw logic_error("illegal format " + format);
+        }
+        json = (format == "json");
+      } else if (strcmp(argv[i], "--scenario") == 0 && hasValue) {
+        names.push_back(argv[++i]);
+      } else if (strcmp(argv[i], "-T") == 0 && hasValue) {
+        T = atof(argv[++i]);
+      } else if (strcmp(argv[i], "--minTime") == 0 && hasValue) {
+        minSeconds = atof(argv[++i]);
+      } else if (strcmp(argv[i], "--compare") == 0 && hasValue) {
+        baselineFilename = argv[++i];
+      } else {
+        throw logic_error(string("unexpected argument ") + argv[i]);
+      }
+    }
+    if (T <= 0) {
+      throw logic_error("T must be positive");
+    }
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-bench: %s\n", e.what());
+    printUsage();
+    return 1;
+  }
+
+  vector<Scenario> all;
+  all.push_back(makeScenario("demo7", Options::BOUNCING,
+                             1.5, 0, 90, 0, 0, 0, T));
+  all.push_back(makeScenario("collisions", Options::BOUNCING,
+                             1.05, 0, 30, 0, 0, 0, T));
+  all.push_back(makeScenario("sliding", Options::SLIDING,
+                             1, 3, -18.78982612, 0, 0, 0, T));
+  vector<Scenario> scenarios;
+  for (int i = 0; i < all.size(); ++i) {
+    if (names.empty() ||
+        find(names.begin(), names.end(), all[i].name) != names.end()) {
+      scenarios.push_back(all[i]);
+    }
+  }
+  if (scenarios.empty()) {
+    fprintf(stderr, "magphyx-bench: no such scenario\n");
+    return 1;
+  }
+
+  vector<BenchmarkRun> baseline;
+  try {
+    if (!baselineFilename.empty()) {
+      baseline = WorkPrecision::readCsv(baselineFilename);
+    }
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-bench: %s\n", e.what());
+    return 1;
+  }
+
+  FILE* out = outFilename.empty() ? stdout : fopen(outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "magphyx-bench: unable to open %s\n", outFilename.c_str());
+    return 1;
+  }
+  if (!json) {
+    WorkPrecision::writeCsvHeader(out);
+  }
+
+  const WorkPrecision wp(minSeconds);
+  const Options::Integrator integrators[] = {
+    Options::RK8PD, Options::RKF45, Options::TAYLOR };
+  const double fixedSteps[] = { 1e-1, 3e-2, 1e-2, 3e-3, 1e-3 };
+  vector<BenchmarkRun> runs;
+  for (int i = 0; i < scenarios.size(); ++i) {
+    const Scenario& s = scenarios[i];
+    const WorkPrecision::Reference ref = WorkPrecision::reference(s);
+    vector<BenchmarkRun> sruns;
+    for (int j = 0; j < 3; ++j) {
+      for (int e = 4; e <= 14; e += 2) {
+        sruns.push_back(wp.run(s, ref, integrators[j], pow(10.0, -e),
+                               o.h, false));
+      }
+    }
+    // Fixed steps with every scheme; the symplectic ones need sliding
+    for (int k = Options::GSL; k <= Options::SYMPLECTIC8; ++k) {
+      const Options::FixedScheme scheme = (Options::FixedScheme)k;
+      if (scheme > Options::RK4 && s.dynamics != Options::SLIDING) continue;
+      for (int j = 0; j < 5; ++j) {
+        sruns.push_back(wp.run(s, ref, Options::RK8PD, o.eps, fixedSteps[j],
+                               true, scheme));
+      }
+    }
+    for (int j = 0; j < sruns.size(); ++j) {
+      if (!json) {
+        WorkPrecision::writeCsv(out, sruns[j]);
+      }
+    }
+    fflush(out);
+    runs.insert(runs.end(), sruns.begin(), sruns.end());
+  }
+  if (json) {
+    WorkPrecision::writeJson(out, runs);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  if (!baseline.empty() && compare(runs, baseline) > 0) {
+    return 2;
+  }
+  return 0;
+}
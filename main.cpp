@@ -1,17 +1,43 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <thread>
 
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_odeiv2.h>
 
+#include "./Checkpoint.h"
 #include "./Dipole.h"
+#include "./DriftControl.h"
 #include "./Physics.h"
 #include "./Event.h"
+#include "./EventRing.h"
+#include "./EventStream.h"
+#include "./Layout.h"
 #include "./Options.h"
 #include "./Stepper.h"
+#include "./DenseOutput.h"
+#include "./Ensemble.h"
+#include "./LiveMetrics.h"
+#include "./Microcanonical.h"
+#include "./ResultFile.h"
+#include "./Recurrence.h"
+#include "./ResultCache.h"
+#include "./Parareal.h"
+#include "./Summary.h"
+#include "./Benchmark.h"
+#include "./PeriodicOrbit.h"
+#include "./Ftle.h"
 
 using namespace std;
 
@@ -23,7 +49,26 @@ const double default_eps = 1e-10;
 // Global Options object. Declared in Options.h.
 Options o(default_n, default_h, default_eps, default_dynamics);
 
-Dipole doSimulation(const Dipole& freeDipole, Event& event);
+RunResult doSimulation(const Dipole& freeDipole, Event& event,
+                       const int numEvents, const Options::Dynamics dynamics,
+                       const bool verbose, LiveMetrics::Slot& metrics,
+                       const RunResult* resume = 0,
+                       const double eps = o.eps,
+                       const Options::Integrator integrator = o.integrator,
+                       CheckpointWriter* checkpoints = 0);
+void doParareal(const Dipole& freeDipole, Event& event);
+void doDriftControl(const Dipole& freeDipole, Event& event);
+int doWorkPrecision();
+int doPeriodicOrbit();
+int doFtle();
+int doStream(const Dipole& freeDipole);
+int doEnsemble();
+int doCachedSimulation(const Dipole& freeDipole);
+RunResult runSingle(const Dipole& freeDipole, Event& event,
+                    const RunResult* resume = 0,
+                    CheckpointWriter* checkpoints = 0);
+int doReplay(const Dipole& freeDipole);
+int writeSummary(const Summary& summary);
 
 void printUsage() {
   fprintf(stderr, "\n");
@@ -56,6 +101,17 @@ void printUsage() {
   fprintf(stderr, "\t\tFilename to output to. Default = output to stdout.\n");
   fprintf(stderr, "\t-d (bouncing | sliding)\n");
   fprintf(stderr, "\t\tDynamics type. Default = bouncing.\n");
+  fprintf(stderr, "\t--layout filename\n");
+  fprintf(stderr, "\t\tFixed magnets to move among, one \"x y alpha\" line per\n"
+          "\t\tmagnet with the center in diameters and the moment angle\n"
+          "\t\tin degrees. There must be one at the origin, which r and\n"
+          "\t\ttheta are measured from. Collisions are with any of them.\n"
+          "\t\tLayouts of more than 32 magnets have their far field\n"
+          "\t\ttabulated when read, so that a step costs about the same\n"
+          "\t\tfor any number of magnets. Not valid with -d sliding,\n"
+          "\t\t--integrator taylor, --shell, --recurrence, --periodic,\n"
+          "\t\t--ftle, --workPrecision or --summary. Default = one\n"
+          "\t\tmagnet at 0 0 0.\n");
   fprintf(stderr, "\t--numEvents n\n");
   fprintf(stderr, 
           "\t\tExecutes the simulation until n events occur. Actual number of\n"
@@ -75,10 +131,249 @@ void printUsage() {
   fprintf(stderr, "\t-c\n");
   fprintf(stderr, "\t\tUse a fixed step size. Default is to use an adaptive\n"
           "\t\tstep size.\n");
+  fprintf(stderr, "\t--scheme (gsl | rk4 | sym2 | sym4 | sym6 | sym8)\n");
+  fprintf(stderr, "\t\tFixed step scheme for -c. gsl takes fixed steps with\n"
+          "\t\tthe --integrator method and checks its error estimate.\n"
+          "\t\trk4 is classical Runge-Kutta. symN is a symplectic\n"
+          "\t\tscheme of order N (Stormer-Verlet and its compositions),\n"
+          "\t\twhich keeps the energy error bounded; sliding only.\n"
+          "\t\tThe other schemes have no error estimate and keep no\n"
+          "\t\tbackup of the state. Default = gsl.\n");
   fprintf(stderr, "\t-s (theta | phi | all)\n");
   fprintf(stderr, "\t\tSingle step output. Output the given state variable\n"
           "\t\t(or all state variables) at every step. Default is to output\n"
           "\t\tonly on events.\n");
+  fprintf(stderr, "\t--sampleDt dt\n");
+  fprintf(stderr, "\t\tWith -s, output the state variable at the uniform times\n"
+          "\t\t0, dt, 2dt, ... interpolated from the adaptive steps\n"
+          "\t\tinstead of at every step. With --logOfNumSteps n, 2^n\n"
+          "\t\tsamples are output. Use instead of -c for --fft.\n");
+  fprintf(stderr, "\t--pyramid dir\n");
+  fprintf(stderr, "\t\tWith -s, also write a level-of-detail pyramid of the run\n"
+          "\t\tto the directory dir as it goes: the min, max and mean of\n"
+          "\t\tr, theta, phi, pr, ptheta, pphi and E over buckets of 2^k\n"
+          "\t\tsamples, for every level k. Plots of any time window then\n"
+          "\t\tread about one bucket per pixel; see magphyx-query\n"
+          "\t\t--zoom. Memory use does not grow with the run. Combine\n"
+          "\t\twith --noEvents to write only the pyramid. See Pyramid.h\n"
+          "\t\tfor the format.\n");
+  fprintf(stderr, "\t--pyramidMinLevel k\n");
+  fprintf(stderr, "\t\tLowest --pyramid level written, i.e. the finest buckets\n"
+          "\t\thold 2^k samples. Default = 6.\n");
+  fprintf(stderr, "\t--project k\n");
+  fprintf(stderr, "\t\tEvery k accepted steps and after each reflection,\n"
+          "\t\tmove the state back onto the initial energy surface with\n"
+          "\t\ta minimum-norm correction along the energy gradient. The\n"
+          "\t\tsize of the corrections is reported at the end of the run.\n"
+          "\t\tDefault = 0 (no projection).\n");
+  fprintf(stderr, "\t--integrator (rk8pd | rkf45 | taylor)\n");
+  fprintf(stderr, "\t\tIntegration method. taylor is a Taylor series method\n"
+          "\t\twhose order (about 13 at the default eps, 19 at 1e-16)\n"
+          "\t\tand step size are chosen from eps. Default = rk8pd.\n");
+  fprintf(stderr, "\t--workPrecision T\n");
+  fprintf(stderr, "\t\tInstead of simulating, run the initial condition to\n"
+          "\t\ttime T with each integrator at eps = 1e-6 ... 1e-14 and\n"
+          "\t\toutput steps, RHS evaluations, wall time, final dE and\n"
+          "\t\terror against an rk8pd reference at eps = 1e-14 as CSV,\n"
+          "\t\twith the reference's own error (its difference from a\n"
+          "\t\ttaylor run at eps = 1e-16). See also magphyx-bench.\n");
+  fprintf(stderr, "\t--summary filename\n");
+  fprintf(stderr, "\t\tWrite a JSON summary of the events of a single run:\n"
+          "\t\tper event type the count, moments, quantiles (1%% relative\n"
+          "\t\taccuracy) and histograms of the state, dE and the time\n"
+          "\t\tsince the previous event of the type, and the events with\n"
+          "\t\tthe largest dE.\n");
+  fprintf(stderr, "\t--noEvents\n");
+  fprintf(stderr, "\t\tDo not output events. Use with --summary.\n");
+  fprintf(stderr, "\t--events list\n");
+  fprintf(stderr, "\t\tComma-separated event surfaces to log, each of the form\n"
+          "\t\tlhs=rhs[:any|pos|neg], where lhs and rhs are arithmetic\n"
+          "\t\texpressions in r, theta, phi (degrees), pr, ptheta, pphi\n"
+          "\t\tand E. beta=0 and collision are also accepted. pos/neg\n"
+          "\t\trestrict to crossings in one direction. Default =\n"
+          "\t\ttheta=0,phi=0,beta=0,pr=0:neg,ptheta=0,pphi=0,collision.\n");
+  fprintf(stderr, "\t--checkpoints filename\n");
+  fprintf(stderr, "\t\tWrite a checkpoint of the run every --checkpointEvery\n"
+          "\t\tevents to filename, for --replay. Event output only.\n");
+  fprintf(stderr, "\t--checkpointEvery n\n");
+  fprintf(stderr, "\t\tEvents between --checkpoints. Default = 1000.\n");
+  fprintf(stderr, "\t--replay filename a:b\n");
+  fprintf(stderr, "\t\tReplay events a to b of a run from its --checkpoints\n"
+          "\t\tfile, integrating only from the last checkpoint before\n"
+          "\t\tevent a. The trajectory is the run's, so -i, -d, -h, -c,\n"
+          "\t\t-e, --integrator and --events must be as in the run.\n"
+          "\t\tOutputs the events, or with -s the states of every step\n"
+          "\t\tfrom event a to event b, or with --sampleDt uniform\n"
+          "\t\tsamples over them. Stops where the run ended (or at its\n"
+          "\t\t--numEvents or --logOfNumSteps if it was interrupted) and\n"
+          "\t\treports the events past it.\n");
+  fprintf(stderr, "\t--take n\n");
+  fprintf(stderr, "\t\tOutput only the first n events at or after --after of\n"
+          "\t\tthe --only types, numbered from 1, and stop the run as\n"
+          "\t\tsoon as they are found. With --logOfNumSteps, also stop\n"
+          "\t\tafter that many steps.\n");
+  fprintf(stderr, "\t--after t\n");
+  fprintf(stderr, "\t\tWith --take, skip the events before time t. Default = 0.\n");
+  fprintf(stderr, "\t--only type\n");
+  fprintf(stderr, "\t\tWith --take, only count and output events of this type,\n"
+          "\t\tas written in the event_type column, e.g. collision or\n"
+          "\t\t\"phi = 0\". May be repeated. Default = all types.\n");
+  fprintf(stderr, "\t--ensemble filename\n");
+  fprintf(stderr, "\t\tRun every initial condition in filename instead of -i\n"
+          "\t\tor -f. Each line is \"r theta phi pr ptheta pphi\n"
+          "\t\t[numEvents [bouncing|sliding]]\" in the same units as -i,\n"
+          "\t\tseparated by spaces or commas. Binary files written by\n"
+          "\t\t--writeBinaryEnsemble are also accepted and are memory\n"
+          "\t\tmapped. One row with the final state of each run is output.\n");
+  fprintf(stderr, "\t--shell E n\n");
+  fprintf(stderr, "\t\tInstead of --ensemble, run n initial conditions drawn\n"
+          "\t\tuniformly from the energy shell E (the microcanonical\n"
+          "\t\tensemble) with the -d dynamics. Positions are sampled\n"
+          "\t\tby rejection and the momentum magnitude is solved from\n"
+          "\t\tthe energy, so every record has energy E. Record k is the\n"
+          "\t\tsame for any n, --shard and --threads. Combine with\n"
+          "\t\t--writeBinaryEnsemble to save the initial conditions.\n");
+  fprintf(stderr, "\t--seed s\n");
+  fprintf(stderr, "\t\tSeed of --shell. Default = 1.\n");
+  fprintf(stderr, "\t--collisionSurface\n");
+  fprintf(stderr, "\t\tWith --shell, sample the collision surface r = 1, pr > 0\n"
+          "\t\twith its invariant measure instead of the whole shell.\n"
+          "\t\tBouncing only.\n");
+  fprintf(stderr, "\t--rMax r\n");
+  fprintf(stderr, "\t\tWith --shell, sample only r <= rMax. Needed for E >= 0,\n"
+          "\t\twhere the shell is unbounded. Default = the largest r on\n"
+          "\t\tthe shell.\n");
+  fprintf(stderr, "\t--threads n\n");
+  fprintf(stderr, "\t\tWith --ensemble, run n simulations at a time. With\n"
+          "\t\t--parareal, the number of time slices per window.\n"
+          "\t\tDefault = 1.\n");
+  fprintf(stderr, "\t--writeBinaryEnsemble filename\n");
+  fprintf(stderr, "\t\tConvert the --ensemble file (or --shell sample) to the\n"
+          "\t\tbinary format and exit.\n");
+  fprintf(stderr, "\t--shard k/N\n");
+  fprintf(stderr, "\t\tWith --ensemble, run only shard k (0 <= k < N). Runs are\n"
+          "\t\tassigned to shards deterministically and balanced by\n"
+          "\t\ttheir event budgets. Combine shard outputs with\n"
+          "\t\tmagphyx-merge. Default = 0/1.\n");
+  fprintf(stderr, "\t--screen eps n\n");
+  fprintf(stderr, "\t\tWith --ensemble and --recurrence, first run every record\n"
+          "\t\twith rkf45 at tolerance eps for n events, then rerun with\n"
+          "\t\tthe full settings only the records whose screening run\n"
+          "\t\tis unresolved, lost more than 100 eps of energy, or\n"
+          "\t\tdiffers in fate or period from a neighbor, plus an audit\n"
+          "\t\tsample. Neighbors are the records before and after it in\n"
+          "\t\tthe file unless --screenGrid is given. Other rows hold the\n"
+          "\t\tscreening result. Reruns and the agreement of the two tiers\n"
+          "\t\tare printed. Default = off.\n");
+  fprintf(stderr, "\t--screenGrid W\n");
+  fprintf(stderr, "\t\tThe --screen ensemble is a grid stored row by row with\n"
+          "\t\tW records per row, and the neighbors of a record are the\n"
+          "\t\tup to four records beside it on the grid. Without it, a\n"
+          "\t\tboundary that runs along the rows of a grid is missed.\n"
+          "\t\tNeighbors in another --shard are not compared.\n"
+          "\t\tDefault = 0 (file order).\n");
+  fprintf(stderr, "\t--screenAudit fraction\n");
+  fprintf(stderr, "\t\tFraction of accepted --screen records rerun anyway to\n"
+          "\t\tmeasure how often screening is wrong, drawn with --seed.\n"
+          "\t\tDefault = 0.01.\n");
+  fprintf(stderr, "\t--screenReport filename\n");
+  fprintf(stderr, "\t\tWrite each --screen record's screening fate, rerun\n"
+          "\t\treason and final fate as CSV to filename.\n");
+  fprintf(stderr, "\t--cache dir\n");
+  fprintf(stderr, "\t\tKeep finished runs in dir, keyed by a hash of the initial\n"
+          "\t\tcondition and every option that affects the run except\n"
+          "\t\t--numEvents and --logOfNumSteps. A run already in the\n"
+          "\t\tcache is copied out instead of computed, for single runs\n"
+          "\t\tand each --ensemble record. A longer run continues the\n"
+          "\t\tlongest shorter cached one from its final state, unless\n"
+          "\t\t--summary, --project, --recurrence, -s or --sampleDt is\n"
+          "\t\tgiven. Default = off.\n");
+  fprintf(stderr, "\t--metrics name\n");
+  fprintf(stderr, "\t\tPublish live counters (steps, events, t, h, dE, and the\n"
+          "\t\trecord of each --threads worker) in the shared memory\n"
+          "\t\tsegment /magphyx-name while running, for magphyx-top.\n"
+          "\t\tThe simulation never waits for readers. Default = off.\n");
+  fprintf(stderr, "\t--ring name\n");
+  fprintf(stderr, "\t\tAlso publish the events (and -s states) of a single run\n"
+          "\t\tas raw records in the shared memory ring\n"
+          "\t\t/magphyxring-name, for local readers such as\n"
+          "\t\tmagphyx-ring. See EventRing.h for the layout. Default = off.\n");
+  fprintf(stderr, "\t--ringSize n\n");
+  fprintf(stderr, "\t\tRecords the --ring holds, rounded up to a power of two.\n"
+          "\t\tDefault = 65536.\n");
+  fprintf(stderr, "\t--ringBlock\n");
+  fprintf(stderr, "\t\tMake the run wait for registered --ring readers that\n"
+          "\t\tfall a full ring behind, instead of overwriting records\n"
+          "\t\tthey have not read.\n");
+  fprintf(stderr, "\t--recurrence q\n");
+  fprintf(stderr, "\t\tStop early once the run's fate is known. States on the\n"
+          "\t\tPoincare section are quantized to cells of size q; the run\n"
+          "\t\tis periodic once a cycle of section states repeats three\n"
+          "\t\ttimes, and has escaped once the dipole can no longer\n"
+          "\t\treturn. The fate is printed, or output per run with\n"
+          "\t\t--ensemble. Default = 0 (off).\n");
+  fprintf(stderr, "\t--maxPeriod k\n");
+  fprintf(stderr, "\t\tLongest cycle detected, in section crossings.\n"
+          "\t\tDefault = 64.\n");
+  fprintf(stderr, "\t--section surface\n");
+  fprintf(stderr, "\t\tPoincare section for --recurrence and --periodic, in the\n"
+          "\t\tform used by --events, e.g. theta=0:pos.\n"
+          "\t\tDefault = collision.\n");
+  fprintf(stderr, "\t--periodic k\n");
+  fprintf(stderr, "\t\tInstead of simulating, find the periodic orbit that\n"
+          "\t\treturns to the --section after k crossings, starting from\n"
+          "\t\tthe first crossing after the initial condition. Uses\n"
+          "\t\tNewton's method on the return map with the variational\n"
+          "\t\tequations. Outputs as CSV the orbit's section point,\n"
+          "\t\tperiod and Floquet multipliers.\n");
+  fprintf(stderr, "\t--orbitTol tol\n");
+  fprintf(stderr, "\t\tNewton tolerance of --periodic on the return map\n"
+          "\t\tresidual. Should be well above eps. Default = 1e-8.\n");
+  fprintf(stderr, "\t--continuation dE n\n");
+  fprintf(stderr, "\t\tWith --periodic, follow the orbit for n steps of dE in\n"
+          "\t\tenergy, stopping if Newton fails. Default = 0 0.\n");
+  fprintf(stderr, "\t--ftle x xMin xMax nx y yMin yMax ny\n");
+  fprintf(stderr, "\t\tInstead of simulating, map the finite-time Lyapunov\n"
+          "\t\texponent over an nx by ny grid of initial conditions that\n"
+          "\t\tvary the state variables x and y (r, theta, phi, pr,\n"
+          "\t\tptheta or pphi; angles in degrees) of the -i initial\n"
+          "\t\tcondition. Each point is integrated once with the\n"
+          "\t\tvariational equations, and its FTLE is taken at each of\n"
+          "\t\tthe --horizons. The map is written to the -o file as one\n"
+          "\t\tfloat32 image per horizon (see Ftle.h for the format).\n"
+          "\t\tPoints are shared among --threads.\n");
+  fprintf(stderr, "\t--horizons T1,T2,...\n");
+  fprintf(stderr, "\t\tIncreasing integration times at which --ftle is taken.\n");
+  fprintf(stderr, "\t--parareal T\n");
+  fprintf(stderr, "\t\tIntegrate a single run in parallel in time. The run is\n"
+          "\t\tcut into windows of --threads slices of length T, which\n"
+          "\t\tare iterated with a cheap rkf45 propagator and the\n"
+          "\t\taccurate rk8pd one until converged. Iterations and\n"
+          "\t\tspeedup are printed per window. T must be short compared\n"
+          "\t\tto the time over which trajectories diverge. Event output\n"
+          "\t\tonly, and adaptive steps only: fixed -c steps would not end\n"
+          "\t\ton the slice boundaries. Default = 0 (off).\n");
+  fprintf(stderr, "\t--pararealTol tol\n");
+  fprintf(stderr, "\t\tA window is converged when no slice start state changes\n"
+          "\t\tby more than tol. Default = 1e-8.\n");
+  fprintf(stderr, "\t--coarseEps eps\n");
+  fprintf(stderr, "\t\tError tolerance of the parareal coarse propagator.\n"
+          "\t\tDefault = 1e-6.\n");
+  fprintf(stderr, "\t--maxDrift dE\n");
+  fprintf(stderr, "\t\tKeep the energy drift |E - E0| of a single run under dE.\n"
+          "\t\tThe run is cut into segments (see --driftSegment); a\n"
+          "\t\tsegment that ends over budget is rolled back and rerun at\n"
+          "\t\ta tenth of the tolerance, and the tolerance is relaxed\n"
+          "\t\tback toward -e on the following segments. The tolerance\n"
+          "\t\tof each segment is written to --driftLog. Event output\n"
+          "\t\tonly. Default = 0 (off).\n");
+  fprintf(stderr, "\t--driftSegment T\n");
+  fprintf(stderr, "\t\tLength of the --maxDrift segments, i.e. how far a\n"
+          "\t\trollback goes back. Default = 10.\n");
+  fprintf(stderr, "\t--driftLog filename\n");
+  fprintf(stderr, "\t\tCSV of the --maxDrift segments: times, tolerance,\n"
+          "\t\trollbacks, steps and dE at the end. Default =\n"
+          "\t\t<outFilename>.drift.csv, or none when output is to stdout.\n");
   fprintf(stderr, "\t--fft\n");
   fprintf(stderr, "\t\tRun the state variable output through an fft before\n"
           "\t\toutputting. Only valid together with the -s flag.\n");
@@ -90,9 +385,19 @@ void printUsage() {
   fprintf(stderr, "\t\tDemo 7 from MagPhyx web version\n");
   fprintf(stderr, "\t./magphyxc --numEvents 1e5 -d bouncing -f init.csv -o events.csv\n");
   fprintf(stderr, "\t\tLoads initial conditions from file\n");
+  fprintf(stderr, "\t./magphyxc -i 1.5 0 90 0 0 0 --events \"r=1.2:pos, phi-theta=0:neg, collision\" -o events.csv\n");
+  fprintf(stderr, "\t\tLogs only outward crossings of r=1.2, downward\n"
+          "\t\tcrossings of phi=theta and collisions\n");
   fprintf(stderr, "\t./magphyxc -d sliding --logOfNumSteps 10 -s theta -i 1 3 -18.78982612 0 0 0 -c -h 1e-2 --fft -o theta.dat\n");
   fprintf(stderr, "\t\tRuns 1024 steps of sliding case and outputs the fft\n"
           "\t\tof the theta values.\n");
+  fprintf(stderr, "\tfor k in 0 1 2 3; do ./magphyxc --ensemble ics.txt --shard $k/4 -o shard$k.csv & done; wait\n");
+  fprintf(stderr, "\t./magphyx-merge -o results.csv shard0.csv shard1.csv shard2.csv shard3.csv\n");
+  fprintf(stderr, "\t\tRuns an ensemble as four local processes and merges\n"
+          "\t\tthe results\n");
+  fprintf(stderr, "\t./magphyxc -d sliding --logOfNumSteps 10 -s theta -i 1 3 -18.78982612 0 0 0 --sampleDt 1e-2 --fft -o theta.dat\n");
+  fprintf(stderr, "\t\tSame as above, but with adaptive steps resampled at\n"
+          "\t\tuniform times.\n");
   fprintf(stderr, "\n");
 }
 
@@ -105,14 +410,506 @@ int main(int argc, char** argv) {
       stop = false;
     }
   }
+  if (o.fixedScheme != Options::GSL && !o.fixed_h) {
+    fprintf(stderr, "--scheme is only valid together with the -c flag\n");
+    return 1;
+  }
+
+  // The layout is read before any run, and -i, which was parsed without
+  // it, takes its energy from the layout
+  unique_ptr<MagnetLayout> layout;
+  if (!o.layoutFilename.empty()) {
+    // These assume the single magnet at the origin in closed form. The
+    // --summary pr histogram is bounded by its minimum energy at contact.
+    if (o.dynamics == Options::SLIDING ||
+        o.integrator == Options::TAYLOR || o.shellSize > 0 ||
+        o.recurrenceTol > 0 || o.periodicReturns > 0 ||
+        o.ftleAxes[0].n > 0 || o.workPrecisionT > 0 ||
+        !o.summaryFilename.empty()) {
+      fprintf(stderr, "--layout cannot be combined with -d sliding, "
+              "--integrator taylor, --shell, --recurrence, --periodic, "
+              "--ftle, --workPrecision or --summary\n");
+      return 1;
+    }
+    try {
+      layout.reset(new MagnetLayout(o.layoutFilename));
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+    MagnetLayout::setActive(layout.get());
+    o.dipole.set_E0(o.dipole.get_E());
+    if (o.initialized && Physics::separation(o.dipole) < 1) {
+      fprintf(stderr, "The initial position overlaps a fixed magnet\n");
+      return 1;
+    }
+  }
+
+  if (!o.ensembleFilename.empty() || o.shellSize > 0) {
+    try {
+      return doEnsemble();
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
   if (!o.initialized) {
     printUsage();
     return 1;
   }
+  if (o.sampleDt > 0 && o.singleStep == Options::NONE) {
+    fprintf(stderr, "--sampleDt is only valid together with the -s flag\n");
+    return 1;
+  }
+
+  if (o.workPrecisionT > 0) {
+    return doWorkPrecision();
+  }
+
+  if (o.periodicReturns > 0) {
+    try {
+      return doPeriodicOrbit();
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+
+  if (o.ftleAxes[0].n > 0) {
+    try {
+      return doFtle();
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+
+  if (o.noEvents && o.singleStep != Options::NONE && o.pyramidDir.empty()) {
+    fprintf(stderr, "--noEvents cannot be combined with -s unless writing "
+            "a --pyramid\n");
+    return 1;
+  }
+  if (!o.pyramidDir.empty() && o.singleStep == Options::NONE) {
+    fprintf(stderr, "--pyramid is only valid together with the -s flag\n");
+    return 1;
+  }
+
+  if (o.fixedScheme > Options::RK4 && o.dynamics != Options::SLIDING) {
+    fprintf(stderr, "--scheme %s is only valid with -d sliding\n",
+            FixedStep::name(o.fixedScheme));
+    return 1;
+  }
 
   Dipole freeDipole = o.dipole;
-  Event event(o.outFilename, freeDipole, o.singleStep);
-  doSimulation(freeDipole, event);
+  if (!o.replayFilename.empty()) {
+    if (!o.checkpointFilename.empty() || o.interactive || o.take > 0 ||
+        o.pararealSlice > 0 || o.maxDrift > 0 || o.projectEvery > 0 ||
+        o.recurrenceTol > 0 || !o.pyramidDir.empty()) {
+      fprintf(stderr, "--replay cannot be combined with --checkpoints, -I,"
+              " --take, --parareal, --maxDrift, --project, --recurrence or"
+              " --pyramid\n");
+      return 1;
+    }
+    try {
+      return doReplay(freeDipole);
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  if (!o.checkpointFilename.empty() &&
+      (!Checkpoints::checkpointable() || o.take > 0 ||
+       o.pararealSlice > 0 || o.maxDrift > 0)) {
+    fprintf(stderr, "--checkpoints cannot be combined with -s, --sampleDt,"
+            " --project, --take, --parareal or --maxDrift\n");
+    return 1;
+  }
+  if (o.take > 0) {
+    if (o.singleStep != Options::NONE || o.noEvents || o.interactive ||
+        o.pararealSlice > 0 || o.recurrenceTol > 0 || o.projectEvery > 0 ||
+        o.maxDrift > 0) {
+      fprintf(stderr, "--take cannot be combined with -s, --noEvents, -I,"
+              " --parareal, --recurrence, --project or --maxDrift\n");
+      return 1;
+    }
+    try {
+      return doStream(freeDipole);
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  if (!o.cacheDir.empty() && o.pararealSlice == 0 && !o.interactive &&
+      o.pyramidDir.empty() && o.maxDrift == 0 &&
+      o.checkpointFilename.empty() && o.ringName.empty()) {
+    try {
+      return doCachedSimulation(freeDipole);
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  unique_ptr<Event> event(
+      o.noEvents ? new Event(freeDipole, o.singleStep) :
+      new Event(o.outFilename, freeDipole, o.singleStep));
+  unique_ptr<Summary> summary;
+  if (!o.summaryFilename.empty()) {
+    summary.reset(new Summary(freeDipole));
+    event->setSummary(summary.get());
+  }
+  unique_ptr<EventRing> ring;
+  if (!o.ringName.empty()) {
+    try {
+      ring.reset(new EventRing(o.ringName, o.ringSize, o.ringBlock ?
+                               EventRing::BLOCK : EventRing::OVERWRITE));
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+    event->setRing(ring.get());
+  }
+  unique_ptr<PyramidWriter> pyramid;
+  unique_ptr<CheckpointWriter> checkpoints;
+  if (o.pararealSlice > 0) {
+    if (o.singleStep != Options::NONE || o.interactive || o.fixed_h ||
+        o.recurrenceTol > 0 || o.projectEvery > 0) {
+      fprintf(stderr, "--parareal cannot be combined with -s, --interactive,"
+              " -c, --recurrence or --project\n");
+      return 1;
+    }
+    try {
+      doParareal(freeDipole, *event);
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  } else if (o.maxDrift > 0) {
+    if (o.singleStep != Options::NONE || o.interactive || o.fixed_h ||
+        o.recurrenceTol > 0 || o.projectEvery > 0) {
+      fprintf(stderr, "--maxDrift cannot be combined with -s, --interactive,"
+              " -c, --recurrence or --project\n");
+      return 1;
+    }
+    try {
+      doDriftControl(freeDipole, *event);
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  } else {
+    try {
+      if (!o.pyramidDir.empty()) {
+        pyramid.reset(new PyramidWriter(o.pyramidDir, o.pyramidMinLevel));
+        event->setPyramid(pyramid.get());
+      }
+      if (!o.checkpointFilename.empty()) {
+        checkpoints.reset(new CheckpointWriter(
+            o.checkpointFilename, Checkpoints::config(freeDipole, o.dynamics),
+            o.checkpointEvery));
+      }
+      runSingle(freeDipole, *event, 0, checkpoints.get());
+      if (pyramid) {
+        pyramid->finish();
+        printf("Pyramid output to %s\n\n", o.pyramidDir.c_str());
+      }
+      if (checkpoints) {
+        printf("Checkpoints output to %s\n\n",
+               checkpoints->filename().c_str());
+      }
+    } catch (logic_error& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+
+  if (summary) {
+    return writeSummary(*summary);
+  }
+}
+
+int writeSummary(const Summary& summary) {
+  FILE* out = fopen(o.summaryFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "Unable to open %s\n", o.summaryFilename.c_str());
+    return 1;
+  }
+  summary.writeJson(out);
+  fclose(out);
+  printf("Summary output to %s\n", o.summaryFilename.c_str());
+  printf("\n");
+  return 0;
+}
+
+// Runs the -i/-f simulation, publishing its --metrics.
+RunResult runSingle(const Dipole& freeDipole, Event& event,
+                    const RunResult* resume, CheckpointWriter* checkpoints) {
+  LiveMetrics metrics(o.metricsName, 1, 0, o.numEvents);
+  metrics.slot(0).start(-1);
+  const RunResult result = doSimulation(freeDipole, event, o.numEvents,
+                                        o.dynamics, true, metrics.slot(0),
+                                        resume, o.eps, o.integrator,
+                                        checkpoints);
+  metrics.slot(0).finish();
+  metrics.slot(0).done();
+  return result;
+}
+
+// Replays events --replay a:b of a run from the last of its checkpoints
+// before event a. Events a to b are output as in the run, or with -s the
+// states of every step from the one in which event a occurs to the one in
+// which event b occurs, or with --sampleDt uniform samples over the same
+// steps. The trajectory is the run's, so the options that determine it
+// must be those of the run.
+int doReplay(const Dipole& freeDipole) {
+  const Checkpoints checkpoints(o.replayFilename,
+                                Checkpoints::config(freeDipole, o.dynamics));
+  const RunResult* start = checkpoints.before(o.replayFirst);
+
+  Stepper stepper(freeDipole, o.h, o.fixed_h, o.eps, o.dynamics,
+                  o.integrator);
+  vector<Event::Record> records;
+  Event counter(freeDipole, 0, &records);
+  int numEvents = 0;
+  long numSteps = 0;
+  if (start) {
+    stepper.d = start->d;
+    stepper.t = start->t;
+    stepper.h = start->h;
+    // The last crossing test saw the state before the reflection, or
+    // with a layout the reflected one (see Event::logCollision)
+    Dipole seen = start->d;
+    if (start->atCollision && !MagnetLayout::active()) {
+      seen.set_pr(-seen.get_pr());
+    }
+    counter.resume(seen, start->t, start->numEvents);
+    numEvents = start->numEvents;
+    numSteps = start->numSteps;
+  }
+  const double t0 = stepper.t;
+  const long numSteps0 = numSteps;
+  // Replay no further than the run went: to its recorded end, or else to
+  // the --numEvents or --logOfNumSteps limit it had
+  int lastEvent = o.replayLast;
+  long lastStep = LONG_MAX;
+  if (checkpoints.finished()) {
+    lastEvent = min(lastEvent, checkpoints.endEvents());
+    lastStep = checkpoints.endSteps();
+  } else if (o.numEvents != -1) {
+    lastEvent = min(lastEvent, o.numEvents-1);
+  } else {
+    lastStep = o.numSteps;
+  }
+
+  const bool stepOutput = (o.singleStep != Options::NONE);
+  const bool eventOutput = (o.singleStep == Options::NONE ||
+                            o.singleStep == Options::ALL);
+  const bool sampling = (o.sampleDt > 0);
+  long numOutput = 0;
+  {
+    Event out(o.outFilename, freeDipole, o.singleStep);
+    if (!stepOutput) {
+      // Number the events as in the run
+      out.resume(freeDipole, 0, o.replayFirst-1);
+    }
+    out.printHeader();
+    DenseOutput dense(o.sampleDt);
+    auto emit = [&](const Dipole& d, const double t) {
+      if (sampling) {
+        numOutput += dense.add(d, t, INT_MAX,
+                               [&out](const Dipole& s, const double ts) {
+                                 out.logStep(s, ts);
+                               });
+      } else {
+        out.logStep(d, t);
+        ++numOutput;
+      }
+    };
+
+    // State at the end of the previous logged step, which starts the
+    // step in which event a occurs
+    Dipole prev = stepper.d;
+    double prevT = stepper.t;
+    bool inWindow = false;
+    // Numbers and outputs the events of the step just logged
+    auto consume = [&]() {
+      for (int i = 0; i < records.size(); ++i) {
+        ++numEvents;
+        if (numEvents == o.replayFirst && stepOutput) {
+          inWindow = true;
+          if (sampling) {
+            dense.restart(prev, prevT);
+            dense.skipTo(prevT);
+          } else {
+            emit(prev, prevT);
+          }
+        }
+        if (eventOutput && numEvents >= o.replayFirst &&
+            numEvents <= o.replayLast) {
+          out.replay(records[i]);
+          if (!stepOutput) ++numOutput;
+        }
+      }
+      records.clear();
+    };
+    // Steps are counted as doSimulation counts them, by logged steps
+    auto log = [&]() {
+      ++numSteps;
+      counter.log(stepper.d, stepper.t, &stepper);
+      consume();
+      if (inWindow) {
+        emit(stepper.d, stepper.t);
+        if (numEvents >= o.replayLast) inWindow = false;
+      }
+      prev = stepper.d;
+      prevT = stepper.t;
+    };
+    auto collision = [&]() {
+      counter.logCollision(stepper.d, stepper.t);
+      consume();
+    };
+
+    while (numEvents < lastEvent && numSteps < lastStep) {
+      bool collided = false;
+      stepper.advanceStep(log, [&]() {
+        collision();
+        collided = true;
+      });
+      if (collided) {
+        // The reflected state starts the next step
+        prev = stepper.d;
+        if (inWindow && sampling) {
+          dense.restart(stepper.d, stepper.t);
+        }
+      }
+    }
+  }
+
+  printf("\n");
+  printf("Replayed events %d to %d from t = %lf (event %d) to t = %lf: "
+         "%ld steps, %ld %s output\n", o.replayFirst,
+         min(numEvents, o.replayLast), t0,
+         start ? start->numEvents : 0, stepper.t, numSteps - numSteps0,
+         numOutput, stepOutput ? (sampling ? "samples" : "states") :
+         "events");
+  if (numEvents < o.replayLast) {
+    fprintf(stderr, "The run ended after event %d (step %ld); events %d to"
+            " %d were not replayed\n", numEvents, numSteps,
+            max(numEvents+1, o.replayFirst), o.replayLast);
+  }
+  printf("\n");
+  if (o.outFilename != "") {
+    printf("Results output to %s\n", o.outFilename.c_str());
+    printf("\n");
+  }
+  return 0;
+}
+
+// Runs the -i/-f simulation for --take events, pulling them from an
+// EventStream so that no step is taken after the last one is found.
+int doStream(const Dipole& freeDipole) {
+  EventStream stream(freeDipole);
+  unique_ptr<Summary> summary;
+  int numWritten = 0;
+  {
+    Event out(o.outFilename, freeDipole, Options::NONE);
+    if (!o.summaryFilename.empty()) {
+      summary.reset(new Summary(freeDipole));
+      out.setSummary(summary.get());
+    }
+    out.printHeader();
+    LiveMetrics metrics(o.metricsName, 1, 0, o.take);
+    LiveMetrics::Slot& slot = metrics.slot(0);
+    slot.start(-1);
+    Event::Record e;
+    while (numWritten < o.take) {
+      const long budget = (o.numSteps == -1) ? -1 :
+          max(0L, o.numSteps - stream.numSteps());
+      if (budget == 0 || !stream.next(e, budget)) break;
+      slot.step(stream.numSteps(), numWritten, stream.time(),
+                stream.stepSize());
+      if (e.t < o.after ||
+          (!o.onlyTypes.empty() &&
+           find(o.onlyTypes.begin(), o.onlyTypes.end(), e.name) ==
+           o.onlyTypes.end())) {
+        continue;
+      }
+      out.replay(e);
+      ++numWritten;
+      slot.energy(e.d.get_dE());
+    }
+    slot.finish();
+    slot.done();
+  }
+
+  if (o.outFilename != "") {
+    printf("\n%d events after %ld steps to t = %lf output to %s\n\n",
+           numWritten, stream.numSteps(), stream.time(),
+           o.outFilename.c_str());
+  }
+  if (summary) {
+    return writeSummary(*summary);
+  }
+  return 0;
+}
+
+// Runs the -i/-f simulation through the --cache directory. The outputs of
+// an identical earlier run are copied instead of computed, and a shorter
+// earlier run is continued where possible. Event output to stdout is
+// served from the cache but not stored.
+int doCachedSimulation(const Dipole& freeDipole) {
+  const ResultCache cache(o.cacheDir);
+  const string config = ResultCache::config(freeDipole, o.dynamics);
+  const bool wantEvents = !o.noEvents;
+  const bool wantSummary = !o.summaryFilename.empty();
+  ResultCache::Entry entry;
+  const bool found =
+      cache.find(config, o.numEvents, o.numSteps, ResultCache::resumable(),
+                 entry) &&
+      (!wantEvents || entry.hasEvents) && (!wantSummary || entry.hasSummary);
+
+  if (found && entry.numEvents == o.numEvents &&
+      entry.numSteps == o.numSteps) {
+    if (wantEvents) {
+      ResultCache::copy(entry.base + ".csv", o.outFilename);
+    }
+    if (wantSummary) {
+      ResultCache::copy(entry.base + ".json", o.summaryFilename);
+    }
+    if (!o.outFilename.empty()) {
+      printf("\nResults output to %s from cache %s\n\n",
+             o.outFilename.c_str(), entry.base.c_str());
+    }
+    return 0;
+  }
+
+  const RunResult* resume = found ? &entry.result : 0;
+  if (resume) {
+    if (wantEvents) {
+      ResultCache::copy(entry.base + ".csv", o.outFilename);
+    }
+    if (!o.outFilename.empty()) {
+      printf("\nContinuing cached run %s\n", entry.base.c_str());
+    }
+  }
+  RunResult result;
+  unique_ptr<Summary> summary;
+  {
+    unique_ptr<Event> event(
+        o.noEvents ? new Event(freeDipole) :
+        new Event(o.outFilename, freeDipole, o.singleStep, resume != 0));
+    if (wantSummary) {
+      summary.reset(new Summary(freeDipole));
+      event->setSummary(summary.get());
+    }
+    result = runSingle(freeDipole, *event, resume);
+  }
+  if (summary && writeSummary(*summary) != 0) {
+    return 1;
+  }
+  cache.store(config, o.numEvents, o.numSteps, result,
+              (wantEvents && !o.outFilename.empty()) ? o.outFilename : "",
+              o.summaryFilename);
+  return 0;
 }
 
 void printStateHeader() {
@@ -135,44 +932,157 @@ void printState(const double t, const double h, const Dipole& d,
          d.get_E(), d.get_dE());
 }
 
-void printProgress(const int n, const Dipole& d, const bool fired) {
-  if (!o.interactive && (n % 1000 == 0 || n >= o.numEvents) && fired) {
-    printf("\r");
-    printf("Num events = %-7d     dE = %-12e     ", n, d.get_dE());
-    fflush(stdout);
-  }
+void printProgress(const LiveMetrics::Snapshot& s) {
+  printf("\r");
+  printf("Num events = %-7ld     dE = %-12e     ", s.events, s.dE);
+  fflush(stdout);
 }
 
-bool keepGoing(const Event& event, const int n) {
-  if (o.numEvents != -1) {
-    return (event.get_n() < o.numEvents);
+// Redraws the progress line from the live metrics every 200 ms on its own
+// thread, so that the step loop only publishes, until stopped.
+class ProgressLine {
+ public:
+  explicit ProgressLine(const LiveMetrics::Slot& slot)
+      : _slot(slot), _stop(false), _thread(&ProgressLine::run, this) {}
+
+  ~ProgressLine() {
+    {
+      lock_guard<mutex> lock(_mutex);
+      _stop = true;
+    }
+    _stopped.notify_all();
+    _thread.join();
+    LiveMetrics::Snapshot s;
+    _slot.read(s);
+    printProgress(s);
+  }
+
+ private:
+  void run() {
+    unique_lock<mutex> lock(_mutex);
+    while (!_stopped.wait_for(lock, chrono::milliseconds(200),
+                              [this]() { return _stop; })) {
+      LiveMetrics::Snapshot s;
+      if (_slot.read(s)) {
+        printProgress(s);
+      }
+    }
+  }
+
+ private:
+  const LiveMetrics::Slot& _slot;
+  mutex _mutex;
+  condition_variable _stopped;
+  bool _stop;
+  thread _thread;
+};
+
+bool keepGoing(const Event& event, const int n, const int numEvents) {
+  if (numEvents != -1) {
+    return (event.get_n() < numEvents);
   }
   return (n < o.numSteps);
 }
 
-Dipole doSimulation(const Dipole& freeDipole, Event& event) {
+// Runs a single simulation until numEvents events (or --logOfNumSteps
+// steps if numEvents is -1). If verbose, progress and the interactive
+// state are printed to stdout. Counters are published to metrics as the
+// run goes. If resume is given, the run continues from where that earlier
+// run of freeDipole stopped (see ResultCache::resumable). eps and
+// integrator default to the options'. If checkpoints is given, the run's
+// checkpoints are written to it. Only reads the global options, so
+// several simulations can run concurrently.
+RunResult doSimulation(const Dipole& freeDipole, Event& event,
+                       const int numEvents, const Options::Dynamics dynamics,
+                       const bool verbose, LiveMetrics::Slot& metrics,
+                       const RunResult* resume, const double eps,
+                       const Options::Integrator integrator,
+                       CheckpointWriter* checkpoints) {
   const double h_ = o.h;
-  const int numEvents = o.numEvents;
   const int numSteps = o.numSteps;
 
-  Stepper stepper(freeDipole, h_, o.fixed_h, o.eps);
+  Stepper stepper(freeDipole, h_, o.fixed_h, eps, dynamics, integrator);
 
   double t = 0.0;
   int n = 0;
-  const bool showProgress = (o.outFilename != "" &&
+  const bool showProgress = (verbose &&
+                             (o.outFilename != "" || o.noEvents) &&
                              o.singleStep == Options::NONE);
 
-  printf("\n");
-  event.printHeader();
+  if (resume) {
+    stepper.d = resume->d;
+    stepper.t = resume->t;
+    stepper.h = resume->h;
+    n = resume->numSteps;
+    // The last crossing test saw the state before the reflection, or
+    // with a layout the reflected one (see Event::logCollision)
+    Dipole seen = resume->d;
+    if (resume->atCollision && !MagnetLayout::active()) {
+      seen.set_pr(-seen.get_pr());
+    }
+    event.resume(seen, resume->t, resume->numEvents);
+  }
+
+  if (verbose) {
+    printf("\n");
+  }
+  if (!resume) {
+    event.printHeader();
+  }
   if (o.interactive) {
     printStateHeader();
     printState(0, h_, freeDipole);
   }
-  if (showProgress) {
-    printProgress(0, freeDipole, true);
+  unique_ptr<ProgressLine> progress;
+  if (showProgress && !o.interactive) {
+    progress.reset(new ProgressLine(metrics));
   }
+  long numStepsTaken = 0;
+  bool atCollision = false;
+
+  RecurrenceDetector recurrence(o.recurrenceTol, o.maxPeriod,
+                                o.recurrenceConfirm, o.section, freeDipole);
+  const bool detecting = recurrence.enabled();
+
+  const bool sampling = (o.sampleDt > 0);
+  DenseOutput dense(o.sampleDt);
+  if (sampling) {
+    dense.restart(freeDipole, 0);
+  }
+  // Logs the step just taken. When sampling, n counts samples rather
+  // than steps so that --logOfNumSteps gives 2^n uniform samples.
+  auto logStep = [&]() -> bool {
+    if (detecting) {
+      recurrence.step(stepper.d);
+    }
+    if (sampling) {
+      const int remaining = (numSteps == -1) ? INT_MAX : numSteps - n;
+      n += dense.add(stepper.d, stepper.t, remaining,
+                     [&event](const Dipole& d, const double t) {
+                       event.logStep(d, t);
+                     });
+      return true;
+    }
+    ++n;
+    return event.log(stepper.d, stepper.t, &stepper);
+  };
+
+  // Energy projection. fixRadius keeps r and pr, which are constrained
+  // while sliding and at a collision.
+  const bool projecting = (o.projectEvery > 0);
+  int stepsSinceProjection = 0;
+  long numProjections = 0;
+  double sumCorrection = 0;
+  double maxCorrection = 0;
+  auto project = [&](const bool fixRadius) {
+    const double c = stepper.d.projectToEnergy(fixRadius);
+    ++numProjections;
+    sumCorrection += c;
+    maxCorrection = max(maxCorrection, c);
+    stepsSinceProjection = 0;
+  };
 
-  while (keepGoing(event, n)) {
+  while (keepGoing(event, n, numEvents) && !recurrence.done()) {
     try {
       stepper.step();
     } catch (logic_error& e) {
@@ -188,46 +1098,784 @@ Dipole doSimulation(const Dipole& freeDipole, Event& event) {
     // Keep theta and phi in the range [-180, 180]
     stepper.d.set_theta(Physics::normalizeAngle(stepper.d.get_theta()));
     stepper.d.set_phi(Physics::normalizeAngle(stepper.d.get_phi()));
-    if (stepper.d.get_r() < 1) {
+    if (Physics::separation(stepper.d) < 1) {
       // Handle collision. Iterate until we get close enough to reflect.
       stepper.undo();
-      while (stepper.d.get_r() > 1.0000000000001) {
+      while (Physics::separation(stepper.d) > 1.0000000000001) {
         stepper.stepHalf();
-        if (stepper.d.get_r() < 1) {
+        ++numStepsTaken;
+        if (Physics::separation(stepper.d) < 1) {
           stepper.undo();
         } else {
-          event.log(stepper.d, stepper.t);
-          ++n;
+          logStep();
         }
       }
 
       event.logCollision(stepper.d, stepper.t);
-      if (showProgress) {
-        printProgress(event.get_n(), stepper.d, true);
+      if (detecting) {
+        recurrence.collision(stepper.d);
       }
+      metrics.energy(stepper.d.get_dE());
       // Specular reflection
-      stepper.d.set_pr(-stepper.d.get_pr());
+      Physics::reflect(stepper.d);
+      if (projecting) {
+        project(true);
+      }
+      if (sampling) {
+        dense.restart(stepper.d, stepper.t);
+      }
 
       stepper.reset();
+      atCollision = true;
     } else {
-      const bool fired = event.log(stepper.d, stepper.t);
-      if (showProgress) {
-        printProgress(event.get_n(), stepper.d, fired);
+      atCollision = false;
+      if (projecting && ++stepsSinceProjection >= o.projectEvery) {
+        project(dynamics == Options::SLIDING);
+      }
+      if (logStep()) {
+        metrics.energy(stepper.d.get_dE());
+      }
+    }
+    metrics.step(++numStepsTaken, event.get_n()-1, stepper.t, stepper.h);
+    if (checkpoints) {
+      checkpoints->step(stepper.d, stepper.t, stepper.h, n, event.get_n()-1,
+                        atCollision);
+    }
+  }
+  progress.reset();
+  if (checkpoints) {
+    checkpoints->finish(n, event.get_n()-1);
+  }
+
+  if (verbose) {
+    printf("\n");
+    // printStateHeader();
+    // printState(0, h_, freeDipole);
+    // printState(stepper.t, stepper.h, stepper.d);
+
+    printf("\n");
+    if (detecting) {
+      if (recurrence.fate() == RecurrenceDetector::PERIODIC) {
+        printf("Fate: periodic with period %d at t = %lf\n",
+               recurrence.period(), stepper.t);
+      } else {
+        printf("Fate: %s at t = %lf\n",
+               RecurrenceDetector::fateName(recurrence.fate()), stepper.t);
       }
-      ++n;
+      printf("\n");
+    }
+    if (projecting) {
+      printf("Energy projections: %ld, mean correction = %e, "
+             "max correction = %e\n", numProjections,
+             numProjections > 0 ? sumCorrection / numProjections : 0.0,
+             maxCorrection);
+      printf("\n");
+    }
+    if (o.outFilename != "") {
+      printf("Results output to %s\n", o.outFilename.c_str());
+      printf("\n");
     }
   }
 
+  RunResult result;
+  result.d = stepper.d;
+  result.t = stepper.t;
+  result.numEvents = event.get_n()-1;
+  result.numSteps = n;
+  result.fate = recurrence.fate();
+  result.period = recurrence.period();
+  result.h = stepper.h;
+  result.atCollision = atCollision;
+  return result;
+}
+
+// Runs a single simulation with parareal (see Parareal.h), one window of
+// --threads slices at a time, until numEvents events (or --logOfNumSteps
+// fine steps).
+void doParareal(const Dipole& freeDipole, Event& event) {
+  Parareal parareal(max(1, o.numThreads), o.pararealSlice, o.pararealTol,
+                    o.coarseEps, o.dynamics);
+  Dipole d = freeDipole;
+  double t = 0;
+  int n = 0;
+  int numWindows = 0;
+  long numIterations = 0;
+  double serialSeconds = 0;
+  double seconds = 0;
+
   printf("\n");
-  // printStateHeader();
-  // printState(0, h_, freeDipole);
-  // printState(stepper.t, stepper.h, stepper.d);
+  event.printHeader();
+  while (keepGoing(event, n, o.numEvents)) {
+    vector<Event::Record> records;
+    const Parareal::Window w = parareal.window(d, t, records);
+    for (int i = 0; i < records.size() && keepGoing(event, n, o.numEvents);
+         ++i) {
+      event.replay(records[i]);
+    }
+    n += w.fineSteps;
+    ++numWindows;
+    numIterations += w.iterations;
+    serialSeconds += w.serialSeconds;
+    seconds += w.seconds;
+    printf("Window %d: t = %lf, events = %d, iterations = %d, "
+           "speedup = %.2f\n", numWindows, t, event.get_n()-1, w.iterations,
+           w.seconds > 0 ? w.serialSeconds / w.seconds : 0.0);
+  }
 
+  printf("\n");
+  printf("Parareal: %d windows, %.2f iterations per window, "
+         "speedup = %.2f (%.2f s serial estimate, %.2f s)\n",
+         numWindows, (double)numIterations / numWindows,
+         seconds > 0 ? serialSeconds / seconds : 0.0, serialSeconds, seconds);
   printf("\n");
   if (o.outFilename != "") {
     printf("Results output to %s\n", o.outFilename.c_str());
     printf("\n");
   }
+}
+
+// Runs a single simulation under the --maxDrift energy budget (see
+// DriftControl.h), one segment at a time, until numEvents events (or
+// --logOfNumSteps steps). The tolerance of each segment is written to
+// --driftLog, or to <outFilename>.drift.csv.
+void doDriftControl(const Dipole& freeDipole, Event& event) {
+  DriftControl control(o.maxDrift, o.driftSegment, o.eps, o.dynamics,
+                       o.integrator);
+  string logFilename = o.driftLog;
+  if (logFilename.empty() && o.outFilename != "") {
+    logFilename = o.outFilename + ".drift.csv";
+  }
+  FILE* log = 0;
+  if (!logFilename.empty()) {
+    log = fopen(logFilename.c_str(), "w");
+    if (!log) {
+      throw logic_error("Unable to open " + logFilename);
+    }
+    fprintf(log, "segment, t0, t1, eps, rollbacks, steps, total_steps, dE\n");
+  }
+
+  Dipole d = freeDipole;
+  double t = 0;
+  int n = 0;
+  int numSegments = 0;
+  int numTightened = 0;
+  long numRollbacks = 0;
+  long totalSteps = 0;
+  double minEps = o.eps;
+
+  printf("\n");
+  event.printHeader();
+  try {
+    while (keepGoing(event, n, o.numEvents)) {
+      vector<Event::Record> records;
+      const DriftControl::Segment s = control.segment(d, t, records);
+      for (int i = 0; i < records.size() && keepGoing(event, n, o.numEvents);
+           ++i) {
+        event.replay(records[i]);
+      }
+      n += s.steps;
+      ++numSegments;
+      if (s.eps < o.eps) ++numTightened;
+      numRollbacks += s.rollbacks;
+      totalSteps += s.totalSteps;
+      minEps = min(minEps, s.eps);
+      if (log) {
+        fprintf(log, "%d,%lf,%lf,%.1e,%d,%ld,%ld,%.2e\n", numSegments, s.t0,
+                s.t1, s.eps, s.rollbacks, s.steps, s.totalSteps, s.dE);
+      }
+    }
+  } catch (logic_error& e) {
+    if (log) fclose(log);
+    throw;
+  }
+  if (log) fclose(log);
+
+  printf("\n");
+  printf("Drift control: %d segments, %d tightened (min eps = %.1e), "
+         "%ld rollbacks, %ld of %ld steps kept, dE = %.2e\n",
+         numSegments, numTightened, minEps, numRollbacks, (long)n,
+         totalSteps, d.get_dE());
+  printf("\n");
+  if (o.outFilename != "") {
+    printf("Results output to %s\n", o.outFilename.c_str());
+    printf("\n");
+  }
+  if (log) {
+    printf("Segment tolerances output to %s\n", logFilename.c_str());
+    printf("\n");
+  }
+}
+
+// Work-precision comparison of the integrators on the initial condition
+// run to time T. The reference and its error are those of magphyx-bench,
+// see Benchmark.h; magphyx-bench runs the same comparison on a fixed set
+// of scenarios.
+int doWorkPrecision() {
+  Scenario s;
+  s.name = "cli";
+  s.d = o.dipole;
+  s.dynamics = o.dynamics;
+  s.T = o.workPrecisionT;
+  const WorkPrecision::Reference ref = WorkPrecision::reference(s);
+  const WorkPrecision wp(0.2);
+
+  FILE* out = (o.outFilename == "") ? stdout : fopen(o.outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "Unable to open %s\n", o.outFilename.c_str());
+    return 1;
+  }
+  WorkPrecision::writeCsvHeader(out);
+  const Options::Integrator integrators[] = {
+    Options::RK8PD, Options::RKF45, Options::TAYLOR };
+  for (int i = 0; i < 3; ++i) {
+    for (int e = 6; e <= 14; ++e) {
+      WorkPrecision::writeCsv(
+          out, wp.run(s, ref, integrators[i], pow(10.0, -e), o.h, false));
+      fflush(out);
+    }
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+// Finds the periodic orbit near the initial condition and follows it in
+// energy. See PeriodicOrbit.h.
+int doPeriodicOrbit() {
+  if (o.dynamics == Options::SLIDING &&
+      o.section.kind() == EventSurface::COLLISION) {
+    throw logic_error("--periodic with -d sliding needs a --section other "
+                      "than collision");
+  }
+  PeriodicOrbit finder(o.section, o.periodicReturns, o.eps, o.orbitTol,
+                       o.dynamics);
+
+  FILE* out = (o.outFilename == "") ? stdout : fopen(o.outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "Unable to open %s\n", o.outFilename.c_str());
+    return 1;
+  }
+  fprintf(out, "E, T, r, theta, phi, pr, ptheta, pphi, converged, "
+          "iterations, residual, stable, maxMultiplier, multipliers\n");
+
+  // Predictor for continuation: secant through the last two orbits
+  vector<Dipole> orbits;
+  Dipole guess = finder.toSection(o.dipole);
+  int numConverged = 0;
+  for (int j = 0; j <= o.continuationSteps; ++j) {
+    const double E = o.dipole.get_E() + j * o.continuationStep;
+    if (orbits.size() >= 2) {
+      const Dipole& a = orbits[orbits.size()-2];
+      const Dipole& b = orbits.back();
+      guess = Dipole(2*b.get_r() - a.get_r(),
+                     b.get_theta() + Physics::normalizeAngle(
+                         b.get_theta() - a.get_theta()),
+                     b.get_phi() + Physics::normalizeAngle(
+                         b.get_phi() - a.get_phi()),
+                     2*b.get_pr() - a.get_pr(),
+                     2*b.get_ptheta() - a.get_ptheta(),
+                     2*b.get_pphi() - a.get_pphi());
+    } else if (orbits.size() == 1) {
+      guess = orbits.back();
+    }
+
+    const PeriodicOrbit::Orbit orbit = finder.solve(guess, E);
+    const Dipole& d = orbit.d;
+    fprintf(out, "%.17g, %.17g, %.17g, %.17g, %.17g, %.17g, %.17g, %.17g, "
+            "%d, %d, %e, %d, %.17g, ", E, orbit.T,
+            d.get_r(), Physics::rad2deg(d.get_theta()),
+            Physics::rad2deg(d.get_phi()),
+            d.get_pr(), d.get_ptheta(), d.get_pphi(),
+            orbit.converged ? 1 : 0, orbit.iterations, orbit.residual,
+            orbit.stable() ? 1 : 0, orbit.maxMultiplier());
+    for (int i = 0; i < orbit.multipliers.size(); ++i) {
+      const complex<double>& m = orbit.multipliers[i];
+      fprintf(out, "%s%.10g%+.10gi", i ? " " : "", m.real(), m.imag());
+    }
+    fprintf(out, "\n");
+    fflush(out);
+    if (!orbit.converged) break;
+    ++numConverged;
+    orbits.push_back(d);
+  }
+  if (out != stdout) {
+    fclose(out);
+    printf("%d periodic orbits from %ld trajectory integrations\n",
+           numConverged, finder.numIntegrations());
+    printf("Results output to %s\n", o.outFilename.c_str());
+  }
+  return numConverged > 0 ? 0 : 1;
+}
+
+// Cost of a run for shard balancing
+double runCost(const EnsembleRecord& rec) {
+  return (rec.numEvents != -1) ? rec.numEvents : o.numSteps;
+}
+
+string formatRow(const EnsembleRecord& rec, const RunResult& result) {
+  const Dipole& d0 = rec.dipole;
+  const Dipole& d = result.d;
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "%ld,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%d,%.17g,"
+           "%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%s,%d\n",
+           rec.index, d0.get_r(), Physics::rad2deg(d0.get_theta()),
+           Physics::rad2deg(d0.get_phi()), d0.get_pr(), d0.get_ptheta(),
+           d0.get_pphi(), result.numEvents, result.t, d.get_r(),
+           Physics::rad2deg(d.get_theta()), Physics::rad2deg(d.get_phi()),
+           d.get_pr(), d.get_ptheta(), d.get_pphi(), d.get_E(),
+           d.get_dE(), RecurrenceDetector::fateName(result.fate),
+           result.period);
+  return buf;
+}
+
+// Runs one record of an ensemble, through the cache if given: the final
+// state of an identical earlier run is reused, and a shorter one is
+// continued where possible.
+RunResult runRecord(const EnsembleRecord& rec, const ResultCache* cache,
+                    LiveMetrics::Slot& slot) {
+  Event event(rec.dipole);
+  if (!cache) {
+    return doSimulation(rec.dipole, event, rec.numEvents, rec.dynamics, false,
+                        slot);
+  }
+  const string config = ResultCache::config(rec.dipole, rec.dynamics);
+  ResultCache::Entry entry;
+  const bool found = cache->find(config, rec.numEvents, o.numSteps,
+                                 ResultCache::resumable(), entry);
+  if (found && entry.numEvents == rec.numEvents &&
+      entry.numSteps == o.numSteps) {
+    return entry.result;
+  }
+  const RunResult result =
+      doSimulation(rec.dipole, event, rec.numEvents, rec.dynamics, false,
+                   slot, found ? &entry.result : 0);
+  cache->store(config, rec.numEvents, o.numSteps, result, "", "");
+  return result;
+}
+
+// Why a record of a --screen ensemble was rerun at full accuracy
+enum Rerun { ACCEPTED, UNRESOLVED, UNSTABLE, BOUNDARY, AUDIT, NUM_RERUNS };
+
+const char* rerunName(const int rerun) {
+  switch (rerun) {
+    case UNRESOLVED: return "unresolved";
+    case UNSTABLE: return "unstable";
+    case BOUNDARY: return "boundary";
+    case AUDIT: return "audit";
+    default: return "accepted";
+  }
+}
+
+bool sameFate(const RunResult& a, const RunResult& b) {
+  return a.fate == b.fate && a.period == b.period;
+}
+
+// Calls f(worker, i) for every i in [0, n) on o.numThreads threads.
+template <typename F>
+void parallelFor(const long n, F f) {
+  atomic<long> next(0);
+  auto worker = [&](const int w) {
+    for (long i = next++; i < n; i = next++) {
+      f(w, i);
+    }
+  };
+  vector<thread> threads;
+  for (int i = 1; i < o.numThreads; ++i) {
+    threads.push_back(thread(worker, i));
+  }
+  worker(0);
+  for (int i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+}
+
+// Runs this process's shard of a --screen ensemble in two tiers and writes
+// the rows. Every record is first screened with rkf45 at --screen eps for
+// its short event budget. Records are rerun with the full settings if the
+// screening run
+//   unresolved  did not classify the run
+//   unstable    lost more than 100 eps of energy
+//   boundary    has a different fate or period from a neighbor: the
+//               record before or after it in the ensemble or, with
+//               --screenGrid, the records beside it on the grid
+//   audit       was drawn with probability --screenAudit, to estimate how
+//               often the accepted screening fates are wrong
+// Rows of accepted records hold the screening result. The shard's records
+// and results are kept in memory for the neighbor test.
+void doScreenedEnsemble(EnsembleReader& reader, const ShardAssignment& shards,
+                        FILE* out, LiveMetrics& metrics,
+                        const ResultCache* cache) {
+  vector<EnsembleRecord> records;
+  EnsembleRecord rec;
+  double costBefore = 0;
+  while (reader.next(rec)) {
+    const double cost = runCost(rec);
+    if (shards.shardOf(costBefore, cost) == o.shardIndex) {
+      records.push_back(rec);
+    }
+    costBefore += cost;
+  }
+  const long n = records.size();
+
+  vector<RunResult> screened(n);
+  parallelFor(n, [&](const int w, const long i) {
+    LiveMetrics::Slot& slot = metrics.slot(w);
+    slot.start(records[i].index);
+    Event event(records[i].dipole);
+    screened[i] = doSimulation(records[i].dipole, event, o.screenEvents,
+                               records[i].dynamics, false, slot, 0,
+                               o.screenEps, Options::RKF45);
+    slot.finish();
+  });
+
+  // Shard position of each record index, for the grid neighbors. Records
+  // of other shards are not compared.
+  map<long, long> position;
+  if (o.screenGrid > 0) {
+    for (long i = 0; i < n; ++i) {
+      position[records[i].index] = i;
+    }
+  }
+  auto onBoundary = [&](const long i) {
+    if (o.screenGrid == 0) {
+      return (i > 0 && !sameFate(screened[i], screened[i-1])) ||
+          (i+1 < n && !sameFate(screened[i], screened[i+1]));
+    }
+    const long k = records[i].index;
+    const long w = o.screenGrid;
+    const long neighbors[4] = {
+      (k % w > 0) ? k-1 : -1, ((k+1) % w > 0) ? k+1 : -1, k-w, k+w };
+    for (int j = 0; j < 4; ++j) {
+      const map<long, long>::const_iterator it = position.find(neighbors[j]);
+      if (it != position.end() &&
+          !sameFate(screened[i], screened[it->second])) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  vector<int> rerun(n, ACCEPTED);
+  vector<long> reruns;
+  for (long i = 0; i < n; ++i) {
+    const RunResult& s = screened[i];
+    if (s.fate == RecurrenceDetector::UNRESOLVED) {
+      rerun[i] = UNRESOLVED;
+    } else if (s.d.get_dE() > 100 * o.screenEps) {
+      rerun[i] = UNSTABLE;
+    } else if (onBoundary(i)) {
+      rerun[i] = BOUNDARY;
+    } else if (Philox(~(uint64_t)o.seed, records[i].index).uniform() <
+               o.screenAudit) {
+      // Keyed apart from --shell, which draws from the same streams
+      rerun[i] = AUDIT;
+    }
+    if (rerun[i] != ACCEPTED) {
+      reruns.push_back(i);
+    }
+  }
+
+  vector<RunResult> results(screened);
+  parallelFor(reruns.size(), [&](const int w, const long j) {
+    const long i = reruns[j];
+    LiveMetrics::Slot& slot = metrics.slot(w);
+    slot.start(records[i].index);
+    results[i] = runRecord(records[i], cache, slot);
+    slot.finish();
+  });
+  for (int w = 0; w < o.numThreads; ++w) {
+    metrics.slot(w).done();
+  }
+
+  for (long i = 0; i < n; ++i) {
+    fputs(formatRow(records[i], results[i]).c_str(), out);
+  }
+
+  // Report: reruns and how often the tiers agree, by reason
+  long count[NUM_RERUNS] = { 0 };
+  long agree[NUM_RERUNS] = { 0 };
+  long screenSteps = 0;
+  long fullSteps = 0;
+  for (long i = 0; i < n; ++i) {
+    ++count[rerun[i]];
+    screenSteps += screened[i].numSteps;
+    if (rerun[i] != ACCEPTED) {
+      fullSteps += results[i].numSteps;
+      if (sameFate(screened[i], results[i])) {
+        ++agree[rerun[i]];
+      }
+    }
+  }
+  FILE* report = (out == stdout) ? stderr : stdout;
+  fprintf(report, "\nScreened %ld runs with rkf45 at eps = %g for %d events"
+          " (%ld steps)\n", n, o.screenEps, o.screenEvents, screenSteps);
+  fprintf(report, "Reran %ld runs (%.1f%%) at full accuracy (%ld steps)\n",
+          (long)reruns.size(), n > 0 ? 100.0 * reruns.size() / n : 0.0,
+          fullSteps);
+  for (int k = UNRESOLVED; k < NUM_RERUNS; ++k) {
+    if (count[k] == 0) continue;
+    fprintf(report, "  %-10s %8ld runs, screening fate confirmed in %ld"
+            " (%.1f%%)\n", rerunName(k), count[k], agree[k],
+            100.0 * agree[k] / count[k]);
+  }
 
-  return freeDipole;
+  if (!o.screenReportFilename.empty()) {
+    FILE* f = fopen(o.screenReportFilename.c_str(), "w");
+    if (!f) {
+      throw logic_error("Unable to open " + o.screenReportFilename);
+    }
+    fprintf(f, "run, rerun, screen_fate, screen_period, screen_dE,"
+            " fate, period\n");
+    for (long i = 0; i < n; ++i) {
+      fprintf(f, "%ld,%s,%s,%d,%.17g,%s,%d\n", records[i].index,
+              rerunName(rerun[i]),
+              RecurrenceDetector::fateName(screened[i].fate),
+              screened[i].period, screened[i].d.get_dE(),
+              RecurrenceDetector::fateName(results[i].fate),
+              results[i].period);
+    }
+    fclose(f);
+    fprintf(report, "Screening report output to %s\n",
+            o.screenReportFilename.c_str());
+  }
+}
+
+// Converts the ensemble to the binary format with run settings.
+int writeBinaryEnsemble(EnsembleReader& reader) {
+  FILE* out = fopen(o.binaryEnsembleFilename.c_str(), "wb");
+  if (!out) {
+    throw logic_error("Unable to open " + o.binaryEnsembleFilename);
+  }
+  BinaryEnsembleReader::writeHeader(out, true);
+  EnsembleRecord rec;
+  long count = 0;
+  while (reader.next(rec)) {
+    BinaryEnsembleReader::writeRecord(out, rec);
+    ++count;
+  }
+  fclose(out);
+  printf("Wrote %ld records to %s\n", count, o.binaryEnsembleFilename.c_str());
+  return 0;
+}
+
+// Runs this process's shard of the ensemble on o.numThreads worker
+// threads and writes one row per run to the output file. Event output is
+// not written for ensemble runs.
+//
+// Records are streamed from the reader; workers take the next record of
+// the shard under a lock. Rows are written in run order. A worker does
+// not start a record more than a window of records ahead of the last row
+// written, which bounds the rows held back for reordering.
+int doEnsemble() {
+  if (o.screenEps > 0 && (o.recurrenceTol <= 0 || o.screenEvents <= 0)) {
+    throw logic_error("--screen needs --recurrence to classify runs and a"
+                      " positive event budget");
+  }
+  unique_ptr<EnsembleReader> reader;
+  string ensembleName = o.ensembleFilename;
+  if (o.shellSize > 0) {
+    reader.reset(new MicrocanonicalReader(o.shellEnergy, o.shellSize, o.seed,
+                                          o.collisionSurface, o.rMax,
+                                          o.numEvents, o.dynamics));
+    char buf[128];
+    snprintf(buf, sizeof(buf), "shell E=%.17g seed=%lu%s", o.shellEnergy,
+             o.seed, o.collisionSurface ? " collisionSurface" : "");
+    ensembleName = buf;
+  } else {
+    reader.reset(
+        EnsembleReader::open(o.ensembleFilename, o.numEvents, o.dynamics));
+  }
+  if (!o.binaryEnsembleFilename.empty()) {
+    return writeBinaryEnsemble(*reader);
+  }
+  EnsembleRecord rec;
+
+  // First pass: total cost and shard size
+  double totalCost = 0;
+  long numRecords = 0;
+  while (reader->next(rec)) {
+    totalCost += runCost(rec);
+    ++numRecords;
+  }
+  const ShardAssignment shards(o.numShards, totalCost);
+  long numShardRecords = 0;
+  double costBefore = 0;
+  reader->rewind();
+  while (reader->next(rec)) {
+    if (shards.shardOf(costBefore, runCost(rec)) == o.shardIndex) {
+      ++numShardRecords;
+    }
+    costBefore += runCost(rec);
+  }
+
+  LiveMetrics metrics(o.metricsName, o.numThreads, numShardRecords,
+                      o.numEvents);
+  unique_ptr<const ResultCache> cache(
+      o.cacheDir.empty() ? 0 : new ResultCache(o.cacheDir));
+
+  FILE* out = o.outFilename.empty() ? stdout : fopen(o.outFilename.c_str(), "w");
+  if (!out) {
+    throw logic_error("Unable to open " + o.outFilename);
+  }
+  ResultFile::Header header;
+  header.push_back(make_pair("ensemble", ensembleName));
+  header.push_back(make_pair("ensemble_records", to_string(numRecords)));
+  header.push_back(make_pair("shard", to_string(o.shardIndex) + "/" +
+                             to_string(o.numShards)));
+  header.push_back(make_pair("records", to_string(numShardRecords)));
+  header.push_back(make_pair("dynamics", (o.dynamics == Options::BOUNCING) ?
+                             "bouncing" : "sliding"));
+  header.push_back(make_pair("numEvents", to_string(o.numEvents)));
+  header.push_back(make_pair("numSteps", to_string(o.numSteps)));
+  char buf[64];
+  sprintf(buf, "%.17g", o.h);
+  header.push_back(make_pair("h", string(buf)));
+  header.push_back(make_pair("fixed_h", o.fixed_h ? "1" : "0"));
+  sprintf(buf, "%.17g", o.eps);
+  header.push_back(make_pair("eps", string(buf)));
+  header.push_back(make_pair("integrator", integratorName(o.integrator)));
+  header.push_back(make_pair("scheme", FixedStep::name(o.fixedScheme)));
+  header.push_back(make_pair("project", to_string(o.projectEvery)));
+  sprintf(buf, "%.17g", o.recurrenceTol);
+  header.push_back(make_pair("recurrence", string(buf)));
+  header.push_back(make_pair("maxPeriod", to_string(o.maxPeriod)));
+  header.push_back(make_pair("section", o.section.kind() ==
+                             EventSurface::COLLISION ? "collision" :
+                             o.section.name()));
+  if (o.screenEps > 0) {
+    sprintf(buf, "%.17g", o.screenEps);
+    header.push_back(make_pair("screen_eps", string(buf)));
+    header.push_back(make_pair("screen_events", to_string(o.screenEvents)));
+  }
+  ResultFile::writeHeader(out, header);
+
+  if (o.screenEps > 0) {
+    reader->rewind();
+    doScreenedEnsemble(*reader, shards, out, metrics, cache.get());
+    if (out != stdout) {
+      fclose(out);
+      printf("\nResults output to %s\n\n", o.outFilename.c_str());
+    }
+    return 0;
+  }
+
+  reader->rewind();
+  costBefore = 0;
+  // Reading state, guarded by readMutex
+  mutex readMutex;
+  long numTaken = 0;
+  // Writing state, guarded by writeMutex
+  mutex writeMutex;
+  condition_variable written;
+  long numWritten = 0;
+  map<long, string> pending;
+  const long window = 64 * o.numThreads;
+
+  auto worker = [&](const int workerIndex) {
+    LiveMetrics::Slot& slot = metrics.slot(workerIndex);
+    EnsembleRecord rec;
+    while (true) {
+      long ordinal = -1;
+      {
+        lock_guard<mutex> lock(readMutex);
+        while (ordinal == -1 && reader->next(rec)) {
+          const double cost = runCost(rec);
+          if (shards.shardOf(costBefore, cost) == o.shardIndex) {
+            ordinal = numTaken++;
+          }
+          costBefore += cost;
+        }
+      }
+      if (ordinal == -1) {
+        slot.done();
+        return;
+      }
+
+      {
+        unique_lock<mutex> lock(writeMutex);
+        written.wait(lock, [&]() { return ordinal < numWritten + window; });
+      }
+
+      slot.start(rec.index);
+      const RunResult result = runRecord(rec, cache.get(), slot);
+      slot.finish();
+      const string row = formatRow(rec, result);
+
+      lock_guard<mutex> lock(writeMutex);
+      pending[ordinal] = row;
+      while (!pending.empty() && pending.begin()->first == numWritten) {
+        fputs(pending.begin()->second.c_str(), out);
+        pending.erase(pending.begin());
+        ++numWritten;
+        if (out != stdout) {
+          printf("\rShard %d/%d: run %ld of %ld     ",
+                 o.shardIndex, o.numShards, numWritten, numShardRecords);
+          fflush(stdout);
+        }
+      }
+      written.notify_all();
+    }
+  };
+
+  vector<thread> threads;
+  for (int i = 1; i < o.numThreads; ++i) {
+    threads.push_back(thread(worker, i));
+  }
+  worker(0);
+  for (int i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+
+  if (out != stdout) {
+    fclose(out);
+    printf("\n\nResults output to %s\n\n", o.outFilename.c_str());
+  }
+  return 0;
+}
+
+// Maps the FTLE over the --ftle grid around the initial condition. See
+// Ftle.h.
+int doFtle() {
+  if (o.outFilename.empty()) {
+    throw logic_error("--ftle needs an output file (-o)");
+  }
+  const FtleMap ftleMap(o.dipole, o.ftleAxes[0], o.ftleAxes[1], o.horizons,
+                        o.eps, o.dynamics);
+  const int m = ftleMap.numHorizons();
+  vector<float> ftle(ftleMap.size() * m);
+  parallelFor(ftleMap.size(), [&](const int worker, const long i) {
+    (void)(worker);
+    ftleMap.compute(i, &ftle[i * m]);
+  });
+
+  FILE* out = fopen(o.outFilename.c_str(), "wb");
+  if (!out) {
+    throw logic_error("Unable to open " + o.outFilename);
+  }
+  ftleMap.write(out, ftle);
+  fclose(out);
+
+  printf("FTLE of %d x %d initial conditions over %s and %s\n",
+         o.ftleAxes[0].n, o.ftleAxes[1].n,
+         FtleMap::variableName(o.ftleAxes[0].var),
+         FtleMap::variableName(o.ftleAxes[1].var));
+  for (int k = 0; k < m; ++k) {
+    double sum = 0, maximum = -1e300;
+    long count = 0;
+    for (long i = 0; i < ftleMap.size(); ++i) {
+      const float f = ftle[i * m + k];
+      if (f == f) {
+        sum += f;
+        maximum = max(maximum, (double)f);
+        ++count;
+      }
+    }
+    printf("T = %g: mean %g, max %g, %ld undefined\n", o.horizons[k],
+           count ? sum / count : 0, count ? maximum : 0,
+           ftleMap.size() - count);
+  }
+  printf("Results output to %s\n", o.outFilename.c_str());
+  return 0;
 }
@@ -0,0 +1,225 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// magphyx-merge combines the result files written by the shards of a
+// sharded ensemble run (magphyxc --ensemble file --shard k/N) into one
+// result file. Shard files are checked for consistency and merged by run
+// index. Each shard file is already sorted, so the merge streams and uses
+// memory proportional to the number of shards only.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./ResultFile.h"
+
+using namespace std;
+
+void printUsage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "\t./magphyx-merge [-o outFilename] shard0.csv shard1.csv ...\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "DESCRIPTION\n");
+  fprintf(stderr,
+          "\tMerges the result files of all shards of an ensemble run into\n"
+          "\ta single result file ordered by run. Fails if shards are\n"
+          "\tmissing, duplicated, incomplete (fewer rows than their\n"
+          "\trecords entry, e.g. from a killed run) or were run with\n"
+          "\tdifferent settings, or if runs are missing or duplicated.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "\t-o outFilename\n");
+  fprintf(stderr, "\t\tFilename to output to. Default = output to stdout.\n");
+  fprintf(stderr, "\n");
+}
+
+// Parses "k/N".
+bool parseShard(const string& s, int& k, int& N) {
+  return sscanf(s.c_str(), "%d/%d", &k, &N) == 2 && N > 0 && k >= 0 && k < N;
+}
+
+// Verifies that the shard files belong together and form a complete set.
+void checkShards(const vector<ResultFile*>& files) {
+  const ResultFile& first = *files[0];
+  int k, N;
+  if (!parseShard(first.value("shard"), k, N)) {
+    throw logic_error(first.filename() + " has no valid shard entry");
+  }
+
+  set<int> seen;
+  long numRecords = 0;
+  for (int i = 0; i < files.size(); ++i) {
+    const ResultFile& f = *files[i];
+    int fk, fN;
+    if (!parseShard(f.value("shard"), fk, fN) || fN != N) {
+      throw logic_error(f.filename() + " is not one of " +
+                        to_string(N) + " shards");
+    }
+    if (!seen.insert(fk).second) {
+      throw logic_error("shard " + to_string(fk) + " given twice");
+    }
+    // All settings other than the shard itself must match
+    const ResultFile::Header& h = f.header();
+    for (int j = 0; j < h.size(); ++j) {
+      if (h[j].first == "shard" || h[j].first == "records") continue;
+      if (first.value(h[j].first) != h[j].second) {
+        throw logic_error(f.filename() + " differs from " + first.filename() +
+                          " in " + h[j].first);
+      }
+    }
+    numRecords += atol(f.value("records").c_str());
+  }
+
+  if (seen.size() != N) {
+    string missing;
+    for (int i = 0; i < N; ++i) {
+      if (seen.find(i) == seen.end()) missing += " " + to_string(i);
+    }
+    throw logic_error("missing shards:" + missing);
+  }
+  if (numRecords != atol(first.value("ensemble_records").c_str())) {
+    throw logic_error("shards hold " + to_string(numRecords) +
+                      " runs but the ensemble has " +
+                      first.value("ensemble_records"));
+  }
+}
+
+// Reports runs first to last (inclusive) as absent from the merge.
+void reportGap(const long first, const long last) {
+  if (first == last) {
+    fprintf(stderr, "magphyx-merge: run %ld is missing\n", first);
+  } else {
+    fprintf(stderr, "magphyx-merge: runs %ld to %ld are missing\n", first,
+            last);
+  }
+}
+
+struct Row {
+  long run;
+  int file;
+  string text;
+  bool operator<(const Row& r) const {
+    // priority_queue is a max heap
+    return run > r.run;
+  }
+};
+
+int main(int argc, char** argv) {
+  string outFilename;
+  vector<string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+      outFilename = argv[++i];
+    } else {
+      filenames.push_back(argv[i]);
+    }
+  }
+  if (filenames.empty()) {
+    printUsage();
+    return 1;
+  }
+
+  vector<ResultFile*> files;
+  try {
+    for (int i = 0; i < filenames.size(); ++i) {
+      files.push_back(new ResultFile(filenames[i]));
+    }
+    checkShards(files);
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-merge: %s\n", e.what());
+    return 1;
+  }
+
+  FILE* out = outFilename.empty() ? stdout : fopen(outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "magphyx-merge: unable to open %s\n", outFilename.c_str());
+    return 1;
+  }
+
+  // writeHeader adds the format line itself
+  const ResultFile::Header& firstHeader = files[0]->header();
+  ResultFile::Header header;
+  for (int i = 0; i < firstHeader.size(); ++i) {
+    if (firstHeader[i].first != "format") {
+      header.push_back(firstHeader[i]);
+    }
+  }
+  for (int i = 0; i < header.size(); ++i) {
+    if (header[i].first == "shard") {
+      int k, N;
+      parseShard(header[i].second, k, N);
+      header[i].second = "all/" + to_string(N);
+    } else if (header[i].first == "records") {
+      header[i].second = files[0]->value("ensemble_records");
+    }
+  }
+  ResultFile::writeHeader(out, header);
+
+  // k-way merge by run index. Rows are counted per file since a shard
+  // that was killed keeps its header but has fewer rows.
+  priority_queue<Row> rows;
+  vector<long> numRows(files.size(), 0);
+  for (int i = 0; i < files.size(); ++i) {
+    Row row;
+    row.file = i;
+    if (files[i]->nextRow(row.run, row.text)) {
+      ++numRows[i];
+      rows.push(row);
+    }
+  }
+  long last = -1;
+  int status = 0;
+  while (!rows.empty()) {
+    Row row = rows.top();
+    rows.pop();
+    if (row.run == last) {
+      fprintf(stderr, "magphyx-merge: run %ld appears in more than one "
+              "shard\n", row.run);
+      status = 1;
+    } else if (row.run > last+1) {
+      reportGap(last+1, row.run-1);
+      status = 1;
+    }
+    last = row.run;
+    fprintf(out, "%s\n", row.text.c_str());
+    if (files[row.file]->nextRow(row.run, row.text)) {
+      ++numRows[row.file];
+      rows.push(row);
+    }
+  }
+  const long numRuns = atol(files[0]->value("ensemble_records").c_str());
+  if (last+1 < numRuns) {
+    reportGap(last+1, numRuns-1);
+    status = 1;
+  }
+  for (int i = 0; i < files.size(); ++i) {
+    const long expected = atol(files[i]->value("records").c_str());
+    if (numRows[i] != expected) {
+      fprintf(stderr, "magphyx-merge: %s holds %ld of its %ld runs\n",
+              files[i]->filename().c_str(), numRows[i], expected);
+      status = 1;
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  for (int i = 0; i < files.size(); ++i) {
+    delete files[i];
+  }
+  return status;
+}
@@ -0,0 +1,647 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// magphyx-query extracts rows from an event file written by magphyxc
+// (-o events.csv, including -s all) by event type, event number, time
+// and predicates on the state.
+//
+// The file is cut into blocks of rows. A sidecar index (events.csv.idx)
+// holds each block's byte range, the event types it contains and the
+// min/max of every numeric column. Blocks that cannot match are skipped
+// without being read. The index is built on the first query and rebuilt
+// when the event file changes.
+//
+// With --zoom it instead reads a window of a --pyramid directory written
+// by magphyxc -s, at about the given number of buckets.
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./MappedFile.h"
+#include "./Pyramid.h"
+
+using namespace std;
+
+// Numeric columns of an event row. Column 1, the event type, is kept
+// separately.
+const int NUM_COLUMNS = 11;
+const char* columnNames[NUM_COLUMNS] = {
+  "n", "t", "r", "theta", "phi", "pr", "ptheta", "pphi", "beta", "E", "dE"
+};
+
+void printUsage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "\t./magphyx-query [options] events.csv\n");
+  fprintf(stderr, "\t./magphyx-query --zoom width [--t a:b] [options] pyramidDir\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "DESCRIPTION\n");
+  fprintf(stderr,
+          "\tOutputs the rows of an event file that match all of the\n"
+          "\tgiven filters. Uses a block index in events.csv.idx, which is\n"
+          "\tcreated or updated as needed, to skip blocks that cannot\n"
+          "\tmatch.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "\t--type name\n");
+  fprintf(stderr, "\t\tOnly events of this type, as written in the event_type\n"
+          "\t\tcolumn, e.g. collision or \"phi = 0\". May be repeated.\n");
+  fprintf(stderr, "\t--n a:b\n");
+  fprintf(stderr, "\t\tOnly events numbered a to b inclusive. Either end may\n"
+          "\t\tbe left out.\n");
+  fprintf(stderr, "\t--t a:b\n");
+  fprintf(stderr, "\t\tOnly events with a <= t <= b. Either end may be left\n"
+          "\t\tout.\n");
+  fprintf(stderr, "\t--where predicate\n");
+  fprintf(stderr, "\t\tA comparison column op value, where column is one of\n"
+          "\t\tn t r theta phi pr ptheta pphi beta E dE and op is one of\n"
+          "\t\t< <= > >= == !=. For example \"r<1.2\". May be repeated.\n");
+  fprintf(stderr, "\t--format (csv | binary)\n");
+  fprintf(stderr, "\t\tcsv outputs the matching rows unchanged. binary outputs\n"
+          "\t\tthe header \"MAGPHYXQ\", a uint32 version (1), a uint32\n"
+          "\t\tnumber of types and the null-terminated type names, then\n"
+          "\t\tone record of 12 doubles per row: n, type index, t, r,\n"
+          "\t\ttheta, phi, pr, ptheta, pphi, beta, E, dE. Default = csv.\n");
+  fprintf(stderr, "\t--blockRows k\n");
+  fprintf(stderr, "\t\tRows per index block when the index is built.\n"
+          "\t\tDefault = 4096.\n");
+  fprintf(stderr, "\t--zoom width\n");
+  fprintf(stderr, "\t\tRead the --t window of a pyramid directory (magphyxc\n"
+          "\t\t--pyramid) instead of an event file. Outputs the buckets\n"
+          "\t\tof the finest level with at most width of them in the\n"
+          "\t\twindow: t0, t1, the number of samples and the min, max\n"
+          "\t\tand mean of r, theta, phi, pr, ptheta, pphi and E. With\n"
+          "\t\t--format binary the records are output as they are\n"
+          "\t\tstored; see Pyramid.h. Only --t, --format and -o apply.\n");
+  fprintf(stderr, "\t--stats\n");
+  fprintf(stderr, "\t\tPrint the number of blocks read and skipped to stderr.\n");
+  fprintf(stderr, "\t-o outFilename\n");
+  fprintf(stderr, "\t\tFilename to output to. Default = output to stdout.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "EXAMPLES\n");
+  fprintf(stderr, "\t./magphyx-query --type collision --t 1000:2000 events.csv\n");
+  fprintf(stderr, "\t./magphyx-query --type \"phi = 0\" --where \"pphi>0\" --format binary -o section.bin events.csv\n");
+  fprintf(stderr, "\t./magphyx-query --zoom 1920 --t 1e4:2e4 run.pyr\n");
+  fprintf(stderr, "\n");
+}
+
+//------------------------------------------------------------
+// Rows
+//------------------------------------------------------------
+
+// Splits the row [p, end) into the event type and the numeric columns.
+bool parseRow(const char* p, const char* end, string& type,
+              double values[NUM_COLUMNS]) {
+  char buf[512];
+  const size_t len = end - p;
+  if (len >= sizeof(buf)) return false;
+  memcpy(buf, p, len);
+  buf[len] = 0;
+
+  char* s = buf;
+  char* next;
+  values[0] = strtod(s, &next);
+  if (next == s || *next != ',') return false;
+  s = next+1;
+  char* comma = strchr(s, ',');
+  if (!comma) return false;
+  type.assign(s, comma - s);
+  s = comma+1;
+  for (int i = 1; i < NUM_COLUMNS; ++i) {
+    values[i] = strtod(s, &next);
+    if (next == s) return false;
+    s = next;
+    if (i < NUM_COLUMNS-1) {
+      if (*s != ',') return false;
+      ++s;
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------
+// Index
+//------------------------------------------------------------
+
+struct Block {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t numRows;
+  uint32_t reserved;
+  // Bit i is set if type i occurs in the block. Types 63 and up share
+  // bit 63.
+  uint64_t typeMask;
+  double min[NUM_COLUMNS];
+  double max[NUM_COLUMNS];
+};
+
+class Index {
+ public:
+  static const uint32_t VERSION = 2;
+
+  // Offset of the first row, after the column header line
+  uint64_t dataBegin;
+  vector<string> types;
+  vector<Block> blocks;
+
+  int typeIndex(const string& type) const {
+    for (int i = 0; i < types.size(); ++i) {
+      if (types[i] == type) return i;
+    }
+    return -1;
+  }
+
+  static uint64_t typeBit(const int i) {
+    return uint64_t(1) << (i < 63 ? i : 63);
+  }
+
+  // Scans the event file.
+  void build(const MappedFile& file, const int blockRows) {
+    const char* data = file.data();
+    const char* end = data + file.size();
+    const char* p = data;
+    const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+    if (!lineEnd || strncmp(p, "n, event_type", 13) != 0) {
+      throw logic_error("not an event file");
+    }
+    dataBegin = lineEnd+1 - data;
+    p = lineEnd+1;
+
+    Block block;
+    startBlock(block, p - data);
+    string type;
+    double values[NUM_COLUMNS];
+    while (p < end) {
+      lineEnd = (const char*)memchr(p, '\n', end - p);
+      if (!lineEnd) lineEnd = end;
+      if (lineEnd > p) {
+        if (!parseRow(p, lineEnd, type, values)) {
+          throw logic_error("malformed row at byte " + to_string(p - data));
+        }
+        int t = typeIndex(type);
+        if (t == -1) {
+          t = types.size();
+          types.push_back(type);
+        }
+        block.typeMask |= typeBit(t);
+        for (int i = 0; i < NUM_COLUMNS; ++i) {
+          block.min[i] = fmin(block.min[i], values[i]);
+          block.max[i] = fmax(block.max[i], values[i]);
+        }
+        ++block.numRows;
+      }
+      p = (lineEnd < end) ? lineEnd+1 : end;
+      if (block.numRows == blockRows) {
+        block.end = p - data;
+        blocks.push_back(block);
+        startBlock(block, p - data);
+      }
+    }
+    if (block.numRows > 0) {
+      block.end = p - data;
+      blocks.push_back(block);
+    }
+  }
+
+  // Modification time of a file in nanoseconds. Whole seconds miss an
+  // event file rewritten within the second it was indexed.
+  static int64_t modificationTime(const struct stat& st) {
+#ifdef __MAC__
+    return st.st_mtimespec.tv_sec * INT64_C(1000000000) +
+        st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * INT64_C(1000000000) + st.st_mtim.tv_nsec;
+#endif
+  }
+
+  // FNV-1a hash of the first and last 4 KB of the file, for file systems
+  // whose timestamps are coarser than a rewrite
+  static uint64_t fingerprint(const MappedFile& file) {
+    const uint64_t n = std::min<uint64_t>(4096, file.size());
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (int part = 0; part < 2; ++part) {
+      const char* p = file.data() + (part ? file.size() - n : 0);
+      for (uint64_t i = 0; i < n; ++i) {
+        h = (h ^ (unsigned char)p[i]) * UINT64_C(1099511628211);
+      }
+    }
+    return h;
+  }
+
+  // Reads an index written for an event file of the given size,
+  // modification time and fingerprint. Returns false if there is none or
+  // it is stale.
+  bool read(const string& filename, const uint64_t size, const int64_t mtime,
+            const uint64_t hash) {
+    FILE* in = fopen(filename.c_str(), "rb");
+    if (!in) return false;
+    bool ok = false;
+    char magic[8];
+    uint32_t version, numTypes;
+    uint64_t fileSize, numBlocks;
+    int64_t fileTime;
+    uint64_t fileHash;
+    if (fread(magic, 1, 8, in) == 8 && memcmp(magic, "MAGPHYXI", 8) == 0 &&
+        fread(&version, 4, 1, in) == 1 && version == VERSION &&
+        fread(&fileSize, 8, 1, in) == 1 && fileSize == size &&
+        fread(&fileTime, 8, 1, in) == 1 && fileTime == mtime &&
+        fread(&fileHash, 8, 1, in) == 1 && fileHash == hash &&
+        fread(&dataBegin, 8, 1, in) == 1 &&
+        fread(&numTypes, 4, 1, in) == 1) {
+      ok = true;
+      for (int i = 0; i < numTypes && ok; ++i) {
+        uint32_t len;
+        char buf[256];
+        ok = fread(&len, 4, 1, in) == 1 && len < sizeof(buf) &&
+            fread(buf, 1, len, in) == len;
+        if (ok) types.push_back(string(buf, len));
+      }
+      ok = ok && fread(&numBlocks, 8, 1, in) == 1;
+      if (ok) {
+        blocks.resize(numBlocks);
+        ok = fread(blocks.data(), sizeof(Block), numBlocks, in) == numBlocks;
+      }
+    }
+    fclose(in);
+    if (!ok) {
+      types.clear();
+      blocks.clear();
+    }
+    return ok;
+  }
+
+  // Writes the index. Failure is not an error since the index can always
+  // be rebuilt.
+  void write(const string& filename, const uint64_t size,
+             const int64_t mtime, const uint64_t hash) const {
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (!out) return;
+    const uint32_t version = VERSION;
+    const uint64_t numBlocks = blocks.size();
+    const uint32_t numTypes = types.size();
+    fwrite("MAGPHYXI", 1, 8, out);
+    fwrite(&version, 4, 1, out);
+    fwrite(&size, 8, 1, out);
+    fwrite(&mtime, 8, 1, out);
+    fwrite(&hash, 8, 1, out);
+    fwrite(&dataBegin, 8, 1, out);
+    fwrite(&numTypes, 4, 1, out);
+    for (int i = 0; i < types.size(); ++i) {
+      const uint32_t len = types[i].size();
+      fwrite(&len, 4, 1, out);
+      fwrite(types[i].data(), 1, len, out);
+    }
+    fwrite(&numBlocks, 8, 1, out);
+    fwrite(blocks.data(), sizeof(Block), numBlocks, out);
+    fclose(out);
+  }
+
+ private:
+  static void startBlock(Block& block, const uint64_t begin) {
+    block.begin = begin;
+    block.end = begin;
+    block.numRows = 0;
+    block.reserved = 0;
+    block.typeMask = 0;
+    for (int i = 0; i < NUM_COLUMNS; ++i) {
+      block.min[i] = INFINITY;
+      block.max[i] = -INFINITY;
+    }
+  }
+};
+
+//------------------------------------------------------------
+// Filters
+//------------------------------------------------------------
+
+struct Predicate {
+  enum Op { LT, LE, GT, GE, EQ, NE };
+  int column;
+  Op op;
+  double value;
+
+  bool matches(const double v) const {
+    switch (op) {
+      case LT: return v < value;
+      case LE: return v <= value;
+      case GT: return v > value;
+      case GE: return v >= value;
+      case EQ: return v == value;
+      default: return v != value;
+    }
+  }
+
+  // True if some value in [min, max] may match
+  bool mayMatch(const double min, const double max) const {
+    switch (op) {
+      case LT: return min < value;
+      case LE: return min <= value;
+      case GT: return max > value;
+      case GE: return max >= value;
+      case EQ: return min <= value && value <= max;
+      default: return !(min == value && max == value);
+    }
+  }
+};
+
+int columnIndex(const string& name) {
+  for (int i = 0; i < NUM_COLUMNS; ++i) {
+    if (name == columnNames[i]) return i;
+  }
+  throw logic_error("unknown column " + name);
+}
+
+// Parses "column op value", ignoring spaces.
+Predicate parsePredicate(const string& text) {
+  string s;
+  for (int i = 0; i < text.size(); ++i) {
+    if (text[i] != ' ') s += text[i];
+  }
+  const size_t opBegin = s.find_first_of("<>=!");
+  if (opBegin == string::npos || opBegin == 0) {
+    throw logic_error("illegal predicate " + text);
+  }
+  size_t opEnd = opBegin+1;
+  if (opEnd < s.size() && s[opEnd] == '=') ++opEnd;
+  const string op = s.substr(opBegin, opEnd-opBegin);
+
+  Predicate p;
+  p.column = columnIndex(s.substr(0, opBegin));
+  if (op == "<") p.op = Predicate::LT;
+  else if (op == "<=") p.op = Predicate::LE;
+  else if (op == ">") p.op = Predicate::GT;
+  else if (op == ">=") p.op = Predicate::GE;
+  else if (op == "==" || op == "=") p.op = Predicate::EQ;
+  else if (op == "!=") p.op = Predicate::NE;
+  else throw logic_error("illegal operator in " + text);
+
+  const string value = s.substr(opEnd);
+  char* end;
+  p.value = strtod(value.c_str(), &end);
+  if (value.empty() || *end != 0) {
+    throw logic_error("illegal value in " + text);
+  }
+  return p;
+}
+
+// Adds the predicates of a range "a:b" on column.
+void parseRange(const string& text, const int column,
+                vector<Predicate>& predicates) {
+  const size_t colon = text.find(':');
+  if (colon == string::npos) {
+    throw logic_error("illegal range " + text + ", expected a:b");
+  }
+  const string a = text.substr(0, colon);
+  const string b = text.substr(colon+1);
+  if (!a.empty()) {
+    predicates.push_back(parsePredicate(string(columnNames[column]) + ">=" + a));
+  }
+  if (!b.empty()) {
+    predicates.push_back(parsePredicate(string(columnNames[column]) + "<=" + b));
+  }
+}
+
+//------------------------------------------------------------
+// Pyramid windows
+//------------------------------------------------------------
+
+// Outputs the buckets of the window range ("a:b", either end may be left
+// out) of a pyramid at most width wide.
+int doZoom(const string& dir, const string& range, const int width,
+           const string& outFilename, const bool binary) {
+  double t0 = -HUGE_VAL, t1 = HUGE_VAL;
+  if (!range.empty()) {
+    const size_t colon = range.find(':');
+    if (colon == string::npos) {
+      fprintf(stderr, "magphyx-query: illegal range %s, expected a:b\n",
+              range.c_str());
+      return 1;
+    }
+    if (colon > 0) t0 = atof(range.substr(0, colon).c_str());
+    if (colon+1 < range.size()) t1 = atof(range.substr(colon+1).c_str());
+  }
+
+  FILE* out = outFilename.empty() ? stdout : fopen(outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "magphyx-query: unable to open %s\n", outFilename.c_str());
+    return 1;
+  }
+  const int N = Pyramid::NUM_VARIABLES;
+  if (!binary) {
+    fprintf(out, "t0, t1, n");
+    for (int j = 0; j < N; ++j) {
+      const char* name = Pyramid::variableName(j);
+      fprintf(out, ", %s_min, %s_max, %s_mean", name, name, name);
+    }
+    fprintf(out, "\n");
+  }
+  try {
+    const PyramidReader pyramid(dir);
+    pyramid.window(t0, t1, width, [&](const double* record) {
+      if (binary) {
+        fwrite(record, sizeof(double), Pyramid::RECORD_SIZE, out);
+        return;
+      }
+      fprintf(out, "%.17g,%.17g,%.0f", record[0], record[1], record[2]);
+      for (int j = 0; j < N; ++j) {
+        fprintf(out, ",%.17g,%.17g,%.17g", record[3+j], record[3+N+j],
+                record[3+2*N+j]);
+      }
+      fprintf(out, "\n");
+    });
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-query: %s\n", e.what());
+    if (out != stdout) fclose(out);
+    return 1;
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------
+// Main
+//------------------------------------------------------------
+
+int main(int argc, char** argv) {
+  string filename, outFilename;
+  vector<string> typeNames;
+  vector<Predicate> predicates;
+  bool binary = false;
+  bool stats = false;
+  int blockRows = 4096;
+  int zoomWidth = 0;
+  string timeRange;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const bool hasValue = (i+1 < argc);
+      if (strcmp(argv[i], "--type") == 0 && hasValue) {
+        typeNames.push_back(argv[++i]);
+      } else if (strcmp(argv[i], "--n") == 0 && hasValue) {
+        parseRange(argv[++i], 0, predicates);
+      } else if (strcmp(argv[i], "--t") == 0 && hasValue) {
+        timeRange = argv[++i];
+        parseRange(timeRange, 1, predicates);
+      } else if (strcmp(argv[i], "--where") == 0 && hasValue) {
+        predicates.push_back(parsePredicate(argv[++i]));
+      } else if (strcmp(argv[i], "--format") == 0 && hasValue) {
+        const string format = argv[++i];
+        if (format != "csv" && format != "binary") {
+          throw logic_error("illegal format " + format);
+        }
+        binary = (format == "binary");
+      } else if (strcmp(argv[i], "--blockRows") == 0 && hasValue) {
+        blockRows = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--zoom") == 0 && hasValue) {
+        zoomWidth = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--stats") == 0) {
+        stats = true;
+      } else if (strcmp(argv[i], "-o") == 0 && hasValue) {
+        outFilename = argv[++i];
+      } else if (filename.empty() && argv[i][0] != '-') {
+        filename = argv[i];
+      } else {
+        throw logic_error(string("unexpected argument ") + argv[i]);
+      }
+    }
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-query: %s\n", e.what());
+    printUsage();
+    return 1;
+  }
+  if (filename.empty()) {
+    printUsage();
+    return 1;
+  }
+  if (zoomWidth > 0) {
+    return doZoom(filename, timeRange, zoomWidth, outFilename, binary);
+  }
+
+  Index index;
+  MappedFile* file = 0;
+  try {
+    file = new MappedFile(filename);
+    struct stat st;
+    stat(filename.c_str(), &st);
+    const string indexFilename = filename + ".idx";
+    const int64_t mtime = Index::modificationTime(st);
+    const uint64_t hash = Index::fingerprint(*file);
+    if (!index.read(indexFilename, file->size(), mtime, hash)) {
+      index.build(*file, blockRows);
+      index.write(indexFilename, file->size(), mtime, hash);
+    }
+  } catch (logic_error& e) {
+    fprintf(stderr, "magphyx-query: %s: %s\n", filename.c_str(), e.what());
+    delete file;
+    return 1;
+  }
+
+  // Types that may match. Unknown names match nothing.
+  uint64_t typeMask = ~uint64_t(0);
+  vector<bool> typeWanted(index.types.size(), typeNames.empty());
+  if (!typeNames.empty()) {
+    typeMask = 0;
+    for (int i = 0; i < typeNames.size(); ++i) {
+      const int t = index.typeIndex(typeNames[i]);
+      if (t != -1) {
+        typeMask |= Index::typeBit(t);
+        typeWanted[t] = true;
+      }
+    }
+  }
+
+  FILE* out = outFilename.empty() ? stdout : fopen(outFilename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "magphyx-query: unable to open %s\n", outFilename.c_str());
+    delete file;
+    return 1;
+  }
+  if (binary) {
+    const uint32_t version = 1;
+    const uint32_t numTypes = index.types.size();
+    fwrite("MAGPHYXQ", 1, 8, out);
+    fwrite(&version, 4, 1, out);
+    fwrite(&numTypes, 4, 1, out);
+    for (int i = 0; i < index.types.size(); ++i) {
+      fwrite(index.types[i].c_str(), 1, index.types[i].size()+1, out);
+    }
+  } else {
+    fwrite(file->data(), 1, index.dataBegin, out);
+  }
+
+  long numRead = 0, numSkipped = 0, numMatches = 0;
+  string type;
+  double values[NUM_COLUMNS];
+  for (int b = 0; b < index.blocks.size(); ++b) {
+    const Block& block = index.blocks[b];
+    bool mayMatch = (block.typeMask & typeMask) != 0;
+    for (int i = 0; i < predicates.size() && mayMatch; ++i) {
+      const Predicate& p = predicates[i];
+      mayMatch = p.mayMatch(block.min[p.column], block.max[p.column]);
+    }
+    if (!mayMatch) {
+      ++numSkipped;
+      continue;
+    }
+    ++numRead;
+
+    const char* p = file->data() + block.begin;
+    const char* end = file->data() + block.end;
+    while (p < end) {
+      const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+      if (!lineEnd) lineEnd = end;
+      if (lineEnd > p && parseRow(p, lineEnd, type, values)) {
+        const int t = index.typeIndex(type);
+        bool match = typeWanted[t];
+        for (int i = 0; i < predicates.size() && match; ++i) {
+          match = predicates[i].matches(values[predicates[i].column]);
+        }
+        if (match) {
+          ++numMatches;
+          if (binary) {
+            double record[NUM_COLUMNS+1];
+            record[0] = values[0];
+            record[1] = t;
+            for (int i = 1; i < NUM_COLUMNS; ++i) {
+              record[i+1] = values[i];
+            }
+            fwrite(record, sizeof(double), NUM_COLUMNS+1, out);
+          } else {
+            fwrite(p, 1, lineEnd - p, out);
+            fputc('\n', out);
+          }
+        }
+      }
+      p = (lineEnd < end) ? lineEnd+1 : end;
+    }
+  }
+
+  if (stats) {
+    fprintf(stderr, "%ld matching rows; read %ld of %ld blocks, skipped %ld\n",
+            numMatches, numRead, (long)index.blocks.size(), numSkipped);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  delete file;
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// magphyx-ring follows the events of a magphyxc run started with --ring
+// name, reading the records from shared memory as they are written. It is
+// both a tool for piping a live run into other programs and an example
+// reader of EventRing.h.
+
+#include <errno.h>
+#include <signal.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "./EventRing.h"
+
+using namespace std;
+
+void printUsage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "\t./magphyx-ring [options] name\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "DESCRIPTION\n");
+  fprintf(stderr,
+          "\tWrites the records of the magphyxc run started with --ring\n"
+          "\tname to stdout as CSV, as they are produced, until the run\n"
+          "\tends. Columns are those of the event output, preceded by the\n"
+          "\trecord's sequence number, with n = 0 for -s states. Records\n"
+          "\toverwritten before they were read are counted on stderr.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "\t--new\n");
+  fprintf(stderr, "\t\tStart at the next record written. Default = start at the\n"
+          "\t\toldest record still in the ring.\n");
+  fprintf(stderr, "\t--passive\n");
+  fprintf(stderr, "\t\tDo not register a cursor, so that a run with --ringBlock\n"
+          "\t\tnever waits for this reader.\n");
+  fprintf(stderr, "\t--wait\n");
+  fprintf(stderr, "\t\tWait for the run to start instead of failing.\n");
+  fprintf(stderr, "\t-n count\n");
+  fprintf(stderr, "\t\tExit after count records.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "EXAMPLES\n");
+  fprintf(stderr, "\t./magphyxc -i 1.5 0 90 0 0 0 --ring live -o events.csv &\n");
+  fprintf(stderr, "\t./magphyx-ring live | ./plot\n");
+  fprintf(stderr, "\n");
+}
+
+bool alive(const long pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+int main(int argc, char** argv) {
+  string name;
+  bool fromStart = true;
+  bool registered = true;
+  bool wait = false;
+  long count = -1;
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = (i+1 < argc);
+    if (strcmp(argv[i], "--new") == 0) {
+      fromStart = false;
+    } else if (strcmp(argv[i], "--passive") == 0) {
+      registered = false;
+    } else if (strcmp(argv[i], "--wait") == 0) {
+      wait = true;
+    } else if (strcmp(argv[i], "-n") == 0 && hasValue) {
+      count = atol(argv[++i]);
+    } else if (argv[i][0] == '-' || !name.empty()) {
+      printUsage();
+      return 1;
+    } else {
+      name = argv[i];
+    }
+  }
+  if (name.empty()) {
+    printUsage();
+    return 1;
+  }
+
+  unique_ptr<EventRingReader> reader;
+  while (!reader) {
+    try {
+      reader.reset(new EventRingReader(name, fromStart, registered));
+    } catch (logic_error& e) {
+      if (!wait) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+      }
+      this_thread::sleep_for(chrono::milliseconds(100));
+    }
+  }
+
+  printf("seq, n, event_type, t, r, theta, phi, pr, ptheta, pphi, E, dE\n");
+  long numRead = 0;
+  int idle = 0;
+  while (count < 0 || numRead < count) {
+    const EventRing::Record* r = 0;
+    EventRing::Record copy;
+    // Records of a registered reader of a blocking ring are read in place
+    if (registered && reader->policy() == EventRing::BLOCK) {
+      r = reader->peek();
+    } else if (reader->next(copy)) {
+      r = &copy;
+    }
+    if (!r) {
+      if (reader->done()) break;
+      // A run that crashed never closes its ring
+      if (++idle % 10000 == 0 && !alive(reader->pid())) break;
+      this_thread::sleep_for(chrono::microseconds(100));
+      continue;
+    }
+    idle = 0;
+    printf("%llu,%d,%s,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%.2e\n",
+           (unsigned long long)r->seq, r->n, reader->typeName(r->type),
+           r->t, r->y[0], r->y[1] * 180 / M_PI, r->y[2] * 180 / M_PI,
+           r->y[3], r->y[4], r->y[5], r->E, r->dE);
+    if (r != &copy) {
+      reader->advance();
+    }
+    ++numRead;
+  }
+  fflush(stdout);
+  if (reader->lost() > 0) {
+    fprintf(stderr, "%llu records were overwritten before they were read\n",
+            (unsigned long long)reader->lost());
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// magphyx-top shows the live counters of running magphyxc processes that
+// were started with --metrics name. It only reads the shared memory, so
+// watching a run never slows it down. Step rates are measured between
+// refreshes.
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./LiveMetrics.h"
+
+using namespace std;
+
+void printUsage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "\t./magphyx-top [options] [name ...]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "DESCRIPTION\n");
+  fprintf(stderr,
+          "\tShows the live counters of the magphyxc runs started with\n"
+          "\t--metrics name: per worker the state, ensemble record, steps,\n"
+          "\tevents, simulated time, step size, dE and steps per second.\n"
+          "\tWithout names, every run on this machine is shown.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "\t-i seconds\n");
+  fprintf(stderr, "\t\tRefresh interval. Default = 1.\n");
+  fprintf(stderr, "\t-n count\n");
+  fprintf(stderr, "\t\tExit after count refreshes. With -n 1 the screen is not\n"
+          "\t\tcleared and no rates are shown, for logs. Default = until\n"
+          "\t\tinterrupted.\n");
+  fprintf(stderr, "\t--clean\n");
+  fprintf(stderr, "\t\tRemove the segments left by runs that crashed and exit.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "EXAMPLES\n");
+  fprintf(stderr, "\t./magphyxc --ensemble ics.txt --threads 8 --metrics job1 -o out.csv &\n");
+  fprintf(stderr, "\t./magphyx-top job1\n");
+  fprintf(stderr, "\n");
+}
+
+// Names of all segments, from the shared memory file system
+vector<string> findAll() {
+  vector<string> names;
+  DIR* dir = opendir("/dev/shm");
+  if (!dir) return names;
+  while (struct dirent* e = readdir(dir)) {
+    if (strncmp(e->d_name, "magphyx-", 8) == 0) {
+      names.push_back(e->d_name + 8);
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+bool alive(const long pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+const char* stateName(const int state) {
+  switch (state) {
+    case LiveMetrics::RUNNING: return "running";
+    case LiveMetrics::DONE: return "done";
+    default: return "idle";
+  }
+}
+
+// Last snapshot of a worker, for its step rate
+struct Previous {
+  LiveMetrics::Snapshot s;
+  double time;
+};
+
+void show(const string& name, const LiveMetrics& metrics,
+          map<string, Previous>& previous, const bool rates) {
+  const LiveMetrics::Header& h = metrics.header();
+  const double now = LiveMetrics::now();
+  long runs = 0;
+  vector<LiveMetrics::Snapshot> slots(metrics.numWorkers());
+  vector<bool> ok(metrics.numWorkers());
+  for (int i = 0; i < metrics.numWorkers(); ++i) {
+    ok[i] = metrics.slot(i).read(slots[i]);
+    runs += slots[i].runs;
+  }
+  printf("%s  pid %ld%s  up %.0f s", name.c_str(), (long)h.pid,
+         alive(h.pid) ? "" : " (exited)", now - h.startTime);
+  if (h.numRecords > 0) {
+    printf("  runs %ld of %ld", runs, (long)h.numRecords);
+  }
+  printf("\n");
+  printf("%7s %8s %8s %12s %10s %12s %10s %10s %10s\n", "worker", "state",
+         "record", "steps", "events", "t", "h", "dE", "steps/s");
+  for (int i = 0; i < metrics.numWorkers(); ++i) {
+    const LiveMetrics::Snapshot& s = slots[i];
+    if (!ok[i]) {
+      printf("%7d %8s\n", i, "?");
+      continue;
+    }
+    char rate[32] = "";
+    const string key = name + "/" + to_string(i);
+    map<string, Previous>::const_iterator it = previous.find(key);
+    if (rates && it != previous.end() && s.state == LiveMetrics::RUNNING &&
+        it->second.s.record == s.record && it->second.s.runs == s.runs &&
+        now > it->second.time) {
+      snprintf(rate, sizeof(rate), "%.3g",
+               (s.steps - it->second.s.steps) / (now - it->second.time));
+    }
+    Previous p = { s, now };
+    previous[key] = p;
+    char record[32] = "-";
+    if (s.record >= 0) {
+      snprintf(record, sizeof(record), "%ld", s.record);
+    }
+    printf("%7d %8s %8s %12ld %10ld %12.6g %10.3g %10.3g %10s\n", i,
+           stateName(s.state), record, s.steps, s.events, s.t, s.h, s.dE,
+           rate);
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  vector<string> names;
+  double interval = 1;
+  long count = -1;
+  bool clean = false;
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = (i+1 < argc);
+    if (strcmp(argv[i], "-i") == 0 && hasValue) {
+      interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && hasValue) {
+      count = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--clean") == 0) {
+      clean = true;
+    } else if (argv[i][0] == '-') {
+      printUsage();
+      return 1;
+    } else {
+      names.push_back(argv[i]);
+    }
+  }
+
+  if (clean) {
+    const vector<string> all = names.empty() ? findAll() : names;
+    for (int i = 0; i < all.size(); ++i) {
+      try {
+        const LiveMetrics metrics(all[i]);
+        if (alive(metrics.header().pid)) continue;
+      } catch (logic_error& e) {
+        // Unreadable segments are left alone
+        continue;
+      }
+      shm_unlink(LiveMetrics::path(all[i]).c_str());
+      printf("Removed %s\n", LiveMetrics::path(all[i]).c_str());
+    }
+    return 0;
+  }
+
+  const bool clear = (count != 1 && isatty(STDOUT_FILENO));
+  map<string, Previous> previous;
+  for (long k = 0; count < 0 || k < count; ++k) {
+    if (k > 0) {
+      this_thread::sleep_for(chrono::duration<double>(interval));
+    }
+    const vector<string> current = names.empty() ? findAll() : names;
+    if (clear) {
+      printf("\033[H\033[2J");
+    }
+    if (current.empty()) {
+      printf("No runs with --metrics\n");
+    }
+    for (int i = 0; i < current.size(); ++i) {
+      try {
+        const LiveMetrics metrics(current[i]);
+        show(current[i], metrics, previous, k > 0);
+      } catch (logic_error& e) {
+        // The run may have just ended
+        printf("%s: %s\n\n", current[i].c_str(), e.what());
+      }
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
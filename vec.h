@@ -17,6 +17,15 @@
 #include <cmath>
 #include <iostream>
 
+// SSE2 is always available on x86-64. AVX is used when compiling for a
+// CPU that has it, e.g. with -march=native (MAGPHYX_NATIVE in cmake).
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
 //------------------------------------------------------------
 // Define our own type
 //------------------------------------------------------------
@@ -500,6 +509,21 @@ inline double3 mult(const double c, const double3 a) {
   for (int i = 0; i < 3; i++) result[i] = a.s[i]*c;
   return result;
 }
+#if defined(__SSE2__)
+inline double2 mult(const double2 a, const double2 b) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_mul_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s)));
+  return result;
+}
+inline double2 mult(const double2 a, const double c) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_mul_pd(_mm_loadu_pd(a.s), _mm_set1_pd(c)));
+  return result;
+}
+inline double2 mult(const double c, const double2 a) {
+  return mult(a, c);
+}
+#else
 inline double2 mult(const double2 a, const double2 b) {
   double2 result;
   for (int i = 0; i < 2; i++) result[i] = a.s[i]*b.s[i];
@@ -515,6 +539,7 @@ inline double2 mult(const double c, const double2 a) {
   for (int i = 0; i < 2; i++) result[i] = a.s[i]*c;
   return result;
 }
+#endif
 //------------------------------------------------------------
 // add
 inline double3 add(const double3 a, const double3 b) {
@@ -527,6 +552,18 @@ inline double3 add(const double3 a, const double c) {
   for (int i = 0; i < 3; i++) result[i] = a.s[i]+c;
   return result;
 }
+#if defined(__SSE2__)
+inline double2 add(const double2 a, const double2 b) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_add_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s)));
+  return result;
+}
+inline double2 add(const double2 a, const double c) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_add_pd(_mm_loadu_pd(a.s), _mm_set1_pd(c)));
+  return result;
+}
+#else
 inline double2 add(const double2 a, const double2 b) {
   double2 result;
   for (int i = 0; i < 2; i++) result[i] = a.s[i]+b.s[i];
@@ -537,6 +574,7 @@ inline double2 add(const double2 a, const double c) {
   for (int i = 0; i < 2; i++) result[i] = a.s[i]+c;
   return result;
 }
+#endif
 //------------------------------------------------------------
 // subtract
 inline double3 subtract(const double3 a, const double3 b) {
@@ -549,6 +587,18 @@ inline double3 subtract(const double3 a, const double c) {
   for (int i = 0; i < 3; i++) result[i] = a.s[i]-c;
   return result;
 }
+#if defined(__SSE2__)
+inline double2 subtract(const double2 a, const double2 b) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_sub_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s)));
+  return result;
+}
+inline double2 subtract(const double2 a, const double c) {
+  double2 result;
+  _mm_storeu_pd(result.s, _mm_sub_pd(_mm_loadu_pd(a.s), _mm_set1_pd(c)));
+  return result;
+}
+#else
 inline double2 subtract(const double2 a, const double2 b) {
   double2 result;
   for (int i = 0; i < 2; i++) result[i] = a.s[i]-b.s[i];
@@ -559,6 +609,7 @@ inline double2 subtract(const double2 a, const double c) {
   for (int i = 0; i < 2; i++) result[i] = a.s[i]-c;
   return result;
 }
+#endif
 //------------------------------------------------------------
 // dot
 inline double dot(const double3 a, const double3 b) {
@@ -571,11 +622,18 @@ inline float dot(const float3 a, const float3 b) {
   for (int i = 0; i < 3; i++) result += a.s[i]*b.s[i];
   return result;
 }
+#if defined(__SSE2__)
+inline double dot(const double2 a, const double2 b) {
+  const __m128d m = _mm_mul_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s));
+  return _mm_cvtsd_f64(_mm_add_sd(m, _mm_unpackhi_pd(m, m)));
+}
+#else
 inline double dot(const double2 a, const double2 b) {
   double result = 0;
   for (int i = 0; i < 2; i++) result += a.s[i]*b.s[i];
   return result;
 }
+#endif
 inline float dot(const float2 a, const float2 b) {
   float result = 0;
   for (int i = 0; i < 2; i++) result += a.s[i]*b.s[i];
@@ -688,4 +746,262 @@ VEC_CROSS_VEC(int3)
 VEC_CROSS_VEC(float3)
 VEC_CROSS_VEC(double3)
 
+//------------------------------------------------------------
+// double4
+//------------------------------------------------------------
+// With AVX each operation is a single instruction; otherwise it is two
+// SSE2 instructions. dot sums pairwise: (x+y)+(z+w).
+#if defined(__AVX__)
+#define VEC4_BINARY_OP(name, op)                                       \
+  inline double4 name(const double4 a, const double4 b) {              \
+    double4 result;                                                    \
+    _mm256_storeu_pd(result.s, op(_mm256_loadu_pd(a.s),                \
+                                  _mm256_loadu_pd(b.s)));              \
+    return result;                                                     \
+  }                                                                    \
+  inline double4 name(const double4 a, const double c) {               \
+    double4 result;                                                    \
+    _mm256_storeu_pd(result.s, op(_mm256_loadu_pd(a.s),                \
+                                  _mm256_set1_pd(c)));                 \
+    return result;                                                     \
+  }
+VEC4_BINARY_OP(mult, _mm256_mul_pd)
+VEC4_BINARY_OP(add, _mm256_add_pd)
+VEC4_BINARY_OP(subtract, _mm256_sub_pd)
+inline double dot(const double4 a, const double4 b) {
+  const __m256d m = _mm256_mul_pd(_mm256_loadu_pd(a.s), _mm256_loadu_pd(b.s));
+  const __m128d s = _mm_add_pd(_mm256_castpd256_pd128(m),
+                               _mm256_extractf128_pd(m, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+#elif defined(__SSE2__)
+#define VEC4_BINARY_OP(name, op)                                       \
+  inline double4 name(const double4 a, const double4 b) {              \
+    double4 result;                                                    \
+    _mm_storeu_pd(result.s, op(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s))); \
+    _mm_storeu_pd(result.s+2, op(_mm_loadu_pd(a.s+2),                  \
+                                 _mm_loadu_pd(b.s+2)));                \
+    return result;                                                     \
+  }                                                                    \
+  inline double4 name(const double4 a, const double c) {               \
+    double4 result;                                                    \
+    const __m128d cc = _mm_set1_pd(c);                                 \
+    _mm_storeu_pd(result.s, op(_mm_loadu_pd(a.s), cc));                \
+    _mm_storeu_pd(result.s+2, op(_mm_loadu_pd(a.s+2), cc));            \
+    return result;                                                     \
+  }
+VEC4_BINARY_OP(mult, _mm_mul_pd)
+VEC4_BINARY_OP(add, _mm_add_pd)
+VEC4_BINARY_OP(subtract, _mm_sub_pd)
+inline double dot(const double4 a, const double4 b) {
+  const __m128d s = _mm_add_pd(
+      _mm_mul_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s)),
+      _mm_mul_pd(_mm_loadu_pd(a.s+2), _mm_loadu_pd(b.s+2)));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+#else
+#define VEC4_BINARY_OP(name, op)                                       \
+  inline double4 name(const double4 a, const double4 b) {              \
+    double4 result;                                                    \
+    for (int i = 0; i < 4; i++) result[i] = a.s[i] op b.s[i];          \
+    return result;                                                     \
+  }                                                                    \
+  inline double4 name(const double4 a, const double c) {               \
+    double4 result;                                                    \
+    for (int i = 0; i < 4; i++) result[i] = a.s[i] op c;               \
+    return result;                                                     \
+  }
+VEC4_BINARY_OP(mult, *)
+VEC4_BINARY_OP(add, +)
+VEC4_BINARY_OP(subtract, -)
+inline double dot(const double4 a, const double4 b) {
+  return (a.s[0]*b.s[0] + a.s[1]*b.s[1]) + (a.s[2]*b.s[2] + a.s[3]*b.s[3]);
+}
+#endif
+#undef VEC4_BINARY_OP
+inline double4 mult(const double c, const double4 a) {
+  return mult(a, c);
+}
+inline double length2(const double4 v) {
+  return dot(v, v);
+}
+inline double length(const double4 v) {
+  return sqrt(length2(v));
+}
+inline double4 normalize(const double4 v) {
+  return mult(v, 1 / length(v));
+}
+
+//------------------------------------------------------------
+// double3a
+//------------------------------------------------------------
+// A double3 padded to four lanes so that it fills one AVX register (or two
+// SSE2 registers). w is kept 0, so whole-register operations give the same
+// x, y, z as the double3 versions, and dot is exactly dot(double3, double3).
+// It is only declared 16-byte aligned: std::vector does not honor larger
+// alignments before C++17, and with alignas(32) the compiler would copy
+// vector elements with aligned AVX moves that fault. Loads are unaligned;
+// on 32-byte aligned data they are as fast as aligned loads.
+union alignas(16) double3a {
+  struct { double s[4]; };
+  struct { double x, y, z, w; };
+  double operator[](int i) const { return s[i]; }
+  double& operator[](int i) { return s[i]; }
+};
+
+inline double3a make_double3a(double x = 0, double y = 0, double z = 0) {
+  double3a v;
+  v.x = x;
+  v.y = y;
+  v.z = z;
+  v.w = 0;
+  return v;
+}
+inline double3a make_double3a(const double3& a) {
+  return make_double3a(a.s[0], a.s[1], a.s[2]);
+}
+inline double3 make_double3(const double3a& a) {
+  return make_double3(a.s[0], a.s[1], a.s[2]);
+}
+inline std::ostream& operator<<(std::ostream& out, const double3a& v) {
+  return out << v.s[0] << " " << v.s[1] << " " << v.s[2];
+}
+
+#if defined(__AVX__)
+inline __m256d load(const double3a& a) { return _mm256_loadu_pd(a.s); }
+inline void store(double3a& a, const __m256d v) { _mm256_storeu_pd(a.s, v); }
+inline __m256d splat(const double c) {
+  // Zero in the w lane keeps w = 0 under multiplication
+  return _mm256_set_pd(0, c, c, c);
+}
+#define VEC3A_OP(name, op) \
+  inline double3a name(const double3a& a, const double3a& b) {           \
+    double3a result;                                                   \
+    store(result, op(load(a), load(b)));                               \
+    return result;                                                     \
+  }
+VEC3A_OP(mult, _mm256_mul_pd)
+VEC3A_OP(add, _mm256_add_pd)
+VEC3A_OP(subtract, _mm256_sub_pd)
+#undef VEC3A_OP
+inline double3a mult(const double3a& a, const double c) {
+  double3a result;
+  store(result, _mm256_mul_pd(load(a), splat(c)));
+  return result;
+}
+inline double dot(const double3a& a, const double3a& b) {
+  const __m256d m = _mm256_mul_pd(load(a), load(b));
+  const __m128d lo = _mm256_castpd256_pd128(m);
+  const __m128d hi = _mm256_extractf128_pd(m, 1);
+  // (x + y) + z, as in dot(double3, double3)
+  return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)),
+                                  hi));
+}
+#elif defined(__SSE2__)
+#define VEC3A_OP(name, op) \
+  inline double3a name(const double3a& a, const double3a& b) {           \
+    double3a result;                                                   \
+    _mm_storeu_pd(result.s, op(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s))); \
+    _mm_storeu_pd(result.s+2, op(_mm_loadu_pd(a.s+2),                  \
+                                 _mm_loadu_pd(b.s+2)));                \
+    return result;                                                     \
+  }
+VEC3A_OP(mult, _mm_mul_pd)
+VEC3A_OP(add, _mm_add_pd)
+VEC3A_OP(subtract, _mm_sub_pd)
+#undef VEC3A_OP
+inline double3a mult(const double3a& a, const double c) {
+  double3a result;
+  _mm_storeu_pd(result.s, _mm_mul_pd(_mm_loadu_pd(a.s), _mm_set1_pd(c)));
+  _mm_storeu_pd(result.s+2, _mm_mul_pd(_mm_loadu_pd(a.s+2),
+                                       _mm_set_pd(0, c)));
+  return result;
+}
+inline double dot(const double3a& a, const double3a& b) {
+  const __m128d lo = _mm_mul_pd(_mm_loadu_pd(a.s), _mm_loadu_pd(b.s));
+  const __m128d hi = _mm_mul_sd(_mm_load_sd(a.s+2), _mm_load_sd(b.s+2));
+  // (x + y) + z, as in dot(double3, double3)
+  return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)),
+                                  hi));
+}
+#else
+inline double3a mult(const double3a& a, const double3a& b) {
+  double3a result;
+  for (int i = 0; i < 4; i++) result[i] = a.s[i]*b.s[i];
+  return result;
+}
+inline double3a add(const double3a& a, const double3a& b) {
+  double3a result;
+  for (int i = 0; i < 4; i++) result[i] = a.s[i]+b.s[i];
+  return result;
+}
+inline double3a subtract(const double3a& a, const double3a& b) {
+  double3a result;
+  for (int i = 0; i < 4; i++) result[i] = a.s[i]-b.s[i];
+  return result;
+}
+inline double3a mult(const double3a& a, const double c) {
+  double3a result;
+  for (int i = 0; i < 3; i++) result[i] = a.s[i]*c;
+  result.w = 0;
+  return result;
+}
+inline double dot(const double3a& a, const double3a& b) {
+  return a.s[0]*b.s[0] + a.s[1]*b.s[1] + a.s[2]*b.s[2];
+}
+#endif
+inline double3a mult(const double c, const double3a& a) {
+  return mult(a, c);
+}
+inline double length2(const double3a& v) {
+  return dot(v, v);
+}
+inline double length(const double3a& v) {
+  return sqrt(length2(v));
+}
+inline double3a normalize(const double3a& v) {
+  return mult(v, 1 / length(v));
+}
+inline double3a cross(const double3a& a, const double3a& b) {
+  return make_double3a(a.s[1]*b.s[2]-a.s[2]*b.s[1],
+                       a.s[2]*b.s[0]-a.s[0]*b.s[2],
+                       a.s[0]*b.s[1]-a.s[1]*b.s[0]);
+}
+
+//------------------------------------------------------------
+// Batch operations on arrays of n vectors
+//------------------------------------------------------------
+// out may alias a or b.
+#define VEC_BATCH(typen)                                                \
+  inline void add(const typen* a, const typen* b, typen* out,           \
+                  const int n) {                                        \
+    for (int i = 0; i < n; ++i) out[i] = add(a[i], b[i]);               \
+  }                                                                     \
+  inline void subtract(const typen* a, const typen* b, typen* out,      \
+                       const int n) {                                   \
+    for (int i = 0; i < n; ++i) out[i] = subtract(a[i], b[i]);          \
+  }                                                                     \
+  inline void mult(const typen* a, const typen* b, typen* out,          \
+                   const int n) {                                       \
+    for (int i = 0; i < n; ++i) out[i] = mult(a[i], b[i]);              \
+  }                                                                     \
+  inline void mult(const typen* a, const double c, typen* out,          \
+                   const int n) {                                       \
+    for (int i = 0; i < n; ++i) out[i] = mult(a[i], c);                 \
+  }                                                                     \
+  inline void dot(const typen* a, const typen* b, double* out,          \
+                  const int n) {                                        \
+    for (int i = 0; i < n; ++i) out[i] = dot(a[i], b[i]);               \
+  }                                                                     \
+  inline void length(const typen* a, double* out, const int n) {        \
+    for (int i = 0; i < n; ++i) out[i] = length(a[i]);                  \
+  }                                                                     \
+  inline void normalize(const typen* a, typen* out, const int n) {      \
+    for (int i = 0; i < n; ++i) out[i] = normalize(a[i]);               \
+  }
+VEC_BATCH(double2)
+VEC_BATCH(double3a)
+VEC_BATCH(double4)
+#undef VEC_BATCH
+
 #endif
@@ -0,0 +1,194 @@
+/*******************************************************
+ ** MagPhyx Project                                   **
+ ** Copyright (c) 2016 John Martin Edwards            **
+ ** Idaho State University                            **
+ **                                                   **
+ ** For information about this project contact        **
+ ** John Edwards at                                   **
+ **    edwajohn@isu.edu                               **
+ ** or visit                                          **
+ **    http://www2.cose.isu.edu/~edwajohn/            **
+ *******************************************************/
+
+// Checks the SSE2/AVX paths of vec.h and the batched Dipole::B against
+// plain scalar loops, for single vectors and for batches of every length
+// up to a few registers, on aligned and unaligned storage. Run by ctest;
+// exits nonzero on the first mismatch.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "./Dipole.h"
+#include "./vec.h"
+
+using namespace std;
+
+static int failures = 0;
+static mt19937_64 rng(1);
+
+static double rnd() {
+  return uniform_real_distribution<double>(-10, 10)(rng);
+}
+
+// Elementwise operations must match exactly (scale 0). Sums (dot, length)
+// may be reassociated across lanes, so they get a few ulps of scale, the
+// sum of the magnitudes of the terms.
+static void check(const char* what, const int n, const int i,
+                  const double got, const double want, const double scale) {
+  if (fabs(got - want) > 1e-15 * scale || got != got) {
+    if (failures < 20) {
+      fprintf(stderr, "%s (n = %d, i = %d): %.17g != %.17g\n", what, n, i,
+              got, want);
+    }
+    ++failures;
+  }
+}
+
+// Vectors of type V with D lanes in use, stored at a byte offset from an
+// aligned buffer so that unaligned loads are exercised.
+template <typename V, int D>
+struct Batch {
+  Batch(const int n, const size_t offset)
+      : _buf(sizeof(V) * (n + 1) + 64), _n(n) {
+    char* base = (char*)(((uintptr_t)_buf.data() + 63) & ~(uintptr_t)63);
+    _v = (V*)(base + offset);
+    for (int i = 0; i < n; ++i) {
+      memset(&_v[i], 0, sizeof(V));
+      for (int k = 0; k < D; ++k) _v[i].s[k] = rnd();
+    }
+  }
+  V& operator[](const int i) { return _v[i]; }
+  V* data() { return _v; }
+
+  std::vector<char> _buf;
+  int _n;
+  V* _v;
+};
+
+template <typename V, int D>
+void testType(const char* name, const size_t offset) {
+  char what[64];
+  for (int n = 0; n <= 11; ++n) {
+    Batch<V, D> a(n, offset), b(n, offset), out(n, offset);
+    std::vector<double> s(n);
+    const double c = rnd();
+
+    add(a.data(), b.data(), out.data(), n);
+    snprintf(what, sizeof(what), "%s add", name);
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < D; ++k) {
+        check(what, n, i, out[i].s[k], a[i].s[k] + b[i].s[k], 0);
+      }
+    }
+    subtract(a.data(), b.data(), out.data(), n);
+    snprintf(what, sizeof(what), "%s subtract", name);
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < D; ++k) {
+        check(what, n, i, out[i].s[k], a[i].s[k] - b[i].s[k], 0);
+      }
+    }
+    mult(a.data(), b.data(), out.data(), n);
+    snprintf(what, sizeof(what), "%s mult", name);
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < D; ++k) {
+        check(what, n, i, out[i].s[k], a[i].s[k] * b[i].s[k], 0);
+      }
+    }
+    mult(a.data(), c, out.data(), n);
+    snprintf(what, sizeof(what), "%s mult scalar", name);
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < D; ++k) {
+        check(what, n, i, out[i].s[k], a[i].s[k] * c, 0);
+      }
+    }
+    dot(a.data(), b.data(), s.data(), n);
+    snprintf(what, sizeof(what), "%s dot", name);
+    for (int i = 0; i < n; ++i) {
+      double want = 0, scale = 0;
+      for (int k = 0; k < D; ++k) {
+        want += a[i].s[k] * b[i].s[k];
+        scale += fabs(a[i].s[k] * b[i].s[k]);
+      }
+      check(what, n, i, s[i], want, scale);
+    }
+    length(a.data(), s.data(), n);
+    snprintf(what, sizeof(what), "%s length", name);
+    for (int i = 0; i < n; ++i) {
+      double want = 0;
+      for (int k = 0; k < D; ++k) want += a[i].s[k] * a[i].s[k];
+      check(what, n, i, s[i], sqrt(want), sqrt(want));
+    }
+    normalize(a.data(), out.data(), n);
+    snprintf(what, sizeof(what), "%s normalize", name);
+    for (int i = 0; i < n; ++i) {
+      double l = 0;
+      for (int k = 0; k < D; ++k) l += a[i].s[k] * a[i].s[k];
+      l = sqrt(l);
+      for (int k = 0; k < D; ++k) {
+        check(what, n, i, out[i].s[k], a[i].s[k] / l, 1);
+      }
+    }
+  }
+}
+
+// double3a must give the same results as double3, and keep w at 0.
+void testDouble3a() {
+  for (int i = 0; i < 10000; ++i) {
+    const double3 a = make_double3(rnd(), rnd(), rnd());
+    const double3 b = make_double3(rnd(), rnd(), rnd());
+    const double c = rnd();
+    const double3a aa = make_double3a(a);
+    const double3a ba = make_double3a(b);
+    const double3 sums[4] = { add(a, b), subtract(a, b), mult(a, b),
+                              mult(a, c) };
+    const double3a sumsa[4] = { add(aa, ba), subtract(aa, ba), mult(aa, ba),
+                                mult(aa, c) };
+    for (int j = 0; j < 4; ++j) {
+      for (int k = 0; k < 3; ++k) {
+        check("double3a vs double3", 1, i, sumsa[j].s[k], sums[j].s[k], 0);
+      }
+      check("double3a w", 1, i, sumsa[j].s[3], 0, 0);
+    }
+    check("double3a dot vs double3", 1, i, dot(aa, ba), dot(a, b), 0);
+  }
+}
+
+// The batched field against the scalar one, over batch lengths that leave
+// every remainder.
+void testField() {
+  for (int n = 0; n <= 11; ++n) {
+    std::vector<double3a> p(n), out(n);
+    for (int i = 0; i < n; ++i) p[i] = make_double3a(rnd(), rnd(), rnd());
+    Dipole::B(p.data(), out.data(), n);
+    for (int i = 0; i < n; ++i) {
+      const double3 want = Dipole::B(make_double3(p[i]));
+      for (int k = 0; k < 3; ++k) {
+        check("Dipole::B batch", n, i, out[i].s[k], want.s[k],
+              length(want));
+      }
+    }
+  }
+}
+
+int main() {
+  for (size_t offset = 0; offset < 32; offset += 8) {
+    testType<double2, 2>("double2", offset);
+    testType<double4, 4>("double4", offset);
+  }
+  // double3a is declared 16-byte aligned, which is all std::vector gives
+  // it before C++17.
+  for (size_t offset = 0; offset < 32; offset += 16) {
+    testType<double3a, 3>("double3a", offset);
+  }
+  testDouble3a();
+  testField();
+  if (failures > 0) {
+    fprintf(stderr, "%d mismatches\n", failures);
+    return 1;
+  }
+  printf("vec.h SIMD paths match the scalar versions\n");
+  return 0;
+}